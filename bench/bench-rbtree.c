@@ -0,0 +1,503 @@
+#include <rbtree.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  rbtree 연산별 처리량과 지연 시간을 잰다.
+
+    bench-rbtree [--sizes 1000,100000] [--workloads random,sequential,zipf,mixed]
+                 [--ops N] [--format csv|json] [--seed S]
+    bench-rbtree --compare old.csv new.csv   (CSV와 JSON Lines 결과를 섞어 넘겨도 된다)
+
+  (크기, workload)마다 fork한 process에서 insert, find와 find_batch(또는 mixed), min, max, to_array, to_array_parallel, erase 순서로 돌리고
+  연산마다 한 줄씩 CSV나 JSON Lines로 출력한다. peak RSS는 그 process의 최대치이다.
+  한 단계에서 재는 연산은 최대 --ops개이고(insert는 tree 크기만큼), 지연 시간은 그중 최대 BENCH_MAX_SAMPLES개를 골라 잰다.
+*/
+#define BENCH_MAX_SAMPLES 200000
+#define BENCH_DEFAULT_OPS 1000000
+#define BENCH_ZIPF_THETA 0.99
+#define BENCH_FIND_BATCH 64  // find_batch 한 번에 넘기는 key 수
+#define BENCH_CSV_HEADER "size,workload,op,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb"
+
+typedef enum { WORKLOAD_RANDOM, WORKLOAD_SEQUENTIAL, WORKLOAD_ZIPF, WORKLOAD_MIXED } workload_t;
+
+static const char *workload_names[] = {"random", "sequential", "zipf", "mixed"};
+
+typedef struct {
+  size_t sizes[16];
+  size_t size_count;
+  int workloads[4];
+  size_t workload_count;
+  size_t max_ops;
+  int json;
+  uint64_t seed;
+} bench_config;
+
+typedef struct {
+  uint64_t *samples;
+  size_t count;
+  size_t stride;  // stride번째 연산마다 하나씩 잰다
+  size_t ops;
+  uint64_t start_ns;
+} bench_timer;
+
+typedef struct {
+  double zetan, alpha, eta, theta;
+  size_t n;
+} zipf_gen;
+
+static uint64_t rng_state;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// splitmix64
+static uint64_t next_random(void) {
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// 32bit 위의 전단사 함수. i가 다르면 key도 달라서 random workload에도 중복 key가 없다.
+static key_t mix_key(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return (key_t)x;
+}
+
+// i번째로 넣는 key
+static key_t key_of(const workload_t workload, const size_t i) {
+  return (workload == WORKLOAD_SEQUENTIAL) ? (key_t)i : mix_key((uint32_t)i);
+}
+
+// YCSB의 Zipfian generator. 0이 가장 자주 나온다.
+static void zipf_init(zipf_gen *z, const size_t n, const double theta) {
+  double zeta2 = 0;
+  z->zetan = 0;
+  for (size_t i = 1; i <= n; i++) {
+    z->zetan += 1.0 / pow((double)i, theta);
+    if (i == 2) {
+      zeta2 = z->zetan;
+    }
+  }
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  z->eta = (n < 2) ? 0 : (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static size_t zipf_next(const zipf_gen *z) {
+  const double u = (double)(next_random() >> 11) / (double)(1ull << 53);
+  const double uz = u * z->zetan;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, z->theta)) {
+    return 1 % z->n;
+  }
+  const size_t rank = (size_t)((double)z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return (rank >= z->n) ? z->n - 1 : rank;
+}
+
+static void timer_start(bench_timer *timer, const size_t ops) {
+  timer->ops = ops;
+  timer->count = 0;
+  timer->stride = (ops + BENCH_MAX_SAMPLES - 1) / BENCH_MAX_SAMPLES;
+  if (timer->stride == 0) {
+    timer->stride = 1;
+  }
+  timer->start_ns = now_ns();
+}
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const bench_timer *timer, const double p) {
+  if (timer->count == 0) {
+    return 0;
+  }
+  size_t index = (size_t)(p * (double)timer->count);
+  return timer->samples[(index >= timer->count) ? timer->count - 1 : index];
+}
+
+static void timer_report(bench_timer *timer, const bench_config *config, const size_t size,
+                         const workload_t workload, const char *op) {
+  const uint64_t elapsed = now_ns() - timer->start_ns;
+  qsort(timer->samples, timer->count, sizeof(uint64_t), compare_u64);
+  const double ops_per_sec = (elapsed == 0) ? 0 : (double)timer->ops * 1e9 / (double)elapsed;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  if (config->json) {
+    printf("{\"size\":%zu,\"workload\":\"%s\",\"op\":\"%s\",\"ops\":%zu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"peak_rss_kb\":%ld}\n",
+           size, workload_names[workload], op, timer->ops, ops_per_sec,
+           (unsigned long long)percentile(timer, 0.5), (unsigned long long)percentile(timer, 0.99),
+           (unsigned long long)percentile(timer, 0.999), usage.ru_maxrss);
+  }
+  else {
+    printf("%zu,%s,%s,%zu,%.0f,%llu,%llu,%llu,%ld\n", size, workload_names[workload], op, timer->ops, ops_per_sec,
+           (unsigned long long)percentile(timer, 0.5), (unsigned long long)percentile(timer, 0.99),
+           (unsigned long long)percentile(timer, 0.999), usage.ru_maxrss);
+  }
+  fflush(stdout);
+}
+
+// 연산 하나를 감싼다. stride번째마다 그 연산만 따로 잰다.
+#define TIMED_OP(timer, i, op)                                                \
+  do {                                                                        \
+    if ((i) % (timer)->stride == 0 && (timer)->count < BENCH_MAX_SAMPLES) {   \
+      const uint64_t op_start = now_ns();                                     \
+      op;                                                                     \
+      (timer)->samples[(timer)->count++] = now_ns() - op_start;               \
+    }                                                                         \
+    else {                                                                    \
+      op;                                                                     \
+    }                                                                         \
+  } while (0)
+
+static size_t min_size(const size_t a, const size_t b) {
+  return (a < b) ? a : b;
+}
+
+// 결과를 버리지 않도록 모아 두는 곳
+static volatile uintptr_t sink;
+
+static void run_one(const bench_config *config, const size_t n, const workload_t workload) {
+  bench_timer timer = {0};
+  timer.samples = (uint64_t *)malloc(BENCH_MAX_SAMPLES * sizeof(uint64_t));
+  rng_state = config->seed;
+  const size_t q = min_size(n, config->max_ops);
+  rbtree *t = new_rbtree();
+
+  timer_start(&timer, n);
+  for (size_t i = 0; i < n; i++) {
+    TIMED_OP(&timer, i, rbtree_insert(t, key_of(workload, i)));
+  }
+  timer_report(&timer, config, n, workload, "insert");
+
+  if (workload == WORKLOAD_MIXED) {
+    // find 90%, 새 key insert 5%, 있던 key erase 5%
+    size_t next_new = n;
+    timer_start(&timer, q);
+    for (size_t i = 0; i < q; i++) {
+      const uint64_t r = next_random();
+      const unsigned dice = (unsigned)(r % 100);
+      const size_t index = (size_t)((r >> 8) % n);
+      if (dice < 90) {
+        TIMED_OP(&timer, i, sink += (uintptr_t)rbtree_find(t, key_of(workload, index)));
+      }
+      else if (dice < 95) {
+        TIMED_OP(&timer, i, rbtree_insert(t, key_of(workload, next_new++)));
+      }
+      else {
+        TIMED_OP(&timer, i, {
+          node_t *p = rbtree_find(t, key_of(workload, index));
+          if (p != NULL) {
+            rbtree_erase(t, p);
+          }
+        });
+      }
+    }
+    timer_report(&timer, config, n, workload, "mixed");
+  }
+  else {
+    zipf_gen zipf;
+    if (workload == WORKLOAD_ZIPF) {
+      zipf_init(&zipf, n, BENCH_ZIPF_THETA);
+    }
+    timer_start(&timer, q);
+    for (size_t i = 0; i < q; i++) {
+      size_t index;
+      if (workload == WORKLOAD_SEQUENTIAL) {
+        index = i;
+      }
+      else if (workload == WORKLOAD_ZIPF) {
+        index = zipf_next(&zipf);
+      }
+      else {
+        index = (size_t)(next_random() % n);
+      }
+      TIMED_OP(&timer, i, sink += (uintptr_t)rbtree_find(t, key_of(workload, index)));
+    }
+    timer_report(&timer, config, n, workload, "find");
+
+    // 같은 분포의 key를 BENCH_FIND_BATCH개씩 묶어 찾는다. 지연 시간은 batch 하나 단위이다.
+    key_t keys[BENCH_FIND_BATCH];
+    node_t *found[BENCH_FIND_BATCH];
+    const size_t batches = (q + BENCH_FIND_BATCH - 1) / BENCH_FIND_BATCH;
+    timer_start(&timer, batches);
+    for (size_t b = 0; b < batches; b++) {
+      const size_t count = min_size(BENCH_FIND_BATCH, q - b * BENCH_FIND_BATCH);
+      for (size_t j = 0; j < count; j++) {
+        const size_t i = b * BENCH_FIND_BATCH + j;
+        const size_t index = (workload == WORKLOAD_SEQUENTIAL) ? i
+                             : (workload == WORKLOAD_ZIPF)     ? zipf_next(&zipf)
+                                                               : (size_t)(next_random() % n);
+        keys[j] = key_of(workload, index);
+      }
+      TIMED_OP(&timer, b, sink += rbtree_find_batch(t, keys, count, found));
+    }
+    timer.ops = q;  // 처리량은 찾은 key 수로 센다
+    timer_report(&timer, config, n, workload, "find_batch");
+  }
+
+  timer_start(&timer, q);
+  for (size_t i = 0; i < q; i++) {
+    TIMED_OP(&timer, i, sink += (uintptr_t)rbtree_min(t));
+  }
+  timer_report(&timer, config, n, workload, "min");
+  timer_start(&timer, q);
+  for (size_t i = 0; i < q; i++) {
+    TIMED_OP(&timer, i, sink += (uintptr_t)rbtree_max(t));
+  }
+  timer_report(&timer, config, n, workload, "max");
+
+  // 한 번에 tree 전체를 훑으므로 작은 tree에서만 여러 번 돈다
+  const size_t size = rbtree_size(t);
+  key_t *arr = (key_t *)malloc((size + 1) * sizeof(key_t));
+  const size_t reps = min_size(100, 10000000 / (size + 1) + 1);
+  timer_start(&timer, reps);
+  for (size_t i = 0; i < reps; i++) {
+    TIMED_OP(&timer, i, rbtree_to_array(t, arr, size));
+  }
+  timer.ops = reps * size;  // 처리량은 옮긴 key 수로 센다
+  timer_report(&timer, config, n, workload, "to_array");
+  // 같은 일을 online CPU 수만큼의 thread로 나눠서
+  const int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  timer_start(&timer, reps);
+  for (size_t i = 0; i < reps; i++) {
+    TIMED_OP(&timer, i, rbtree_to_array_parallel(t, arr, size, cpus));
+  }
+  timer.ops = reps * size;
+  timer_report(&timer, config, n, workload, "to_array_parallel");
+  free(arr);
+
+  // erase할 node는 미리 찾아 두고 erase만 잰다
+  node_t **victims = (node_t **)malloc((q + 1) * sizeof(node_t *));
+  size_t victim_count = 0;
+  for (size_t i = 0; i < q; i++) {
+    node_t *p = rbtree_find(t, key_of(workload, i));
+    if (p != NULL) {
+      victims[victim_count++] = p;
+    }
+  }
+  timer_start(&timer, victim_count);
+  for (size_t i = 0; i < victim_count; i++) {
+    TIMED_OP(&timer, i, rbtree_erase(t, victims[i]));
+  }
+  timer_report(&timer, config, n, workload, "erase");
+  free(victims);
+
+  // TTL sweep: tree를 다시 채우고, 가장 작은 key 30%를 구간으로 한 번에 지우기를 tree가 빌 때까지 되풀이한다.
+  // 지연 시간은 sweep 하나 단위이고, 처리량은 지운 key 수로 센다.
+  key_t *keys = (key_t *)malloc((n + 1) * sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = key_of(workload, i);
+  }
+  rbtree_insert_batch(t, keys, n);
+  free(keys);
+  size_t sweeps = 0, removed = 0;
+  timer_start(&timer, 1);  // sweep은 log n번 남짓이므로 모두 잰다
+  while (rbtree_size(t) > 0) {
+    const key_t lo = rbtree_min(t)->key, hi = rbtree_select(t, rbtree_size(t) * 3 / 10)->key;
+    TIMED_OP(&timer, sweeps, removed += rbtree_erase_range(t, lo, hi));
+    sweeps++;
+  }
+  timer.ops = removed;
+  timer_report(&timer, config, n, workload, "erase_range");
+
+  delete_rbtree(t);
+  free(timer.samples);
+}
+
+static int parse_workload(const char *name) {
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, workload_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int parse_args(bench_config *config, int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+    if (value == NULL) {
+      return -1;
+    }
+    if (strcmp(arg, "--sizes") == 0) {
+      char *copy = strdup(value);
+      config->size_count = 0;
+      for (char *tok = strtok(copy, ","); tok != NULL && config->size_count < 16; tok = strtok(NULL, ",")) {
+        config->sizes[config->size_count++] = (size_t)strtod(tok, NULL);  // 1e6 같은 표기도 받는다
+      }
+      free(copy);
+    }
+    else if (strcmp(arg, "--workloads") == 0) {
+      char *copy = strdup(value);
+      config->workload_count = 0;
+      for (char *tok = strtok(copy, ","); tok != NULL && config->workload_count < 4; tok = strtok(NULL, ",")) {
+        const int workload = parse_workload(tok);
+        if (workload < 0) {
+          free(copy);
+          return -1;
+        }
+        config->workloads[config->workload_count++] = workload;
+      }
+      free(copy);
+    }
+    else if (strcmp(arg, "--ops") == 0) {
+      config->max_ops = (size_t)strtod(value, NULL);
+    }
+    else if (strcmp(arg, "--format") == 0) {
+      config->json = (strcmp(value, "json") == 0);
+    }
+    else if (strcmp(arg, "--seed") == 0) {
+      config->seed = strtoull(value, NULL, 10);
+    }
+    else {
+      return -1;
+    }
+    i++;
+  }
+  return 0;
+}
+
+/*
+  compare mode: 두 결과에서 같은 (size, workload, op) 줄을 짝지어 처리량 변화와 p99를 나란히 보여 준다.
+  결과 파일은 이 도구가 쓴 CSV나 JSON Lines이다. 결과 줄이 하나도 없는 파일은 잘못 넘긴 것으로 보고 실패한다.
+*/
+typedef struct {
+  size_t size;
+  char workload[16];
+  char op[16];
+  double ops_per_sec;
+  unsigned long long p99_ns;
+} bench_row;
+
+// timer_report가 쓰는 CSV 한 줄이나 JSON 한 줄을 읽는다. 결과 줄이 아니면 0
+static int parse_row(const char *line, bench_row *row) {
+  unsigned long long ops, p50, p999;
+  long rss;
+  if (line[0] == '{') {
+    return sscanf(line,
+                  "{\"size\":%zu,\"workload\":\"%15[^\"]\",\"op\":\"%15[^\"]\",\"ops\":%llu,\"ops_per_sec\":%lf,"
+                  "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"peak_rss_kb\":%ld}",
+                  &row->size, row->workload, row->op, &ops, &row->ops_per_sec, &p50, &row->p99_ns, &p999, &rss) == 9;
+  }
+  return sscanf(line, "%zu,%15[^,],%15[^,],%llu,%lf,%llu,%llu,%llu,%ld", &row->size, row->workload, row->op, &ops,
+                &row->ops_per_sec, &p50, &row->p99_ns, &p999, &rss) == 9;
+}
+
+static bench_row *read_rows(const char *path, size_t *count) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return NULL;
+  }
+  size_t capacity = 64;
+  bench_row *rows = (bench_row *)malloc(capacity * sizeof(bench_row));
+  char line[512];
+  *count = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    bench_row row;
+    if (!parse_row(line, &row)) {
+      continue;  // CSV header
+    }
+    if (*count == capacity) {
+      capacity *= 2;
+      rows = (bench_row *)realloc(rows, capacity * sizeof(bench_row));
+    }
+    rows[(*count)++] = row;
+  }
+  fclose(file);
+  return rows;
+}
+
+static int compare_runs(const char *old_path, const char *new_path) {
+  size_t old_count, new_count;
+  bench_row *old_rows = read_rows(old_path, &old_count);
+  bench_row *new_rows = read_rows(new_path, &new_count);
+  if (old_rows == NULL || new_rows == NULL) {
+    fprintf(stderr, "cannot read %s\n", (old_rows == NULL) ? old_path : new_path);
+    free(old_rows);
+    free(new_rows);
+    return 1;
+  }
+  if (old_count == 0 || new_count == 0) {
+    fprintf(stderr, "%s has no bench-rbtree result rows (expected CSV or JSON Lines output)\n",
+            (old_count == 0) ? old_path : new_path);
+    free(old_rows);
+    free(new_rows);
+    return 1;
+  }
+  printf("size,workload,op,old_ops_per_sec,new_ops_per_sec,change_pct,old_p99_ns,new_p99_ns\n");
+  for (size_t i = 0; i < new_count; i++) {
+    const bench_row *now = &new_rows[i];
+    for (size_t j = 0; j < old_count; j++) {
+      const bench_row *before = &old_rows[j];
+      if (before->size == now->size && strcmp(before->workload, now->workload) == 0 &&
+          strcmp(before->op, now->op) == 0) {
+        const double change = (before->ops_per_sec == 0) ? 0 : (now->ops_per_sec / before->ops_per_sec - 1) * 100;
+        printf("%zu,%s,%s,%.0f,%.0f,%+.1f,%llu,%llu\n", now->size, now->workload, now->op, before->ops_per_sec,
+               now->ops_per_sec, change, before->p99_ns, now->p99_ns);
+        break;
+      }
+    }
+  }
+  free(old_rows);
+  free(new_rows);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && strcmp(argv[1], "--compare") == 0) {
+    return compare_runs(argv[2], argv[3]);
+  }
+  bench_config config = {{1000, 10000, 100000, 1000000}, 4, {0, 1, 2, 3}, 4, BENCH_DEFAULT_OPS, 0, 42};
+  if (parse_args(&config, argc, argv) != 0) {
+    fprintf(stderr,
+            "usage: %s [--sizes N,...] [--workloads random,sequential,zipf,mixed] [--ops N] [--format csv|json] "
+            "[--seed S]\n       %s --compare old.csv new.csv\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+  if (!config.json) {
+    printf("%s\n", BENCH_CSV_HEADER);
+  }
+  fflush(stdout);
+  for (size_t i = 0; i < config.size_count; i++) {
+    for (size_t j = 0; j < config.workload_count; j++) {
+      // 설정마다 process를 새로 띄워 peak RSS가 앞선 설정에 섞이지 않게 한다
+      const pid_t pid = fork();
+      if (pid == 0) {
+        run_one(&config, config.sizes[i], (workload_t)config.workloads[j]);
+        exit(0);
+      }
+      int status;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "size %zu workload %s failed\n", config.sizes[i], workload_names[config.workloads[j]]);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
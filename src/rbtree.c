@@ -1,15 +1,135 @@
 #include "rbtree.h"
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define RBTREE_MIN_SLAB_SIZE 64
+#define RBTREE_MAX_SLAB_SIZE 65536
+// batch 크기가 tree 크기의 1/RBTREE_BATCH_REBUILD_DIVISOR 이상이면 하나씩 넣는 대신 병합 후 다시 짓는다.
+#define RBTREE_BATCH_REBUILD_DIVISOR 8
+// red-black tree의 높이는 2 log2(n + 1)을 넘지 않는다. reader가 고쳐지는 중인 link를 따라가다 맴돌지 않도록 탐색 길이를 이만큼으로 자른다.
+#define RBTREE_MAX_HEIGHT 128
+// rbtree_find_batch가 한꺼번에 진행하는 탐색 수. 이만큼의 cache miss가 겹쳐서 기다린다.
+#define RBTREE_FIND_BATCH_GROUP 16
+// 집합 연산에서 이보다 작은 하위 문제는 thread를 나누지 않고 한 thread에서 끝낸다.
+#define RBTREE_PARALLEL_GRAIN 65536
+// hash index의 처음 크기와, insert/erase 한 번마다 이전 table에서 옮기는 칸 수
+#define RBTREE_HASH_MIN_CAPACITY 16
+#define RBTREE_HASH_MIGRATE_STEP 8
+
+#if defined(RBTREE_STATS) && defined(RBTREE_CONCURRENT)
+// reader 여러 개가 함께 세므로 atomic으로 더한다
+#define RB_STAT_ADD(t, counter, n) __atomic_fetch_add(&((rbtree *)(t))->counters.counter, (n), __ATOMIC_RELAXED)
+#elif defined(RBTREE_STATS)
+// 조회 함수는 const rbtree *를 받으므로 counter만은 const를 벗겨서 센다.
+#define RB_STAT_ADD(t, counter, n) (((rbtree *)(t))->counters.counter += (n))
+#else
+#define RB_STAT_ADD(t, counter, n) ((void)0)
+#endif
+
+// join/split이 다루는, tree에서 떼어 낸 subtree. bh는 root부터 nil 직전까지의 black node 수 (root가 red면 세지 않는다)
+typedef struct {
+  node_t *root;
+  int bh;
+} rb_subtree;
+
+// 집합 연산 재귀 한 단계의 입력과 결과. 그대로 다른 thread에 넘길 수 있게 묶어 둔다.
+typedef struct {
+  rbtree *t;
+  const rbtree *other;  // intersect/difference에서 key만 읽는 tree
+  rb_subtree a;         // 결과로 남길 node들
+  rb_subtree b;         // union에서 a에 합칠 subtree (a와 같은 pool)
+  const node_t *probe;  // intersect/difference에서 a를 나눌 기준인 other의 subtree
+  int keep_common;      // intersect면 1, difference면 0
+  int threads;
+  node_t *garbage;      // 버릴 subtree들의 root. parent link로 이어지고 nil에서 끝난다
+  rb_subtree result;
+} rb_setop_task;
+
+// rbtree_to_array_parallel에서 thread 하나가 맡는 subtree와 그 subtree가 arr에서 차지하는 첫 칸
+typedef struct {
+  const rbtree *t;
+  node_t *node;
+  key_t *arr;
+  size_t offset;
+  size_t n;
+  int threads;
+} rb_export_task;
 
 void rb_delete_fixup(rbtree *t, node_t *x);
-int inorder_toarray(const rbtree *t, key_t *arr, node_t *root, int ticket);
+void collect_depths(const rbtree *t, const node_t *node, size_t depth, rbtree_stats_t *out);
+void seq_write_begin(rbtree *t);
+void seq_write_end(rbtree *t);
+unsigned seq_read_begin(const rbtree *t);
+int seq_read_retry(const rbtree *t, unsigned seq);
+key_t *sorted_copy(const key_t *keys, size_t n);
+int compare_keys(const void *a, const void *b);
 void rb_transplant(rbtree *t, node_t *u, node_t *v);
-node_t *tree_minimum(rbtree *t, node_t *root);
-void free_nodes_in_postorder(rbtree *t, node_t *root);
+node_t *tree_minimum(const rbtree *t, node_t *root);
+node_t *tree_maximum(const rbtree *t, node_t *root);
+node_t *tree_successor(const rbtree *t, node_t *node);
+node_t *tree_predecessor(const rbtree *t, node_t *node);
 node_t *binary_search(const rbtree *t, node_t *node, key_t key);
+node_t *find_node(const rbtree *t, key_t key);
+void hash_add(rbtree *t, node_t *node);
+void hash_remove(rbtree *t, node_t *node);
+void hash_repair(rbtree *t, key_t key);
+#ifdef RBTREE_HASH_INDEX
+size_t hash_home(key_t key, size_t capacity);
+rb_hash_slot *hash_probe(rb_hash_slot *slots, size_t capacity, key_t key, size_t *probes);
+rb_hash_slot *hash_lookup(const rbtree *t, key_t key);
+rb_hash_slot *hash_place(rb_hash_index *h, rb_hash_slot entry);
+rb_hash_slot *hash_claim(rb_hash_index *h, key_t key);
+void hash_migrate(rb_hash_index *h, size_t steps);
+void hash_resize(rb_hash_index *h);
+void hash_rehash(rb_hash_index *h, rb_hash_slot *slots, size_t capacity);
+#endif
+size_t interleaved_search(const rbtree *t, const key_t *keys, size_t n, node_t **out);
 node_t *new_node(rbtree *t, key_t key, color_t color);
-node_t *bst_insert(rbtree *t, node_t *root, node_t *node_to_insert);
+void free_node(rbtree *t, node_t *node);
+#ifdef RBTREE_INDEX_LINKS
+rbtree_chunk *add_chunk(rbtree *t);
+#else
+rbtree_slab *add_slab(rbtree *t, size_t capacity);
+#endif
+void link_node(rbtree *t, node_t *parent, node_t *node, int as_left);
+void link_balanced(rbtree *t, node_t **order, const key_t *keys, size_t n);
+void set_extremes(rbtree *t, node_t *leftmost, node_t *rightmost);
+int black_height(const rbtree *t, node_t *node);
+node_t *attach(rbtree *t, node_t *left, node_t *node, node_t *right);
+node_t *rotate_left_subtree(rbtree *t, node_t *node);
+node_t *rotate_right_subtree(rbtree *t, node_t *node);
+node_t *join_right(rbtree *t, node_t *l, int l_bh, node_t *k, node_t *r, int r_bh);
+node_t *join_left(rbtree *t, node_t *l, int l_bh, node_t *k, node_t *r, int r_bh);
+rb_subtree join_subtrees(rbtree *t, rb_subtree l, node_t *k, rb_subtree r);
+rb_subtree concat_subtrees(rbtree *t, rb_subtree l, rb_subtree r);
+rb_subtree split_last(rbtree *t, rb_subtree tree, node_t **last);
+void split_subtree(rbtree *t, rb_subtree tree, key_t key, int equal_to_lo, rb_subtree *lo, rb_subtree *hi);
+rb_subtree whole_tree(const rbtree *t);
+void set_whole_tree(rbtree *t, rb_subtree tree);
+rb_subtree move_smaller(rbtree *t1, rbtree *t2, int *swapped);
+void swap_trees(rbtree *a, rbtree *b);
+node_t *clone_subtree(rbtree *dst, const rbtree *src, const node_t *node);
+void free_subtree(rbtree *t, node_t *node);
+void push_garbage(rbtree *t, node_t **list, node_t *subtree);
+void move_garbage(rbtree *t, node_t **list, node_t *from);
+void free_garbage(rbtree *t, node_t *list);
+void filter_tree(rbtree *t1, const rbtree *t2, int keep_common, int threads);
+void run_pair(rb_setop_task *left, rb_setop_task *right, void *(*fn)(void *), size_t work);
+void *union_task(void *arg);
+void *filter_task(void *arg);
+void *export_task(void *arg);
+node_t *build_balanced(rbtree *t, node_t **order, const key_t *keys, size_t lo, size_t hi, int depth, int red_depth);
+int goes_right(key_t key, key_t node_key, int equal_goes_left);
+node_t *finger_subtree(const rbtree *t, node_t *finger, key_t key, int equal_goes_left);
+node_t *finger_lower_bound(const rbtree *t, node_t *finger, key_t key);
+void bst_insert(rbtree *t, node_t *start, node_t *node_to_insert);
+#ifdef RBTREE_COUNTED
+node_t *counted_find(const rbtree *t, node_t *start, key_t key);
+void add_count(rbtree *t, node_t *node, int delta);
+rb_size_t take_extreme(rbtree *t, node_t *node, key_t key);
+#endif
 void left_rotate(rbtree *t, node_t *pivot);
 void right_rotate(rbtree *t, node_t *pivot);
 void rb_insert_fixup(rbtree *t, node_t *node_to_insert);
@@ -18,64 +138,239 @@ void rb_insert_fixup(rbtree *t, node_t *node_to_insert);
   1. Implementation 요구되는 functions
 */
 rbtree *new_rbtree(void) {
-  node_t *NIL = (node_t *)calloc(1, sizeof(node_t));
-  NIL->key = 0;
-  NIL->color = RBTREE_BLACK;
-  NIL->parent = NULL;
-  NIL->left = NULL;
-  NIL->right = NULL;
-  
+  return new_rbtree_with_capacity(0);
+}
+
+// capacity개의 node를 미리 한 slab에 잡아 둔다. capacity가 0이면 첫 insert 때 작은 slab부터 시작한다.
+rbtree *new_rbtree_with_capacity(const size_t capacity) {
+  return new_rbtree_with_node_size(sizeof(node_t), capacity);
+}
+
+// node_t 뒤에 다른 key를 붙인 node를 쓰는 tree(rbtree_template.h)를 위해 pool의 칸 크기를 정해 준다.
+rbtree *new_rbtree_with_node_size(const size_t node_size, const size_t capacity) {
   rbtree *p = (rbtree *)calloc(1, sizeof(rbtree));
-  p->root = NIL;
+  p->free_list = NULL;
+  p->finger = NULL;
+  p->node_size = node_size;
+#ifdef RBTREE_INDEX_LINKS
+  // nil은 0번 칸이다. capacity만큼의 chunk는 미리 만들어 둔다.
+  p->chunk_nodes = (RBTREE_CHUNK_BYTES - sizeof(rbtree_chunk)) / node_size;
+  if (p->chunk_nodes > ((size_t)1 << RBTREE_CHUNK_SHIFT)) {
+    p->chunk_nodes = (size_t)1 << RBTREE_CHUNK_SHIFT;
+  }
+  p->chunks = NULL;
+  p->chunk_count = 0;
+  p->chunk_capacity = 0;
+  add_chunk(p);
+  p->used = 1;
+  for (size_t reserved = p->chunk_nodes - 1; reserved < capacity; reserved += p->chunk_nodes) {
+    add_chunk(p);
+  }
+  p->chunk_count = 1;
+  node_t *NIL = p->chunks[0]->nodes;
+#else
+  node_t *NIL = (node_t *)calloc(1, sizeof(node_t));
+  p->slabs = NULL;
+  p->next_slab_size = RBTREE_MIN_SLAB_SIZE;
+  if (capacity > 0) {
+    add_slab(p, capacity);
+  }
+#endif
   p->nil = NIL;
-  
+  p->root = NIL;
+  p->leftmost = NIL;
+  p->rightmost = NIL;
+  NIL->key = 0;
+  rb_set_color(p, NIL, RBTREE_BLACK);
+  rb_set_parent(p, NIL, NIL);
+  rb_set_left(p, NIL, NIL);
+  rb_set_right(p, NIL, NIL);
+  NIL->size = 0;
+#ifdef RBTREE_COUNTED
+  rb_set_count(NIL, 0);
+#endif
+#ifdef RBTREE_HASH_INDEX
+  // node 뒤에 다른 key를 붙인 tree(rbtree_template.h)는 key_t key를 쓰지 않으므로 index를 두지 않는다
+  memset(&p->hash, 0, sizeof(p->hash));
+  if (node_size == sizeof(node_t)) {
+    p->hash.capacity = RBTREE_HASH_MIN_CAPACITY;
+    p->hash.slots = (rb_hash_slot *)calloc(p->hash.capacity, sizeof(rb_hash_slot));
+  }
+#endif
+
   return p;
 }
 
+// 오름차순으로 정렬된 keys로 O(n)에 tree를 만든다. node는 inorder 순서로 할당되므로 pool 안에 key 순서대로 연속해서 놓인다.
+rbtree *rbtree_build_sorted(const key_t *keys, const size_t n) {
+  rbtree *t = new_rbtree_with_capacity(n);
+  if (n == 0) {
+    return t;
+  }
+
+#ifdef RBTREE_COUNTED
+  // 같은 key는 node 하나의 count로 모은다
+  node_t **order = (node_t **)malloc(n * sizeof(node_t *));
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (m > 0 && order[m - 1]->key == keys[i]) {
+      rb_set_count(order[m - 1], rb_count(order[m - 1]) + 1);
+    }
+    else {
+      order[m++] = new_node(t, keys[i], RBTREE_BLACK);
+    }
+  }
+  link_balanced(t, order, NULL, m);
+  free(order);
+#else
+  link_balanced(t, NULL, keys, n);
+#endif
+  t->finger = tree_maximum(t, t->root);
+  return t;
+}
+
+// node들은 모두 pool 안에 있으므로 tree를 순회할 필요 없이 pool만 반환하면 된다.
 void delete_rbtree(rbtree *t) {
-  free_nodes_in_postorder(t, t->root);
+#ifdef RBTREE_INDEX_LINKS
+  for (size_t i = 0; i < t->chunk_capacity && t->chunks[i] != NULL; i++) {
+    free(t->chunks[i]);
+  }
+  free(t->chunks);
+#else
+  rbtree_slab *slab = t->slabs;
+  while (slab != NULL) {
+    rbtree_slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
   free(t->nil);
+#endif
+#ifdef RBTREE_HASH_INDEX
+  free(t->hash.slots);
+  free(t->hash.old_slots);
+#endif
   free(t);
 }
 
+// 직전에 insert한 node(t->finger)를 hint로 삼는다. 거의 정렬된 순서로 들어오는 key는 root까지 올라가지 않고 자리를 찾는다.
 node_t *rbtree_insert(rbtree *t, const key_t key) {
+  return rbtree_insert_hint(t, t->finger, key);
+}
+
+// hint에서 출발해 key가 들어갈 자리를 품은 subtree까지만 올라갔다가 내려간다. hint가 NULL이면 root에서 시작한다.
+// 새로 만든 node를 반환한다. RBTREE_COUNTED에서 같은 key가 이미 있으면 그 node의 count만 늘려 반환한다.
+node_t *rbtree_insert_hint(rbtree *t, node_t *hint, const key_t key) {
+  RB_STAT_ADD(t, inserts, 1);
+  node_t *start = (hint == NULL) ? t->root : finger_subtree(t, hint, key, 0);
+#ifdef RBTREE_COUNTED
+  node_t *existing = counted_find(t, start, key);
+  if (existing != NULL) {
+    add_count(t, existing, 1);
+    t->finger = existing;
+    return existing;
+  }
+#endif
+
   // Initiallize node with the given key and color it red
   node_t *node_to_insert = new_node(t, key, RBTREE_RED);
 
   // bst insert the new node into t
-  t->root = bst_insert(t, t->root, node_to_insert);
+  bst_insert(t, start, node_to_insert);
 
   // fixup to maintain the properties of rb tree
   rb_insert_fixup(t, node_to_insert);
-  
-  return t->root;
+
+  t->finger = node_to_insert;
+  return node_to_insert;
 }
 
+// reader용 함수는 탐색 도중 writer가 link를 고치면 처음부터 다시 한다. RBTREE_CONCURRENT가 아니면 한 번에 끝난다.
 node_t *rbtree_find(const rbtree *t, const key_t key) {
-  return binary_search(t, t->root, key);
+  node_t *found;
+  unsigned seq;
+  RB_STAT_ADD(t, finds, 1);
+  do {
+    seq = seq_read_begin(t);
+    found = find_node(t, key);
+  } while (seq_read_retry(t, seq));
+  return found;
 }
 
+// keys[i]를 가진 node를 out[i]에 채운다. 없으면 NULL. 찾은 개수를 반환한다.
+// 여러 key의 탐색을 번갈아 한 단계씩 진행하면서 다음에 읽을 자식을 미리 prefetch하므로,
+// tree가 cache보다 클 때 rbtree_find를 n번 부르는 것보다 cache miss를 훨씬 많이 겹쳐서 기다린다.
+size_t rbtree_find_batch(const rbtree *t, const key_t *keys, const size_t n, node_t **out) {
+  size_t found;
+  unsigned seq;
+  RB_STAT_ADD(t, finds, n);
+  do {
+    seq = seq_read_begin(t);
+    found = interleaved_search(t, keys, n, out);
+  } while (seq_read_retry(t, seq));
+  return found;
+}
+
+// 양 끝 node는 insert/erase 때마다 갱신해 두므로 O(1)이다. 빈 tree면 NULL
 node_t *rbtree_min(const rbtree *t) {
-  node_t *cur_node = t->root;
-  node_t *next_left = cur_node->left;
-  while (next_left != t->nil) {
-    cur_node = next_left;
-    next_left = cur_node->left;
-  }
-  return cur_node;
+  node_t *min = rb_leftmost(t);
+  return (min == t->nil) ? NULL : min;
 }
 
 node_t *rbtree_max(const rbtree *t) {
-  node_t *cur_node = t->root;
-  node_t *next_right = cur_node->right;
-  while (next_right != t->nil) {
-    cur_node = next_right;
-    next_right = cur_node->right;
-  }
-  return cur_node;
+  node_t *max = rb_rightmost(t);
+  return (max == t->nil) ? NULL : max;
 }
 
+// RBTREE_COUNTED에서는 key 하나만 지운다. count가 남으면 node는 그대로 tree에 있다.
 int rbtree_erase(rbtree *t, node_t *node_to_delete) {
+#ifdef RBTREE_COUNTED
+  if (node_to_delete->count > 1) {
+    RB_STAT_ADD(t, erases, 1);
+    add_count(t, node_to_delete, -1);
+    return 0;
+  }
+#endif
+  const key_t key = node_to_delete->key;
+  rbtree_link_remove(t, node_to_delete);
+  free_node(t, node_to_delete); // 부모, 좌, 우 연결고리를 잃어버린 node_to_delete을 pool에 반납하기
+  hash_repair(t, key);
+  return 0;
+}
+
+// key를 가진 node를 한 번 내려가(hash index가 있으면 hash에서) 찾아 key 하나를 지운다. 지웠으면 1, 없으면 0
+int rbtree_erase_key(rbtree *t, const key_t key) {
+  node_t *node = find_node(t, key);
+  if (node == NULL) {
+    return 0;
+  }
+  rbtree_erase(t, node);
+  return 1;
+}
+
+// 가장 작은 key를 *key에 쓰고 그 node를 지운다. 빈 tree면 0을 반환한다.
+// leftmost는 왼쪽 자식이 없으므로 rbtree_link_remove에서 오른쪽 자식을 올리는 경우만 타고, 새 leftmost도 O(1)에 정해진다.
+int rbtree_pop_min(rbtree *t, key_t *key) {
+  node_t *min = t->leftmost;
+  if (min == t->nil) {
+    return 0;
+  }
+  *key = min->key;
+  rbtree_erase(t, min);
+  return 1;
+}
+
+int rbtree_pop_max(rbtree *t, key_t *key) {
+  node_t *max = t->rightmost;
+  if (max == t->nil) {
+    return 0;
+  }
+  *key = max->key;
+  rbtree_erase(t, max);
+  return 1;
+}
+
+// node_to_delete를 tree에서 떼어 내고 균형을 맞춘다. node의 메모리는 그대로 둔다.
+void rbtree_link_remove(rbtree *t, node_t *node_to_delete) {
   // 이해의 편의를 위해 Introduction to algorithm에 나오는 pseudo code의 변수명과 일부러 다르게 수정했다.
   // (1) y는 node_to_delete를 대체할 node이고,
   // (2) y_child는 y의 자식 노드로서 y를 대체할 node이다.
@@ -83,95 +378,643 @@ int rbtree_erase(rbtree *t, node_t *node_to_delete) {
   node_t *y;
   color_t y_original_color;
   node_t *y_child;
+  RB_STAT_ADD(t, erases, 1);
+
+  // 양 끝 node를 지우면 바로 옆 node가 새 끝이 된다. 끝 node는 한쪽 자식이 없으므로 옆 node는 가까이 있다.
+  if (node_to_delete == t->leftmost || node_to_delete == t->rightmost) {
+    set_extremes(t, (node_to_delete == t->leftmost) ? tree_successor(t, node_to_delete) : t->leftmost,
+                 (node_to_delete == t->rightmost) ? tree_predecessor(t, node_to_delete) : t->rightmost);
+  }
+
+  // node_to_delete의 조상들은 subtree size를 node_to_delete의 key 수만큼 줄인다.
+  // 자식이 둘이면 successor가 node_to_delete 자리로 올라가므로, 그 사이의 node들은 successor의 key 수만큼 줄이고
+  // node_to_delete 자리에서부터 줄인 size를 y가 그대로 물려받는다.
+  node_t *removed_from = rb_parent(t, node_to_delete);
+  if (rb_left(t, node_to_delete) != t->nil && rb_right(t, node_to_delete) != t->nil) {
+    node_t *successor = tree_minimum(t, rb_right(t, node_to_delete));
+    for (removed_from = rb_parent(t, successor); removed_from != node_to_delete; removed_from = rb_parent(t, removed_from)) {
+      removed_from->size -= rb_count(successor);
+    }
+  }
+  while (removed_from != t->nil) {
+    removed_from->size -= rb_count(node_to_delete);
+    removed_from = rb_parent(t, removed_from);
+  }
   
+  seq_write_begin(t);
   // node_to_delete의 왼쪽 자식이 nil인 경우
   // 즉 (1) 자식 node가 아예 없거나, (2) 오른쪽 자식만 있는 경우
-  if (node_to_delete->left == t->nil) {
+  if (rb_left(t, node_to_delete) == t->nil) {
     y = node_to_delete; // y가 node_to_delete를 가리키게 함으로써 대체한 것으로 간주한다.
-    y_original_color = y->color;
-    y_child = y->right;
+    y_original_color = rb_color(t, y);
+    y_child = rb_right(t, y);
     rb_transplant(t, y, y_child);
   }
   // node_to_delete가 왼쪽 자식만 있는 경우
-  else if (node_to_delete->right == t->nil) {
+  else if (rb_right(t, node_to_delete) == t->nil) {
     y = node_to_delete; // y가 node_to_delete를 가리키게 함으로써 대체한 것으로 간주한다.
-    y_original_color = y->color;
-    y_child = y->left;
+    y_original_color = rb_color(t, y);
+    y_child = rb_left(t, y);
     rb_transplant(t, y, y_child);
   }
   // node_to_delete가 양쪽 자식 모두 가진 경우
   else {
-    y = tree_minimum(t, node_to_delete->right); // node_to_delete의 inorder successor를 y로 지정한다.
-    y_original_color = y->color;
-    y_child = y->right;
+    y = tree_minimum(t, rb_right(t, node_to_delete)); // node_to_delete의 inorder successor를 y로 지정한다.
+    y_original_color = rb_color(t, y);
+    y_child = rb_right(t, y);
     // y가 node_to_delete의 direct right child인 경우
-    if (y->parent == node_to_delete) {
+    if (rb_parent(t, y) == node_to_delete) {
       // y_child가 nil인 경우 fixup에서 문제 생길 수 있는 것에 대비. y_child가 non-nil child면 필요 없음.
       // fixup 때 sibling이 중요 변수여서, y_child의 부모를 참조해야 하는데, y_child가 nil이면 부모가 NULL일 것이라서 문제
-      y_child->parent = y; 
+      rb_set_parent(t, y_child, y); 
     }
     // y가 node_to_delete의 direct right child가 아닌 경우
     else {
       rb_transplant(t, y, y_child);
-      y->right = node_to_delete->right; // y의 우측 child가 변경됨
-      y->right->parent = y;
+      rb_set_right(t, y, rb_right(t, node_to_delete)); // y의 우측 child가 변경됨
+      rb_set_parent(t, rb_right(t, y), y);
     }
     // 직전까지의 코드가 y가 node_to_delete의 right subtree를 계승받는 작업이었다면
     // 아래의 코드는 y가 node_to_delete의 색깔과 부모를 계승받고, left subtree를 계승받는 작업
     rb_transplant(t, node_to_delete, y); // transplant가 부모를 계승받는 작업이다
-    y->left = node_to_delete->left;
-    y->left->parent = y;
-    y->color = node_to_delete->color;
+    rb_set_left(t, y, rb_left(t, node_to_delete));
+    rb_set_parent(t, rb_left(t, y), y);
+    rb_set_color(t, y, rb_color(t, node_to_delete));
+    y->size = node_to_delete->size;
+  }
+  seq_write_end(t);
+  if (t->finger == node_to_delete) {
+    t->finger = NULL;
   }
-  free(node_to_delete); // 부모, 좌, 우 연결고리를 잃어버린 node_to_delete을 free해주기
   if (y_original_color == RBTREE_BLACK) { //y_original_color가 red면 black height에 영향을 안 주지만, black이면 문제가 생길 수 있기 때문
     rb_delete_fixup(t, y_child);
   }
+}
+
+// keys를 정렬한 뒤 key 순서대로 넣는다. 각 key는 직전에 넣은 node에서 출발해 필요한 만큼만 올라갔다가 내려간다.
+// batch가 tree에 비해 크면 기존 node와 새 node를 key 순서로 병합해 균형 잡힌 tree로 다시 연결한다.
+// 어느 경우든 기존 node의 주소는 바뀌지 않는다.
+int rbtree_insert_batch(rbtree *t, const key_t *keys, const size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  key_t *sorted = sorted_copy(keys, n);
+
+  if (n >= t->root->size / RBTREE_BATCH_REBUILD_DIVISOR) {
+    size_t total = t->root->size + n;
+    node_t **order = (node_t **)malloc(total * sizeof(node_t *));
+    node_t *cur_node = rbtree_first(t);
+    size_t i = 0, j = 0;
+    // 같은 key라면 기존 node가 앞에 오도록 해서 rbtree_insert와 같은 순서를 유지한다.
+    while (cur_node != NULL || j < n) {
+      if (cur_node != NULL && (j == n || cur_node->key <= sorted[j])) {
+        order[i++] = cur_node;
+        cur_node = rbtree_next(t, cur_node);
+      }
+      else {
+#ifdef RBTREE_COUNTED
+        // 같은 key는 바로 앞 node(기존 node이든 새 node이든)의 count로 센다
+        if (i > 0 && order[i - 1]->key == sorted[j]) {
+          rb_set_count(order[i - 1], rb_count(order[i - 1]) + 1);
+          j++;
+          continue;
+        }
+#endif
+        order[i++] = new_node(t, sorted[j++], RBTREE_BLACK);
+      }
+    }
+    seq_write_begin(t);
+    link_balanced(t, order, NULL, i);
+    seq_write_end(t);
+    free(order);
+  }
+  else {
+    for (size_t j = 0; j < n; j++) {
+      rbtree_insert_hint(t, t->finger, sorted[j]);
+    }
+  }
+
+  free(sorted);
   return 0;
 }
 
+// keys에 있는 key마다 node를 하나씩 지우고, 실제로 지운 개수를 반환한다. 같은 key가 여러 번 있으면 그만큼 지운다.
+size_t rbtree_erase_batch(rbtree *t, const key_t *keys, const size_t n) {
+  if (n == 0 || t->root == t->nil) {
+    return 0;
+  }
+  key_t *sorted = sorted_copy(keys, n);
+  size_t erased = 0;
+
+  if (n >= t->root->size / RBTREE_BATCH_REBUILD_DIVISOR) {
+    // 남길 node는 앞에서부터, 지울 node는 뒤에서부터 채운다.
+    // 순회가 끝나기 전에 free_node로 link를 덮어쓰면 rbtree_next가 망가지므로 반납은 마지막에 한다.
+    size_t total = t->root->size;
+    node_t **order = (node_t **)malloc(total * sizeof(node_t *));
+    size_t kept = 0, removed = 0, j = 0;
+    for (node_t *cur_node = rbtree_first(t); cur_node != NULL; cur_node = rbtree_next(t, cur_node)) {
+      while (j < n && sorted[j] < cur_node->key) {
+        j++;
+      }
+      // node 하나가 key를 count개 가지고 있으면 keys의 같은 key를 그만큼까지 받아 준다
+      rb_size_t remaining = rb_count(cur_node);
+      for (; j < n && sorted[j] == cur_node->key && remaining > 0; j++) {
+        remaining--;
+        erased++;
+      }
+      if (remaining == 0) {
+        order[total - ++removed] = cur_node;
+      }
+      else {
+#ifdef RBTREE_COUNTED
+        rb_set_count(cur_node, remaining);
+#endif
+        order[kept++] = cur_node;
+      }
+    }
+    seq_write_begin(t);
+    for (size_t i = total - removed; i < total; i++) {
+      if (t->finger == order[i]) {
+        t->finger = NULL;
+      }
+      free_node(t, order[i]);
+    }
+    if (kept == 0) {
+      rb_set_root(t, t->nil);
+      set_extremes(t, t->nil, t->nil);
+    }
+    else {
+      link_balanced(t, order, NULL, kept);
+    }
+    seq_write_end(t);
+    free(order);
+  }
+  else {
+    node_t *finger = t->root;
+    for (size_t j = 0; j < n && t->root != t->nil; j++) {
+      node_t *target = finger_lower_bound(t, finger, sorted[j]);
+      if (target == NULL) {
+        break;
+      }
+      if (target->key != sorted[j]) {
+        finger = target;
+        continue;
+      }
+      // 자식이 둘이면 successor가 target 자리로 옮겨 가지만 node 자체는 그대로이므로 finger로 쓸 수 있다.
+      // count가 남아 target이 tree에 그대로 있으면 target에서 이어 간다.
+      node_t *next = (rb_count(target) > 1) ? target : rbtree_next(t, target);
+      rbtree_erase(t, target);
+      erased++;
+      finger = (next != NULL) ? next : t->root;
+    }
+  }
+
+  free(sorted);
+  return erased;
+}
+
+// [lo, hi] 구간의 key를 모두 지우고 지운 개수를 반환한다. 구간의 양 끝에서 split해 구간을 통째로 떼어 내고
+// 남은 두 쪽을 한 번 이어 붙이므로, key마다 fixup을 도는 대신 O(log n)의 split/join에 떼어 낸 node 수만큼만 더 든다.
+// 떼어 낸 node는 한꺼번에 free list로 돌려준다.
+size_t rbtree_erase_range(rbtree *t, const key_t lo, const key_t hi) {
+  if (hi < lo || t->root == t->nil) {
+    return 0;
+  }
+  rb_subtree below, rest, range, above;
+  seq_write_begin(t);
+  split_subtree(t, whole_tree(t), lo, 0, &below, &rest);
+  split_subtree(t, rest, hi, 1, &range, &above);
+  const size_t removed = range.root->size;
+  free_subtree(t, range.root);
+  set_whole_tree(t, concat_subtrees(t, below, above));
+  seq_write_end(t);
+  RB_STAT_ADD(t, erases, removed);
+  return removed;
+}
+
+// tree가 n보다 크면 key 순서대로 앞의 n개만 채운다. node의 count만큼 같은 key를 되풀이해 쓴다.
 int rbtree_to_array(const rbtree *t, key_t *arr, const size_t n) {
-  inorder_toarray(t, arr, t->root, 0);
+  size_t ticket = 0;
+  for (node_t *p = rbtree_first(t); p != NULL && ticket < n; p = rbtree_next(t, p)) {
+    for (rb_size_t c = 0; c < rb_count(p) && ticket < n; c++) {
+      arr[ticket++] = p->key;
+    }
+  }
   return 0;
 }
 
+// rbtree_to_array와 같은 결과를 threads개의 thread로 채운다. root 근처에서 tree를 서로 겹치지 않는 subtree로 나누고,
+// 각 subtree가 arr의 어느 칸부터 쓸지는 subtree size로 바로 안다. 쓰는 동안 tree를 고치면 안 된다.
+int rbtree_to_array_parallel(const rbtree *t, key_t *arr, const size_t n, const int threads) {
+  rb_export_task task = {t, t->root, arr, 0, n, threads};
+  export_task(&task);
+  return 0;
+}
+
+size_t rbtree_size(const rbtree *t) {
+  return t->root->size;
+}
+
+// key와 같은 key의 개수. RBTREE_COUNTED에서는 node 하나의 count이고, 아니면 hash index가 센 node 수이거나
+// rbtree_range_count(t, key, key)이다.
+size_t rbtree_count(const rbtree *t, const key_t key) {
+#ifdef RBTREE_COUNTED
+  node_t *node = rbtree_find(t, key);
+  return (node == NULL) ? 0 : node->count;
+#else
+#ifdef RBTREE_HASH_INDEX
+  if (t->hash.capacity != 0) {
+    const rb_hash_slot *slot = hash_lookup(t, key);
+    return (slot == NULL) ? 0 : slot->count;
+  }
+#endif
+  return rbtree_range_count(t, key, key);
+#endif
+}
+
+// key보다 작은 key의 개수. 즉 key가 rbtree_to_array 결과에서 처음 나타날(또는 들어갈) 위치이다.
+size_t rbtree_rank(const rbtree *t, const key_t key) {
+  size_t rank = 0;
+  node_t *cur_node = t->root;
+  while (cur_node != t->nil) {
+    if (key <= cur_node->key) {
+      cur_node = rb_left(t, cur_node);
+    }
+    else {
+      rank += rb_left(t, cur_node)->size + rb_count(cur_node);
+      cur_node = rb_right(t, cur_node);
+    }
+  }
+  return rank;
+}
+
+// k번째(0부터 셈)로 작은 key를 가진 node. k가 tree 크기 이상이면 NULL
+// node는 왼쪽 subtree 다음의 count칸을 차지한다.
+node_t *rbtree_select(const rbtree *t, size_t k) {
+  if (k >= t->root->size) {
+    return NULL;
+  }
+  node_t *cur_node = t->root;
+  while (k < rb_left(t, cur_node)->size || k >= rb_left(t, cur_node)->size + rb_count(cur_node)) {
+    if (k < rb_left(t, cur_node)->size) {
+      cur_node = rb_left(t, cur_node);
+    }
+    else {
+      k -= rb_left(t, cur_node)->size + rb_count(cur_node);
+      cur_node = rb_right(t, cur_node);
+    }
+  }
+  return cur_node;
+}
+
+
+// key 이상인 첫 node. 없으면 NULL
+node_t *rbtree_lower_bound(const rbtree *t, const key_t key) {
+  node_t *bound;
+  unsigned seq;
+  do {
+    seq = seq_read_begin(t);
+    bound = NULL;
+    node_t *cur_node = rb_root(t);
+    for (int depth = 0; cur_node != t->nil && depth < RBTREE_MAX_HEIGHT; depth++) {
+      if (key <= rb_key(cur_node)) {
+        bound = cur_node;
+        cur_node = rb_left(t, cur_node);
+      }
+      else {
+        cur_node = rb_right(t, cur_node);
+      }
+    }
+  } while (seq_read_retry(t, seq));
+  return bound;
+}
+
+// key보다 큰 첫 node. 없으면 NULL
+node_t *rbtree_upper_bound(const rbtree *t, const key_t key) {
+  node_t *bound;
+  unsigned seq;
+  do {
+    seq = seq_read_begin(t);
+    bound = NULL;
+    node_t *cur_node = rb_root(t);
+    for (int depth = 0; cur_node != t->nil && depth < RBTREE_MAX_HEIGHT; depth++) {
+      if (key < rb_key(cur_node)) {
+        bound = cur_node;
+        cur_node = rb_left(t, cur_node);
+      }
+      else {
+        cur_node = rb_right(t, cur_node);
+      }
+    }
+  } while (seq_read_retry(t, seq));
+  return bound;
+}
+
+// [lo, hi] 구간에 속한 key의 개수. subtree size 덕분에 구간을 걷지 않고 두 번의 rank로 구한다.
+size_t rbtree_range_count(const rbtree *t, const key_t lo, const key_t hi) {
+  if (hi < lo) {
+    return 0;
+  }
+  node_t *end = rbtree_upper_bound(t, hi);
+  size_t end_rank = (end == NULL) ? t->root->size : rbtree_rank(t, end->key);
+  return end_rank - rbtree_rank(t, lo);
+}
+
+// [lo, hi] 구간의 key를 순서대로 최대 cap개 arr에 채우고, 채운 개수를 반환한다.
+size_t rbtree_range_to_array(const rbtree *t, const key_t lo, const key_t hi, key_t *arr, const size_t cap) {
+  size_t count;
+  unsigned seq;
+  do {
+    seq = seq_read_begin(t);
+    count = 0;
+    node_t *cur_node = rbtree_lower_bound(t, lo);
+    while (cur_node != NULL && rb_key(cur_node) <= hi && count < cap) {
+      for (rb_size_t c = 0; c < rb_count(cur_node) && count < cap; c++) {
+        arr[count++] = rb_key(cur_node);
+      }
+      cur_node = rbtree_next(t, cur_node);
+    }
+  } while (seq_read_retry(t, seq));
+  return count;
+}
+
+// parent link를 따라 움직이므로 추가 메모리가 필요 없고, 전체 순회 시 한 걸음당 amortized O(1)이다.
+node_t *rbtree_first(const rbtree *t) {
+  return rbtree_min(t);
+}
+
+node_t *rbtree_last(const rbtree *t) {
+  return rbtree_max(t);
+}
+
+node_t *rbtree_next(const rbtree *t, const node_t *node) {
+  node_t *next = tree_successor(t, (node_t *)node);
+  return (next == t->nil) ? NULL : next;
+}
+
+node_t *rbtree_prev(const rbtree *t, const node_t *node) {
+  node_t *prev = tree_predecessor(t, (node_t *)node);
+  return (prev == t->nil) ? NULL : prev;
+}
+
+void rbtree_stats(const rbtree *t, rbtree_stats_t *out) {
+  memset(out, 0, sizeof(*out));
+#ifdef RBTREE_STATS
+  out->counters = t->counters;
+#endif
+  collect_depths(t, t->root, 0, out);
+  // 어느 경로로 내려가도 black node 수는 같으므로 왼쪽 끝 경로로 센다
+  for (node_t *cur_node = t->root; cur_node != t->nil; cur_node = rb_left(t, cur_node)) {
+    out->black_height += (rb_color(t, cur_node) == RBTREE_BLACK);
+  }
+}
+
+void rbtree_stats_reset(rbtree *t) {
+#ifdef RBTREE_STATS
+  memset(&t->counters, 0, sizeof(t->counters));
+#endif
+}
+
+/*
+  join/split과 집합 연산: black height가 긴 쪽의 가장자리를 따라 짧은 쪽과 높이가 맞는 곳까지 내려가 매다는 join 하나로
+  split, union, intersect, difference를 모두 만든다. 재귀 중에는 t->root를 건드리지 않고 떼어 낸 subtree끼리만 다룬다.
+*/
+
+void rbtree_join(rbtree *t1, const key_t key, rbtree *t2) {
+#ifdef RBTREE_COUNTED
+  // t1의 끝이나 t2의 앞에 key와 같은 node가 있으면 떼어 내고 그 count를 가운데 node로 옮긴다
+  const rb_size_t count = 1 + take_extreme(t1, t1->rightmost, key) + take_extreme(t2, t2->leftmost, key);
+#endif
+  int swapped;
+  rb_subtree moved = move_smaller(t1, t2, &swapped);
+  rb_subtree kept = whole_tree(t1);
+  node_t *k = new_node(t1, key, RBTREE_RED);
+#ifdef RBTREE_COUNTED
+  rb_set_count(k, count);
+#endif
+  set_whole_tree(t1, swapped ? join_subtrees(t1, moved, k, kept) : join_subtrees(t1, kept, k, moved));
+}
+
+size_t rbtree_split(rbtree *t, const key_t key, rbtree **lt, rbtree **gt) {
+  rb_subtree lo, rest, equal, hi;
+  split_subtree(t, whole_tree(t), key, 0, &lo, &rest);
+  split_subtree(t, rest, key, 1, &equal, &hi);
+  const size_t removed = equal.root->size;
+  free_subtree(t, equal.root);
+
+  // 작은 쪽은 새 tree로 복사하고, 큰 쪽은 t의 pool째로 넘긴다. t에는 새로 만든 빈 pool이 남는다.
+  *lt = new_rbtree_with_node_size(t->node_size, 0);
+  *gt = new_rbtree_with_node_size(t->node_size, 0);
+  const int lo_is_larger = lo.root->size >= hi.root->size;
+  rbtree *larger = lo_is_larger ? *lt : *gt, *smaller = lo_is_larger ? *gt : *lt;
+  rb_subtree larger_part = lo_is_larger ? lo : hi, smaller_part = lo_is_larger ? hi : lo;
+  set_whole_tree(smaller, (rb_subtree){clone_subtree(smaller, t, smaller_part.root), smaller_part.bh});
+  free_subtree(t, smaller_part.root);
+  set_whole_tree(t, larger_part);
+  swap_trees(t, larger);
+  return removed;
+}
+
+void rbtree_union(rbtree *t1, rbtree *t2, const int threads) {
+  int swapped;
+  rb_setop_task task = {0};
+  task.t = t1;
+  task.b = move_smaller(t1, t2, &swapped);
+  task.a = whole_tree(t1);
+  task.threads = threads;
+  task.garbage = t1->nil;
+  union_task(&task);
+  free_garbage(t1, task.garbage);
+  set_whole_tree(t1, task.result);
+}
+
+void rbtree_intersect(rbtree *t1, const rbtree *t2, const int threads) {
+  filter_tree(t1, t2, 1, threads);
+}
+
+void rbtree_difference(rbtree *t1, const rbtree *t2, const int threads) {
+  filter_tree(t1, t2, 0, threads);
+}
+
+/*
+  link 단위 API: key를 모르는 부분만 담당한다. key 비교는 호출하는 쪽(rbtree_template.h 등)이 한다.
+*/
+
+// free list에 반납된 node가 있으면 재사용하고, 없으면 pool의 마지막 slab(chunk)에서 하나 떼어 준다.
+// link와 color, size만 초기화하고 node_t 뒤에 붙은 부분은 건드리지 않는다.
+node_t *rbtree_alloc_node(rbtree *t) {
+  node_t *node;
+  RB_STAT_ADD(t, allocations, 1);
+  if (t->free_list != NULL) {
+    node = t->free_list;
+    t->free_list = (rb_right(t, node) == t->nil) ? NULL : rb_right(t, node);
+  }
+  else {
+#ifdef RBTREE_INDEX_LINKS
+    if (t->used == t->chunk_nodes) {
+      if (t->chunk_count == t->chunk_capacity || t->chunks[t->chunk_count] == NULL) {
+        add_chunk(t);
+      }
+      t->chunk_count++;
+      t->used = 0;
+    }
+    node = (node_t *)((char *)t->chunks[t->chunk_count - 1]->nodes + t->used++ * t->node_size);
+#else
+    rbtree_slab *slab = t->slabs;
+    if (slab == NULL || slab->used == slab->capacity) {
+      slab = add_slab(t, t->next_slab_size);
+    }
+    node = (node_t *)((char *)slab->nodes + slab->used++ * t->node_size);
+#endif
+  }
+  rb_set_parent(t, node, t->nil);
+  rb_set_left(t, node, t->nil);
+  rb_set_right(t, node, t->nil);
+  rb_set_color(t, node, RBTREE_RED);
+  node->size = 1;
+#ifdef RBTREE_COUNTED
+  rb_set_count(node, 1);
+#endif
+
+  return node;
+}
+
+// 호출하는 쪽이 내려가서 찾은 자리(parent의 왼쪽 또는 오른쪽)에 node를 매달고 균형을 맞춘다.
+// node의 link는 여기서 초기화하므로 pool 밖의 node(intrusive link)도 그대로 넘길 수 있다.
+void rbtree_insert_at(rbtree *t, node_t *parent, node_t *node, int as_left) {
+  rb_set_left(t, node, t->nil);
+  rb_set_right(t, node, t->nil);
+  rb_set_color(t, node, RBTREE_RED);
+  node->size = 1;
+#ifdef RBTREE_COUNTED
+  rb_set_count(node, 1);
+#endif
+  link_node(t, parent, node, as_left);
+  rb_insert_fixup(t, node);
+  t->finger = node;
+}
+
+#ifndef RBTREE_INDEX_LINKS
+/*
+  intrusive API: 사용자 구조체 안에 rb_link를 넣어 두고 그 link를 그대로 tree에 매단다. tree는 node를 할당하지 않는다.
+  비교 함수는 rbtree_entry로 바깥 구조체를 꺼내 비교한다.
+*/
+
+// 같은 것으로 비교되는 link는 오른쪽으로 보낸다.
+rb_link *rbtree_link_insert(rbtree *t, rb_link *link, rbtree_link_cmp cmp) {
+  node_t *parent = t->nil;
+  node_t *cur_node = t->root;
+  int as_left = 0;
+  while (cur_node != t->nil) {
+    parent = cur_node;
+    as_left = cmp(link, cur_node) < 0;
+    cur_node = as_left ? rb_left(t, cur_node) : rb_right(t, cur_node);
+  }
+  rbtree_insert_at(t, parent, link, as_left);
+  return link;
+}
+
+// cmp(key, link)는 key가 link보다 작으면 음수, 같으면 0, 크면 양수
+rb_link *rbtree_link_find(const rbtree *t, const void *key, rbtree_key_cmp cmp) {
+  node_t *cur_node = t->root;
+  while (cur_node != t->nil) {
+    const int result = cmp(key, cur_node);
+    if (result == 0) {
+      return cur_node;
+    }
+    cur_node = (result < 0) ? rb_left(t, cur_node) : rb_right(t, cur_node);
+  }
+  return NULL;
+}
+
+rb_link *rbtree_link_lower_bound(const rbtree *t, const void *key, rbtree_key_cmp cmp) {
+  node_t *bound = NULL;
+  node_t *cur_node = t->root;
+  while (cur_node != t->nil) {
+    if (cmp(key, cur_node) <= 0) {
+      bound = cur_node;
+      cur_node = rb_left(t, cur_node);
+    }
+    else {
+      cur_node = rb_right(t, cur_node);
+    }
+  }
+  return bound;
+}
+#endif
+
 
 /* 
   2. helper functions below 
 */
 
-int inorder_toarray(const rbtree *t, key_t *arr, node_t *root, int ticket) {
-  if (root == t->nil) {
-    return ticket;
-  }
+int compare_keys(const void *a, const void *b) {
+  const key_t lhs = *(const key_t *)a;
+  const key_t rhs = *(const key_t *)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
 
-  ticket = inorder_toarray(t, arr, root->left, ticket);
-  *(arr + ticket) = root->key;
-  ticket = inorder_toarray(t, arr, root->right, ++ticket);
-  return ticket;
+key_t *sorted_copy(const key_t *keys, size_t n) {
+  key_t *sorted = (key_t *)malloc(n * sizeof(key_t));
+  memcpy(sorted, keys, n * sizeof(key_t));
+  qsort(sorted, n, sizeof(key_t), compare_keys);
+  return sorted;
 }
 
 // 부모 관계만 계승해준다. 양쪽 자식과의 관계는 별도로 계승작업을 해줘야 한다.
 void rb_transplant(rbtree *t, node_t *node_to_transplant, node_t *replacement) {
-  if (node_to_transplant->parent == t->nil) {
-    t->root = replacement;
+  if (rb_parent(t, node_to_transplant) == t->nil) {
+    rb_set_root(t, replacement);
   }
-  else if (node_to_transplant == node_to_transplant->parent->left) {
-    node_to_transplant->parent->left = replacement;
+  else if (node_to_transplant == rb_left(t, rb_parent(t, node_to_transplant))) {
+    rb_set_left(t, rb_parent(t, node_to_transplant), replacement);
   }
   else {
-    node_to_transplant->parent->right = replacement;
+    rb_set_right(t, rb_parent(t, node_to_transplant), replacement);
   }
-  replacement->parent = node_to_transplant->parent;
+  rb_set_parent(t, replacement, rb_parent(t, node_to_transplant));
 }
 
-node_t *tree_minimum(rbtree *t, node_t *successor_node) {
-  while (successor_node->left != t->nil) {
-    successor_node = successor_node->left;
+node_t *tree_minimum(const rbtree *t, node_t *successor_node) {
+  for (int depth = 0; rb_left(t, successor_node) != t->nil && depth < RBTREE_MAX_HEIGHT; depth++) {
+    successor_node = rb_left(t, successor_node);
   }
   return successor_node;
 }
 
+node_t *tree_maximum(const rbtree *t, node_t *node) {
+  for (int depth = 0; rb_right(t, node) != t->nil && depth < RBTREE_MAX_HEIGHT; depth++) {
+    node = rb_right(t, node);
+  }
+  return node;
+}
+
+// inorder 순서상 다음 node. 오른쪽 subtree가 없으면 왼쪽 자식으로서 올라오게 되는 첫 조상이다. 없으면 nil
+node_t *tree_successor(const rbtree *t, node_t *node) {
+  if (rb_right(t, node) != t->nil) {
+    return tree_minimum(t, rb_right(t, node));
+  }
+  node_t *parent = rb_parent(t, node);
+  for (int depth = 0; parent != t->nil && node == rb_right(t, parent) && depth < RBTREE_MAX_HEIGHT; depth++) {
+    node = parent;
+    parent = rb_parent(t, parent);
+  }
+  return parent;
+}
+
+// tree_successor와 대칭
+node_t *tree_predecessor(const rbtree *t, node_t *node) {
+  if (rb_left(t, node) != t->nil) {
+    return tree_maximum(t, rb_left(t, node));
+  }
+  node_t *parent = rb_parent(t, node);
+  for (int depth = 0; parent != t->nil && node == rb_left(t, parent) && depth < RBTREE_MAX_HEIGHT; depth++) {
+    node = parent;
+    parent = rb_parent(t, parent);
+  }
+  return parent;
+}
+
 // broken_node 변수는 Introduction to algorithm 교과서에서의 x 변수, sibling은 w이다.
 // broken_node는 기본적으로 가지고 있는 색에 더해 black 색깔을 하나 더 가지고 있다고 가정한다.
 // 만약 broken_node의 색은 color attribute가 red라면 black-red,
@@ -180,239 +1023,1164 @@ node_t *tree_minimum(rbtree *t, node_t *successor_node) {
 // broken_node라고 명명한 이유는 property 1을 깨뜨리기 때문이다.
 void rb_delete_fixup(rbtree *t, node_t *broken_node) {
   // broken_node가 doubly-black인 경우에만 아래의 case들을 진행한다.
-  while (broken_node != t->root && broken_node->color == RBTREE_BLACK) {
+  while (broken_node != t->root && rb_color(t, broken_node) == RBTREE_BLACK) {
+    RB_STAT_ADD(t, delete_fixup_loops, 1);
     // Insertion 때와 비슷하게, broken_node가 parent의 좌측 child인지, 우측 child인지로 크게 경우를 나눈다.
-    if (broken_node == broken_node->parent->left) {
-      node_t *sibling = broken_node->parent->right;
+    if (broken_node == rb_left(t, rb_parent(t, broken_node))) {
+      node_t *sibling = rb_right(t, rb_parent(t, broken_node));
       // case 1: sibling이 red인 경우
       // case 1이 종료된 이후 새롭게 지정된 sibling은 반드시 black이기 때문에 case 2, case 3, 혹은 case 4로 넘어간다.
-      if (sibling->color == RBTREE_RED) {
-        sibling->color = RBTREE_BLACK;
-        broken_node->parent->color = RBTREE_RED;
-        left_rotate(t, broken_node->parent);
-        sibling = broken_node->parent->right;
+      if (rb_color(t, sibling) == RBTREE_RED) {
+        rb_set_color(t, sibling, RBTREE_BLACK);
+        rb_set_color(t, rb_parent(t, broken_node), RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 2);
+        left_rotate(t, rb_parent(t, broken_node));
+        sibling = rb_right(t, rb_parent(t, broken_node));
       }
       // case 2: sibling이 black이면서, sibling의 모든 자식들이 black인 경우
       // 만약 case 1에서 case 2로 넘어왔다면 새로운 broken_node는 black-red이기 때문에 case 2 종료 이후 while loop이 종료된다.
-      if (sibling->left->color == RBTREE_BLACK && sibling->right->color == RBTREE_BLACK) {
-        sibling->color = RBTREE_RED;
-        broken_node = broken_node->parent;
+      if (rb_color(t, rb_left(t, sibling)) == RBTREE_BLACK && rb_color(t, rb_right(t, sibling)) == RBTREE_BLACK) {
+        rb_set_color(t, sibling, RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 1);
+        broken_node = rb_parent(t, broken_node);
       }
       else {
         // case 3: sibling이 black이면서, sibling의 left child는 red, right child는 black인 경우
         // case 3가 종료되면 반드시 case 4로 넘어간 후 while loop이 종료된다.
-        if (sibling->right->color == RBTREE_BLACK) {
-          sibling->left->color = RBTREE_BLACK;
-          sibling->color = RBTREE_RED;
+        if (rb_color(t, rb_right(t, sibling)) == RBTREE_BLACK) {
+          rb_set_color(t, rb_left(t, sibling), RBTREE_BLACK);
+          rb_set_color(t, sibling, RBTREE_RED);
+          RB_STAT_ADD(t, recolors, 2);
           right_rotate(t, sibling);
-          sibling = broken_node->parent->right;
+          sibling = rb_right(t, rb_parent(t, broken_node));
         }
         // case 4: sibling이 black이면서, sibling의 left child는 모르고, right child는 red인 경우
-        sibling->color = broken_node->parent->color;
-        broken_node->parent->color = RBTREE_BLACK;
-        sibling->right->color = RBTREE_BLACK;
-        left_rotate(t, broken_node->parent);
+        rb_set_color(t, sibling, rb_color(t, rb_parent(t, broken_node)));
+        rb_set_color(t, rb_parent(t, broken_node), RBTREE_BLACK);
+        rb_set_color(t, rb_right(t, sibling), RBTREE_BLACK);
+        RB_STAT_ADD(t, recolors, 3);
+        left_rotate(t, rb_parent(t, broken_node));
         broken_node = t->root;
       }
     }
     // broken_node가 parent의 left-child일 때와 완전히 대칭적으로 반대이다.
     else {
-      node_t *sibling = broken_node->parent->left;
-      if (sibling->color == RBTREE_RED) {
-        sibling->color = RBTREE_BLACK;
-        broken_node->parent->color = RBTREE_RED;
-        right_rotate(t, broken_node->parent);
-        sibling = broken_node->parent->left;
+      node_t *sibling = rb_left(t, rb_parent(t, broken_node));
+      if (rb_color(t, sibling) == RBTREE_RED) {
+        rb_set_color(t, sibling, RBTREE_BLACK);
+        rb_set_color(t, rb_parent(t, broken_node), RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 2);
+        right_rotate(t, rb_parent(t, broken_node));
+        sibling = rb_left(t, rb_parent(t, broken_node));
       }
-      if (sibling->right->color == RBTREE_BLACK && sibling->left->color == RBTREE_BLACK) {
-        sibling->color = RBTREE_RED;
-        broken_node = broken_node->parent;
+      if (rb_color(t, rb_right(t, sibling)) == RBTREE_BLACK && rb_color(t, rb_left(t, sibling)) == RBTREE_BLACK) {
+        rb_set_color(t, sibling, RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 1);
+        broken_node = rb_parent(t, broken_node);
       }
       else {
-        if (sibling->left->color == RBTREE_BLACK) {
-          sibling->right->color = RBTREE_BLACK;
-          sibling->color = RBTREE_RED;
+        if (rb_color(t, rb_left(t, sibling)) == RBTREE_BLACK) {
+          rb_set_color(t, rb_right(t, sibling), RBTREE_BLACK);
+          rb_set_color(t, sibling, RBTREE_RED);
+          RB_STAT_ADD(t, recolors, 2);
           left_rotate(t, sibling);
-          sibling = broken_node->parent->left;
+          sibling = rb_left(t, rb_parent(t, broken_node));
         }
-        sibling->color = broken_node->parent->color;
-        broken_node->parent->color = RBTREE_BLACK;
-        sibling->left->color = RBTREE_BLACK;
-        right_rotate(t, broken_node->parent);
+        rb_set_color(t, sibling, rb_color(t, rb_parent(t, broken_node)));
+        rb_set_color(t, rb_parent(t, broken_node), RBTREE_BLACK);
+        rb_set_color(t, rb_left(t, sibling), RBTREE_BLACK);
+        RB_STAT_ADD(t, recolors, 3);
+        right_rotate(t, rb_parent(t, broken_node));
         broken_node = t->root;
       }
     }
   }
   // x가 black-red인 상황에서, x를 simple black으로 만들어주면 property 1이 회복됨과 동시에 모든 rb tree property가 지켜지게 된다. 
-  broken_node->color = RBTREE_BLACK;
+  RB_STAT_ADD(t, recolors, rb_color(t, broken_node) == RBTREE_RED);
+  rb_set_color(t, broken_node, RBTREE_BLACK);
 }
 
-void free_nodes_in_postorder(rbtree *t, node_t *root) {
-  if (root == t->nil) {
+// node 아래 subtree의 depth별 node 수와 높이를 out에 더한다
+void collect_depths(const rbtree *t, const node_t *node, size_t depth, rbtree_stats_t *out) {
+  if (node == t->nil) {
     return;
   }
+  out->node_count++;
+  if (depth < RBTREE_STATS_MAX_DEPTH) {
+    out->depth_histogram[depth]++;
+  }
+  if (depth + 1 > out->height) {
+    out->height = depth + 1;
+  }
+  collect_depths(t, rb_left(t, node), depth + 1, out);
+  collect_depths(t, rb_right(t, node), depth + 1, out);
+}
+
+// AMAC 방식: slot마다 진행 중인 탐색 하나를 들고 돌아가며 한 단계씩 내려간다.
+// 끝난 slot에는 다음 key를 root부터 넣고, 넣을 key가 없으면 마지막 slot을 그 자리로 당긴다.
+size_t interleaved_search(const rbtree *t, const key_t *keys, size_t n, node_t **out) {
+  node_t *cur[RBTREE_FIND_BATCH_GROUP];
+  size_t index[RBTREE_FIND_BATCH_GROUP];
+  int depth[RBTREE_FIND_BATCH_GROUP];
+  node_t *root = rb_root(t);
+  size_t next = 0, found = 0;
+  int active = 0;
+  for (; active < RBTREE_FIND_BATCH_GROUP && next < n; active++) {
+    cur[active] = root;
+    index[active] = next++;
+    depth[active] = 0;
+  }
+
+  while (active > 0) {
+    for (int slot = 0; slot < active;) {
+      node_t *node = cur[slot];
+      const key_t key = keys[index[slot]];
+      if (node != t->nil && depth[slot] < RBTREE_MAX_HEIGHT && key != rb_key(node)) {
+        RB_STAT_ADD(t, comparisons, 1);
+        node = (key < rb_key(node)) ? rb_left(t, node) : rb_right(t, node);
+        RB_PREFETCH(node);
+        cur[slot] = node;
+        depth[slot]++;
+        slot++;
+        continue;
+      }
+      if (node != t->nil && depth[slot] < RBTREE_MAX_HEIGHT) {
+        RB_STAT_ADD(t, comparisons, 1);
+        out[index[slot]] = node;
+        found++;
+      }
+      else {
+        out[index[slot]] = NULL;
+      }
 
-  free_nodes_in_postorder(t, root->left);
-  free_nodes_in_postorder(t, root->right);
-  free(root);
+      if (next < n) {
+        cur[slot] = root;
+        index[slot] = next++;
+        depth[slot] = 0;
+        slot++;
+      }
+      else {
+        active--;
+        cur[slot] = cur[active];
+        index[slot] = index[active];
+        depth[slot] = depth[active];
+      }
+    }
+  }
+  return found;
 }
 
 node_t *binary_search(const rbtree *t, node_t *node, key_t key) {
-  if (node == t->nil) {
+  for (int depth = 0; node != t->nil && depth < RBTREE_MAX_HEIGHT; depth++) {
+    RB_STAT_ADD(t, comparisons, 1);
+    if (key < rb_key(node)) {
+      node = rb_left(t, node);
+    }
+    else if (key == rb_key(node)) {
+      return node;
+    }
+    else {
+      node = rb_right(t, node);
+    }
+  }
+  return NULL;
+}
+
+// hash index가 있으면 hash에서, 없거나 대표 node를 아직 못 정한 key면 root에서 내려가 찾는다. 없으면 NULL
+node_t *find_node(const rbtree *t, key_t key) {
+#ifdef RBTREE_HASH_INDEX
+  if (t->hash.capacity != 0) {
+    const rb_hash_slot *slot = hash_lookup(t, key);
+    if (slot == NULL) {
+      return NULL;
+    }
+    if (slot->node != NULL) {
+      return slot->node;
+    }
+  }
+#endif
+  return binary_search(t, rb_root(t), key);
+}
+
+// 새 node를 index에 넣는다. 같은 key가 이미 있으면 node 수만 센다.
+void hash_add(rbtree *t, node_t *node) {
+#ifdef RBTREE_HASH_INDEX
+  rb_hash_index *h = &t->hash;
+  if (h->capacity == 0) {
+    return;
+  }
+  hash_migrate(h, RBTREE_HASH_MIGRATE_STEP);
+  rb_hash_slot *slot = hash_claim(h, node->key);
+  slot->count++;
+  if (slot->node == NULL) {
+    slot->node = node;
+  }
+#endif
+}
+
+// pool로 돌아가는 node를 index에서 뺀다. 같은 key의 node가 남으면 대표 node만 비워 두고, 다음 find가 tree에서 찾는다.
+void hash_remove(rbtree *t, node_t *node) {
+#ifdef RBTREE_HASH_INDEX
+  rb_hash_index *h = &t->hash;
+  if (h->capacity == 0) {
+    return;
+  }
+  hash_migrate(h, RBTREE_HASH_MIGRATE_STEP);
+  rb_hash_slot *slot = hash_lookup(t, node->key);
+  if (slot == NULL) {
+    return;
+  }
+  if (--slot->count == 0) {
+    slot->count = RBTREE_HASH_TOMBSTONE;
+    slot->node = NULL;
+    h->live--;
+  }
+  else if (slot->node == node) {
+    slot->node = NULL;
+  }
+#endif
+}
+
+// tree가 온전할 때(rbtree_erase 끝) 대표 node를 잃은 key에 남은 node 하나를 다시 정해 둔다.
+void hash_repair(rbtree *t, key_t key) {
+#ifdef RBTREE_HASH_INDEX
+  if (t->hash.capacity == 0) {
+    return;
+  }
+  rb_hash_slot *slot = hash_lookup(t, key);
+  if (slot != NULL && slot->node == NULL) {
+    slot->node = binary_search(t, t->root, key);
+  }
+#endif
+}
+
+#ifdef RBTREE_HASH_INDEX
+size_t hash_home(key_t key, size_t capacity) {
+  return (size_t)(((uint64_t)(uint32_t)key * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+// key의 칸. 없으면 NULL. table에는 늘 빈 칸이 남아 있으므로 탐색은 빈 칸에서 끝난다. 들여다본 칸 수를 probes에 더한다.
+rb_hash_slot *hash_probe(rb_hash_slot *slots, size_t capacity, key_t key, size_t *probes) {
+  if (capacity == 0) {
     return NULL;
   }
-  
-  if (key < node->key) {
-    return binary_search(t, node->left, key);
+  for (size_t i = hash_home(key, capacity);; i = (i + 1) & (capacity - 1)) {
+    (*probes)++;
+    if (slots[i].count == 0) {
+      return NULL;
+    }
+    if (slots[i].count != RBTREE_HASH_TOMBSTONE && slots[i].key == key) {
+      return &slots[i];
+    }
+  }
+}
+
+// key는 새 table과 이전 table 중 한 곳에만 있다 (옮긴 칸은 이전 table에서 지운 칸이 된다). 들여다본 칸은 비교로 센다.
+rb_hash_slot *hash_lookup(const rbtree *t, key_t key) {
+  size_t probes = 0;
+  rb_hash_slot *slot = hash_probe(t->hash.slots, t->hash.capacity, key, &probes);
+  if (slot == NULL) {
+    slot = hash_probe(t->hash.old_slots, t->hash.old_capacity, key, &probes);
+  }
+  RB_STAT_ADD(t, comparisons, probes);
+  return slot;
+}
+
+// 새 table에 없는 entry를 처음 만나는 빈 칸이나 지운 칸에 넣는다
+rb_hash_slot *hash_place(rb_hash_index *h, rb_hash_slot entry) {
+  size_t i = hash_home(entry.key, h->capacity);
+  while (h->slots[i].count != 0 && h->slots[i].count != RBTREE_HASH_TOMBSTONE) {
+    i = (i + 1) & (h->capacity - 1);
+  }
+  h->used += (h->slots[i].count == 0);
+  h->slots[i] = entry;
+  return &h->slots[i];
+}
+
+// 새 table에서 key의 칸을 돌려준다. 이전 table에 있으면 옮겨 오고, 어디에도 없으면 count가 0인 칸을 만든다.
+rb_hash_slot *hash_claim(rb_hash_index *h, key_t key) {
+  size_t probes = 0;
+  rb_hash_slot *slot = hash_probe(h->slots, h->capacity, key, &probes);
+  if (slot != NULL) {
+    return slot;
   }
-  else if (key == node->key) {
-    return node;
+  rb_hash_slot entry = {key, 0, NULL};
+  rb_hash_slot *old = hash_probe(h->old_slots, h->old_capacity, key, &probes);
+  if (old != NULL) {
+    entry = *old;
+    old->count = RBTREE_HASH_TOMBSTONE;
   }
   else {
-    return binary_search(t, node->right, key);
+    h->live++;
   }
+  // 지운 칸까지 쳐서 3/4가 차면 키운다 (지운 칸이 많으면 같은 크기로 다시 깐다)
+  if ((h->used + 1) * 4 > h->capacity * 3) {
+    hash_resize(h);
+  }
+  return hash_place(h, entry);
 }
 
+// 이전 table에서 steps칸을 새 table로 옮긴다. 옮긴 칸은 이전 table에서 지워 두고, 다 옮기면 이전 table을 버린다.
+// 옮기는 도중 새 table이 3/4 차면 hash_resize가 두 table을 한꺼번에 더 큰 table로 옮긴다.
+void hash_migrate(rb_hash_index *h, size_t steps) {
+  for (; h->old_slots != NULL && steps > 0; steps--) {
+    rb_hash_slot *entry = &h->old_slots[h->migrated];
+    if (entry->count != 0 && entry->count != RBTREE_HASH_TOMBSTONE) {
+      if ((h->used + 1) * 4 > h->capacity * 3) {
+        hash_resize(h);
+        return;
+      }
+      hash_place(h, *entry);
+      entry->count = RBTREE_HASH_TOMBSTONE;
+    }
+    if (++h->migrated == h->old_capacity) {
+      free(h->old_slots);
+      h->old_slots = NULL;
+      h->old_capacity = 0;
+    }
+  }
+}
+
+// 지금 table을 이전 table로 돌리고 key 수의 두 배 이상인 새 table을 잡는다. 옮기는 일은 hash_migrate가 조금씩 한다.
+// pool처럼 table도 줄이지는 않으므로 보통은 새 table이 다시 3/4 차기 전에 옮기기가 끝난다.
+// 앞선 옮기기가 남아 있으면 두 table을 모두 새 table로 바로 옮긴다. 새 table은 모든 key를 담고도 절반이 빈다.
+void hash_resize(rb_hash_index *h) {
+  size_t capacity = h->capacity;
+  while (capacity < 2 * (h->live + 1)) {
+    capacity *= 2;
+  }
+  rb_hash_slot *slots = h->slots;
+  const size_t old_capacity = h->capacity;
+  h->slots = (rb_hash_slot *)calloc(capacity, sizeof(rb_hash_slot));
+  h->capacity = capacity;
+  h->used = 0;
+  if (h->old_slots != NULL) {
+    hash_rehash(h, slots, old_capacity);
+    hash_rehash(h, h->old_slots, h->old_capacity);
+    h->old_slots = NULL;
+    h->old_capacity = 0;
+    return;
+  }
+  h->old_slots = slots;
+  h->old_capacity = old_capacity;
+  h->migrated = 0;
+}
+
+// slots의 살아 있는 칸을 모두 새 table로 옮기고 slots를 버린다
+void hash_rehash(rb_hash_index *h, rb_hash_slot *slots, size_t capacity) {
+  for (size_t i = 0; i < capacity; i++) {
+    if (slots[i].count != 0 && slots[i].count != RBTREE_HASH_TOMBSTONE) {
+      hash_place(h, slots[i]);
+    }
+  }
+  free(slots);
+}
+#endif
+
 node_t *new_node(rbtree *t, key_t key, color_t color) {
-  node_t *node_to_insert = (node_t *)calloc(1, sizeof(node_t));
-  node_to_insert->key = key;
-  node_to_insert->parent = t->nil;
-  node_to_insert->left = t->nil;
-  node_to_insert->right = t->nil;
-  node_to_insert->color = color;
+  node_t *node_to_insert = rbtree_alloc_node(t);
+  rb_set_key(node_to_insert, key);
+  rb_set_color(t, node_to_insert, color);
+  hash_add(t, node_to_insert);
 
   return node_to_insert;
 }
 
-node_t *bst_insert(rbtree *t, node_t *root, node_t *node_to_insert) {
-  if (root == t->nil)
-    return node_to_insert;
+void free_node(rbtree *t, node_t *node) {
+  hash_remove(t, node);
+  rb_set_right(t, node, (t->free_list == NULL) ? t->nil : t->free_list);
+  t->free_list = node;
+}
 
-  if (node_to_insert->key < root->key) {
-    root->left = bst_insert(t, root->left, node_to_insert);
-    root->left->parent = root;
+// key 순서대로 놓인 n개의 node를 완전히 균형 잡힌 tree로 다시 연결해 t->root로 삼는다. key는 건드리지 않는다.
+// order가 NULL이면 node를 inorder 순서로 새로 할당하면서 keys[i]를 채운다.
+void link_balanced(rbtree *t, node_t **order, const key_t *keys, size_t n) {
+  // 꽉 찬 level의 개수만큼은 black으로 칠하고, 그 아래 마지막 level(있다면)만 red로 칠하면
+  // 모든 경로의 black 개수가 같고 red node는 leaf에만 있게 된다.
+  int red_depth = 0;
+  while (((size_t)2 << red_depth) - 1 <= n) {
+    red_depth++;
+  }
+  rb_set_root(t, build_balanced(t, order, keys, 0, n, 0, red_depth));
+  rb_set_parent(t, t->root, t->nil);
+  set_extremes(t, tree_minimum(t, t->root), tree_maximum(t, t->root));
+}
+
+void set_extremes(rbtree *t, node_t *leftmost, node_t *rightmost) {
+  RB_STORE(t->leftmost, leftmost);
+  RB_STORE(t->rightmost, rightmost);
+}
+
+// [lo, hi) 구간의 가운데를 root로 삼아 재귀적으로 만든다. 재귀 깊이는 log n이다.
+node_t *build_balanced(rbtree *t, node_t **order, const key_t *keys, size_t lo, size_t hi, int depth, int red_depth) {
+  if (lo == hi) {
+    return t->nil;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *left = build_balanced(t, order, keys, lo, mid, depth + 1, red_depth);
+  node_t *root;
+  if (order != NULL) {
+    root = order[mid];
   }
   else {
-    root->right = bst_insert(t, root->right, node_to_insert);
-    root->right->parent = root;
+    root = new_node(t, keys[mid], RBTREE_BLACK);
+  }
+  node_t *right = build_balanced(t, order, keys, mid + 1, hi, depth + 1, red_depth);
+
+  rb_set_color(t, root, (depth >= red_depth) ? RBTREE_RED : RBTREE_BLACK);
+  root->size = left->size + right->size + rb_count(root);
+  rb_set_left(t, root, left);
+  rb_set_right(t, root, right);
+  if (left != t->nil) {
+    rb_set_parent(t, left, root);
+  }
+  if (right != t->nil) {
+    rb_set_parent(t, right, root);
   }
-  
   return root;
 }
 
+#ifdef RBTREE_INDEX_LINKS
+// chunks 배열 끝에 새 chunk를 붙인다. 아직 쓰지 않는 chunk이므로 chunk_count는 호출하는 쪽이 늘린다.
+rbtree_chunk *add_chunk(rbtree *t) {
+  RB_STAT_ADD(t, pool_refills, 1);
+  size_t slot = 0;
+  while (slot < t->chunk_capacity && t->chunks[slot] != NULL) {
+    slot++;
+  }
+  if (slot == t->chunk_capacity) {
+    size_t capacity = (t->chunk_capacity == 0) ? 4 : t->chunk_capacity * 2;
+    t->chunks = (rbtree_chunk **)realloc(t->chunks, capacity * sizeof(rbtree_chunk *));
+    for (size_t i = t->chunk_capacity; i < capacity; i++) {
+      t->chunks[i] = NULL;
+    }
+    t->chunk_capacity = capacity;
+  }
+  rbtree_chunk *chunk = (rbtree_chunk *)aligned_alloc(RBTREE_CHUNK_BYTES, RBTREE_CHUNK_BYTES);
+  chunk->base = (uint32_t)(slot << RBTREE_CHUNK_SHIFT);
+  t->chunks[slot] = chunk;
+  return chunk;
+}
+#else
+// slab 크기는 RBTREE_MAX_SLAB_SIZE까지 두 배씩 키운다. 미리 잡는 capacity는 상한 없이 그대로 쓴다.
+rbtree_slab *add_slab(rbtree *t, size_t capacity) {
+  RB_STAT_ADD(t, pool_refills, 1);
+  rbtree_slab *slab = (rbtree_slab *)malloc(sizeof(rbtree_slab) + capacity * t->node_size);
+  slab->next = t->slabs;
+  slab->capacity = capacity;
+  slab->used = 0;
+  t->slabs = slab;
+
+  if (t->next_slab_size < RBTREE_MAX_SLAB_SIZE) {
+    t->next_slab_size *= 2;
+  }
+  return slab;
+}
+#endif
+
+// start의 subtree 안에서 자리를 찾아 매단다. 같은 key는 오른쪽으로 보낸다.
+// start 위쪽 조상들도 subtree가 커지므로 size는 매단 뒤 root까지 올라가며 늘린다.
+void bst_insert(rbtree *t, node_t *start, node_t *node_to_insert) {
+  node_t *parent = (start == t->nil) ? t->nil : rb_parent(t, start);
+  node_t *cur_node = start;
+  while (cur_node != t->nil) {
+    parent = cur_node;
+    RB_STAT_ADD(t, comparisons, 1);
+    if (node_to_insert->key < cur_node->key) {
+      cur_node = rb_left(t, cur_node);
+    }
+    else {
+      cur_node = rb_right(t, cur_node);
+    }
+  }
+
+  link_node(t, parent, node_to_insert, parent != t->nil && node_to_insert->key < parent->key);
+}
+
+// node를 parent의 자식으로 매달고(parent가 nil이면 root로) root까지 올라가며 size를 늘린다. fixup은 하지 않는다.
+// leftmost의 왼쪽(rightmost의 오른쪽)에 매달린 node는 새 끝이 된다. 회전은 inorder 순서를 바꾸지 않으므로 끝은 그대로이다.
+void link_node(rbtree *t, node_t *parent, node_t *node, int as_left) {
+  rb_set_parent(t, node, parent);
+  if (parent == t->nil) {
+    rb_set_root(t, node);
+    set_extremes(t, node, node);
+  }
+  else if (as_left) {
+    rb_set_left(t, parent, node);
+    if (parent == t->leftmost) {
+      RB_STORE(t->leftmost, node);
+    }
+  }
+  else {
+    rb_set_right(t, parent, node);
+    if (parent == t->rightmost) {
+      RB_STORE(t->rightmost, node);
+    }
+  }
+
+  while (parent != t->nil) {
+    parent->size += rb_count(node);
+    parent = rb_parent(t, parent);
+  }
+}
+
+#ifdef RBTREE_COUNTED
+// start subtree에서 key를 찾는다. finger_subtree(.., 0)이 준 subtree라면 key는 start 바로 앞 조상(low)의 key 이상이므로,
+// subtree 밖에서 같은 key가 있을 수 있는 곳은 그 조상뿐이다.
+node_t *counted_find(const rbtree *t, node_t *start, key_t key) {
+  node_t *found = binary_search(t, start, key);
+  if (found != NULL || start == t->root || start == t->nil) {
+    return found;
+  }
+  node_t *child = start;
+  while (child != t->root && child == rb_left(t, rb_parent(t, child))) {
+    child = rb_parent(t, child);
+  }
+  return (child != t->root && rb_parent(t, child)->key == key) ? rb_parent(t, child) : NULL;
+}
+
+// node의 count와 root까지의 size를 delta만큼 바꾼다. link는 건드리지 않는다.
+void add_count(rbtree *t, node_t *node, int delta) {
+  rb_set_count(node, rb_count(node) + (rb_size_t)delta);
+  for (; node != t->nil; node = rb_parent(t, node)) {
+    node->size += (rb_size_t)delta;
+  }
+}
+
+// 끝 node가 key를 가지고 있으면 떼어 내고 그 count를 반환한다. 아니면 0
+rb_size_t take_extreme(rbtree *t, node_t *node, key_t key) {
+  if (node == t->nil || node->key != key) {
+    return 0;
+  }
+  const rb_size_t count = node->count;
+  rbtree_link_remove(t, node);
+  free_node(t, node);
+  return count;
+}
+#endif
+
+int goes_right(key_t key, key_t node_key, int equal_goes_left) {
+  return equal_goes_left ? key > node_key : key >= node_key;
+}
+
+// finger에서 위로 올라가며 key가 들어갈 자리를 품고 있는 가장 낮은 subtree의 root를 찾는다.
+// u의 subtree에는 u가 오른쪽 subtree에 속하는 가장 가까운 조상 low와, 왼쪽 subtree에 속하는 가장 가까운 조상 high
+// 사이의 key만 들어 있으므로, key가 그 사이에 들어올 때까지 경계를 벗어난 조상으로 올라간다.
+// equal_goes_left이면 lower bound 기준(같은 key는 왼쪽), 아니면 bst_insert 기준(같은 key는 오른쪽)이다.
+node_t *finger_subtree(const rbtree *t, node_t *finger, key_t key, int equal_goes_left) {
+  node_t *u = finger;
+  while (u != t->root) {
+    node_t *low = t->nil;
+    node_t *high = t->nil;
+    node_t *child = u;
+    while (child != t->root && (low == t->nil || high == t->nil)) {
+      node_t *parent = rb_parent(t, child);
+      if (child == rb_left(t, parent)) {
+        if (high == t->nil) {
+          high = parent;
+        }
+      }
+      else if (low == t->nil) {
+        low = parent;
+      }
+      child = parent;
+    }
+
+    if (low != t->nil && !goes_right(key, low->key, equal_goes_left)) {
+      u = low;
+    }
+    else if (high != t->nil && goes_right(key, high->key, equal_goes_left)) {
+      u = high;
+    }
+    else {
+      break;
+    }
+  }
+  return u;
+}
+
+// finger 근처에서 시작하는 rbtree_lower_bound. 없으면 NULL
+node_t *finger_lower_bound(const rbtree *t, node_t *finger, key_t key) {
+  node_t *subtree = finger_subtree(t, finger, key, 1);
+  node_t *bound = NULL;
+  node_t *cur_node = subtree;
+  while (cur_node != t->nil) {
+    if (key <= cur_node->key) {
+      bound = cur_node;
+      cur_node = rb_left(t, cur_node);
+    }
+    else {
+      cur_node = rb_right(t, cur_node);
+    }
+  }
+  if (bound != NULL) {
+    return bound;
+  }
+
+  // subtree 안의 key가 모두 작으면 답은 subtree 바깥, 처음으로 왼쪽 자식으로서 올라가는 조상이다.
+  while (subtree != t->root && subtree == rb_right(t, rb_parent(t, subtree))) {
+    subtree = rb_parent(t, subtree);
+  }
+  return (subtree == t->root) ? NULL : rb_parent(t, subtree);
+}
+
+// writer가 link를 고치는 구간을 홀수 seq로 감싼다. 구간은 겹치지 않게 쓴다. (회전 안에서 또 열지 않는다)
+void seq_write_begin(rbtree *t) {
+#ifdef RBTREE_CONCURRENT
+  __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+}
+
+void seq_write_end(rbtree *t) {
+#ifdef RBTREE_CONCURRENT
+  __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+// 진행 중인 구간이 끝날 때까지 기다렸다가 시작 seq를 돌려준다
+unsigned seq_read_begin(const rbtree *t) {
+#ifdef RBTREE_CONCURRENT
+  unsigned seq;
+  while ((seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE)) & 1) {
+  }
+  return seq;
+#else
+  return 0;
+#endif
+}
+
+// 읽는 동안 writer가 구간을 열었다면 1
+int seq_read_retry(const rbtree *t, const unsigned seq) {
+#ifdef RBTREE_CONCURRENT
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq;
+#else
+  return 0;
+#endif
+}
+
 void left_rotate(rbtree *t, node_t *pivot) {
-  node_t *right = pivot->right;
+  RB_STAT_ADD(t, rotations, 1);
+  seq_write_begin(t);
+  node_t *right = rb_right(t, pivot);
   
   // pivot의 right child가 가지고 있던 left child를 pivot의 right child로 갱신
-  pivot->right = right->left;
-  if (pivot->right != t->nil) {
-    pivot->right->parent = pivot;
+  rb_set_right(t, pivot, rb_left(t, right));
+  if (rb_right(t, pivot) != t->nil) {
+    rb_set_parent(t, rb_right(t, pivot), pivot);
   }
   
   // pivot의 right child가 기존 pivot의 부모와 연결관계 형성
-  right->parent = pivot->parent;
-  if (pivot->parent == t->nil) {
-    t->root = right;
-  } else if (pivot == pivot->parent->left) {
-    pivot->parent->left = right;
+  rb_set_parent(t, right, rb_parent(t, pivot));
+  if (rb_parent(t, pivot) == t->nil) {
+    rb_set_root(t, right);
+  } else if (pivot == rb_left(t, rb_parent(t, pivot))) {
+    rb_set_left(t, rb_parent(t, pivot), right);
   }
-  else if (pivot == pivot->parent->right) {
-    pivot->parent->right = right;
+  else if (pivot == rb_right(t, rb_parent(t, pivot))) {
+    rb_set_right(t, rb_parent(t, pivot), right);
   }
 
   // pivot의 right child와 pivot의 부모 관계를 역전
-  right->left = pivot;
-  pivot->parent = right;
+  rb_set_left(t, right, pivot);
+  rb_set_parent(t, pivot, right);
+
+  // right가 pivot의 subtree 전체를 물려받고, pivot은 자식들로부터 다시 계산
+  right->size = pivot->size;
+  pivot->size = rb_left(t, pivot)->size + rb_right(t, pivot)->size + rb_count(pivot);
+  seq_write_end(t);
 }
 
 void right_rotate(rbtree *t, node_t *pivot) {
-  node_t *left = pivot->left;
+  RB_STAT_ADD(t, rotations, 1);
+  seq_write_begin(t);
+  node_t *left = rb_left(t, pivot);
   
   // pivot의 left child가 가지고 있던 right child를 pivot의 left child로 갱신
-  pivot->left = left->right;
-  if (pivot->left != t->nil) {
-    pivot->left->parent = pivot;
+  rb_set_left(t, pivot, rb_right(t, left));
+  if (rb_left(t, pivot) != t->nil) {
+    rb_set_parent(t, rb_left(t, pivot), pivot);
   }
   
   // pivot의 left child가 기존 pivot의 부모와 연결관계 형성
-  left->parent = pivot->parent;
-  if (pivot->parent == t->nil) {
-    t->root = left;
-  } else if (pivot == pivot->parent->left) {
-    pivot->parent->left = left;
+  rb_set_parent(t, left, rb_parent(t, pivot));
+  if (rb_parent(t, pivot) == t->nil) {
+    rb_set_root(t, left);
+  } else if (pivot == rb_left(t, rb_parent(t, pivot))) {
+    rb_set_left(t, rb_parent(t, pivot), left);
   }
-  else if (pivot == pivot->parent->right) {
-    pivot->parent->right = left;
+  else if (pivot == rb_right(t, rb_parent(t, pivot))) {
+    rb_set_right(t, rb_parent(t, pivot), left);
   }
 
   // pivot의 right child와 pivot의 부모 관계를 역전
-  left->right = pivot;
-  pivot->parent = left;
+  rb_set_right(t, left, pivot);
+  rb_set_parent(t, pivot, left);
+
+  left->size = pivot->size;
+  pivot->size = rb_left(t, pivot)->size + rb_right(t, pivot)->size + rb_count(pivot);
+  seq_write_end(t);
 }
 
 void rb_insert_fixup(rbtree *t, node_t *node_to_insert) {
   node_t *pt = node_to_insert;
   
-  while (pt != t->root && pt->color == RBTREE_RED && pt->parent->color == RBTREE_RED) {
-    node_t *pt_parent = pt->parent;
-    node_t *pt_grandparent = pt->parent->parent;
+  while (pt != t->root && rb_color(t, pt) == RBTREE_RED && rb_color(t, rb_parent(t, pt)) == RBTREE_RED) {
+    node_t *pt_parent = rb_parent(t, pt);
+    node_t *pt_grandparent = rb_parent(t, rb_parent(t, pt));
+    RB_STAT_ADD(t, insert_fixup_loops, 1);
 
     // case A: when pt_parent is left child of pt_grandparent
-    if (pt_parent == pt_grandparent->left) {
-      node_t *pt_uncle = pt_grandparent->right;
+    if (pt_parent == rb_left(t, pt_grandparent)) {
+      node_t *pt_uncle = rb_right(t, pt_grandparent);
       // case 1: pt_uncle is red
-      if (pt_uncle != t->nil && pt_uncle->color == RBTREE_RED) {
-        pt_grandparent->color = RBTREE_RED;
-        pt_parent->color = RBTREE_BLACK;
-        pt_uncle->color = RBTREE_BLACK;
+      if (pt_uncle != t->nil && rb_color(t, pt_uncle) == RBTREE_RED) {
+        rb_set_color(t, pt_grandparent, RBTREE_RED);
+        rb_set_color(t, pt_parent, RBTREE_BLACK);
+        rb_set_color(t, pt_uncle, RBTREE_BLACK);
+        RB_STAT_ADD(t, recolors, 3);
         pt = pt_grandparent;
       }
 
       else {
         // case 2: pt_uncle is black and pt is right child of pt_parent(triangle)
-        if (pt == pt_parent->right) {
+        if (pt == rb_right(t, pt_parent)) {
           left_rotate(t, pt_parent);
           pt = pt_parent;
-          pt_parent = pt->parent;
+          pt_parent = rb_parent(t, pt);
         }
         // case 3: pt_uncle is black is left child of pt_parent(line)
         // case 3가 진행되면 while loop는 반드시 종료된다.
         right_rotate(t, pt_grandparent);
-        pt_parent->color = RBTREE_BLACK;
-        pt_grandparent->color = RBTREE_RED;
+        rb_set_color(t, pt_parent, RBTREE_BLACK);
+        rb_set_color(t, pt_grandparent, RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 2);
         pt = pt_parent;
       }
     }
 
     // case B: when pt_parent is right child of pt_grandparent
-    else if (pt_parent == pt_grandparent->right) {
-      node_t *pt_uncle = pt_grandparent->left;
+    else if (pt_parent == rb_right(t, pt_grandparent)) {
+      node_t *pt_uncle = rb_left(t, pt_grandparent);
       // case 1: pt_uncle is red
-      if (pt_uncle != t->nil && pt_uncle->color == RBTREE_RED) {
-        pt_grandparent->color = RBTREE_RED;
-        pt_parent->color = RBTREE_BLACK;
-        pt_uncle->color = RBTREE_BLACK;
+      if (pt_uncle != t->nil && rb_color(t, pt_uncle) == RBTREE_RED) {
+        rb_set_color(t, pt_grandparent, RBTREE_RED);
+        rb_set_color(t, pt_parent, RBTREE_BLACK);
+        rb_set_color(t, pt_uncle, RBTREE_BLACK);
+        RB_STAT_ADD(t, recolors, 3);
         pt = pt_grandparent;
       }
 
       else {
         // case 2: pt_uncle is black and pt is left child of pt_parent(triangle)
-        if (pt == pt_parent->left) {
+        if (pt == rb_left(t, pt_parent)) {
           right_rotate(t, pt_parent);
           pt = pt_parent;
-          pt_parent = pt->parent;
+          pt_parent = rb_parent(t, pt);
         }
         // case 3: pt_uncle is black is right child of pt_parent(line)
         left_rotate(t, pt_grandparent);
-        pt_parent->color = RBTREE_BLACK;
-        pt_grandparent->color = RBTREE_RED;
+        rb_set_color(t, pt_parent, RBTREE_BLACK);
+        rb_set_color(t, pt_grandparent, RBTREE_RED);
+        RB_STAT_ADD(t, recolors, 2);
         pt = pt_parent;
       }
     }
   }
-  t->root->color = RBTREE_BLACK;
+  RB_STAT_ADD(t, recolors, rb_color(t, t->root) == RBTREE_RED);
+  rb_set_color(t, t->root, RBTREE_BLACK);
+}
+
+
+// black height가 같은 경로 어디서 재도 같으므로 왼쪽 끝 경로로 센다
+int black_height(const rbtree *t, node_t *node) {
+  int bh = 0;
+  for (; node != t->nil; node = rb_left(t, node)) {
+    bh += (rb_color(t, node) == RBTREE_BLACK);
+  }
+  return bh;
+}
+
+// node 아래에 left, right를 매달고 size를 다시 센다. node의 parent는 건드리지 않는다.
+// nil의 link는 쓰지 않으므로 서로 다른 subtree를 여러 thread에서 동시에 다룰 수 있다.
+node_t *attach(rbtree *t, node_t *left, node_t *node, node_t *right) {
+  rb_set_left(t, node, left);
+  rb_set_right(t, node, right);
+  if (left != t->nil) {
+    rb_set_parent(t, left, node);
+  }
+  if (right != t->nil) {
+    rb_set_parent(t, right, node);
+  }
+  node->size = left->size + right->size + rb_count(node);
+  return node;
+}
+
+// node의 오른쪽 자식을 올려 새 subtree root로 반환한다. 새 root의 parent는 호출하는 쪽이 잇는다.
+node_t *rotate_left_subtree(rbtree *t, node_t *node) {
+  node_t *up = rb_right(t, node);
+  attach(t, rb_left(t, node), node, rb_left(t, up));
+  return attach(t, node, up, rb_right(t, up));
+}
+
+node_t *rotate_right_subtree(rbtree *t, node_t *node) {
+  node_t *up = rb_left(t, node);
+  attach(t, rb_right(t, up), node, rb_right(t, node));
+  return attach(t, rb_left(t, up), up, node);
+}
+
+// l의 오른쪽 가장자리를 따라 black height가 r_bh인 black node까지 내려가 그 자리에 (그 node, k, r)을 red로 매단다.
+// 올라오면서 red가 연달아 놓인 곳은 회전으로 푼다. 남는 red-red는 root에서 join_subtrees가 정리한다.
+node_t *join_right(rbtree *t, node_t *l, int l_bh, node_t *k, node_t *r, int r_bh) {
+  if (rb_color(t, l) == RBTREE_BLACK && l_bh == r_bh) {
+    rb_set_color(t, k, RBTREE_RED);
+    return attach(t, l, k, r);
+  }
+  node_t *right = join_right(t, rb_right(t, l), l_bh - (rb_color(t, l) == RBTREE_BLACK), k, r, r_bh);
+  attach(t, rb_left(t, l), l, right);
+  if (rb_color(t, l) == RBTREE_BLACK && rb_color(t, right) == RBTREE_RED &&
+      rb_color(t, rb_right(t, right)) == RBTREE_RED) {
+    rb_set_color(t, rb_right(t, right), RBTREE_BLACK);
+    return rotate_left_subtree(t, l);
+  }
+  return l;
+}
+
+node_t *join_left(rbtree *t, node_t *l, int l_bh, node_t *k, node_t *r, int r_bh) {
+  if (rb_color(t, r) == RBTREE_BLACK && r_bh == l_bh) {
+    rb_set_color(t, k, RBTREE_RED);
+    return attach(t, l, k, r);
+  }
+  node_t *left = join_left(t, l, l_bh, k, rb_left(t, r), r_bh - (rb_color(t, r) == RBTREE_BLACK));
+  attach(t, left, r, rb_right(t, r));
+  if (rb_color(t, r) == RBTREE_BLACK && rb_color(t, left) == RBTREE_RED &&
+      rb_color(t, rb_left(t, left)) == RBTREE_RED) {
+    rb_set_color(t, rb_left(t, left), RBTREE_BLACK);
+    return rotate_right_subtree(t, r);
+  }
+  return r;
+}
+
+// l의 key <= k의 key <= r의 key. 비용은 두 black height의 차이에 비례한다.
+rb_subtree join_subtrees(rbtree *t, rb_subtree l, node_t *k, rb_subtree r) {
+  rb_subtree joined;
+  if (l.bh > r.bh) {
+    joined.root = join_right(t, l.root, l.bh, k, r.root, r.bh);
+    joined.bh = l.bh;
+    if (rb_color(t, joined.root) == RBTREE_RED && rb_color(t, rb_right(t, joined.root)) == RBTREE_RED) {
+      rb_set_color(t, joined.root, RBTREE_BLACK);
+      joined.bh++;
+    }
+  }
+  else if (r.bh > l.bh) {
+    joined.root = join_left(t, l.root, l.bh, k, r.root, r.bh);
+    joined.bh = r.bh;
+    if (rb_color(t, joined.root) == RBTREE_RED && rb_color(t, rb_left(t, joined.root)) == RBTREE_RED) {
+      rb_set_color(t, joined.root, RBTREE_BLACK);
+      joined.bh++;
+    }
+  }
+  else {
+    const int red = rb_color(t, l.root) == RBTREE_BLACK && rb_color(t, r.root) == RBTREE_BLACK;
+    rb_set_color(t, k, red ? RBTREE_RED : RBTREE_BLACK);
+    joined.root = attach(t, l.root, k, r.root);
+    joined.bh = l.bh + !red;
+  }
+  rb_set_parent(t, joined.root, t->nil);
+  return joined;
+}
+
+// 가운데 key 없이 잇는다. l의 마지막 node를 떼어 내 가운데 key로 쓴다.
+rb_subtree concat_subtrees(rbtree *t, rb_subtree l, rb_subtree r) {
+  if (r.root == t->nil) {
+    return l;
+  }
+  if (l.root == t->nil) {
+    return r;
+  }
+  node_t *last;
+  rb_subtree rest = split_last(t, l, &last);
+  return join_subtrees(t, rest, last, r);
+}
+
+rb_subtree split_last(rbtree *t, rb_subtree tree, node_t **last) {
+  node_t *node = tree.root;
+  const int child_bh = tree.bh - (rb_color(t, node) == RBTREE_BLACK);
+  rb_subtree left = {rb_left(t, node), child_bh};
+  if (rb_right(t, node) == t->nil) {
+    *last = node;
+    if (left.root != t->nil) {
+      rb_set_parent(t, left.root, t->nil);
+    }
+    return left;
+  }
+  rb_subtree rest = split_last(t, (rb_subtree){rb_right(t, node), child_bh}, last);
+  return join_subtrees(t, left, node, rest);
+}
+
+// key보다 작은 node(equal_to_lo면 key 이하)는 lo로, 나머지는 hi로 나눈다.
+// 내려간 경로의 반대쪽 subtree들을 올라오며 차례로 join하는데, 그 비용의 합이 O(log n)이다.
+void split_subtree(rbtree *t, rb_subtree tree, const key_t key, const int equal_to_lo, rb_subtree *lo, rb_subtree *hi) {
+  node_t *node = tree.root;
+  if (node == t->nil) {
+    *lo = *hi = (rb_subtree){t->nil, 0};
+    return;
+  }
+  const int child_bh = tree.bh - (rb_color(t, node) == RBTREE_BLACK);
+  rb_subtree left = {rb_left(t, node), child_bh}, right = {rb_right(t, node), child_bh};
+  if (equal_to_lo ? node->key <= key : node->key < key) {
+    split_subtree(t, right, key, equal_to_lo, lo, hi);
+    *lo = join_subtrees(t, left, node, *lo);
+  }
+  else {
+    split_subtree(t, left, key, equal_to_lo, lo, hi);
+    *hi = join_subtrees(t, *hi, node, right);
+  }
+}
+
+rb_subtree whole_tree(const rbtree *t) {
+  return (rb_subtree){t->root, black_height(t, t->root)};
+}
+
+// subtree를 t 전체로 삼는다. root는 black으로 칠하고 끝 node 캐시를 다시 구한다.
+void set_whole_tree(rbtree *t, rb_subtree tree) {
+  if (tree.root != t->nil) {
+    rb_set_parent(t, tree.root, t->nil);
+    rb_set_color(t, tree.root, RBTREE_BLACK);
+  }
+  rb_set_root(t, tree.root);
+  set_extremes(t, tree_minimum(t, tree.root), tree_maximum(t, tree.root));
+  t->finger = NULL;
+}
+
+// 큰 쪽이 t1에 오도록 두 handle을 맞바꾼 뒤, 작은 쪽 node를 t1의 pool로 복사하고 t2를 비운다.
+// 복사한 subtree를 반환하고, 맞바꿨으면 *swapped를 1로 한다.
+rb_subtree move_smaller(rbtree *t1, rbtree *t2, int *swapped) {
+  *swapped = rbtree_size(t2) > rbtree_size(t1);
+  if (*swapped) {
+    swap_trees(t1, t2);
+  }
+  rb_subtree moved = {clone_subtree(t1, t2, t2->root), black_height(t2, t2->root)};
+  free_subtree(t2, t2->root);
+  set_whole_tree(t2, (rb_subtree){t2->nil, 0});
+  return moved;
+}
+
+// 두 handle의 내용(pool, nil, root)을 맞바꾼다. node는 움직이지 않는다. counter는 handle에 남긴다.
+void swap_trees(rbtree *a, rbtree *b) {
+  rbtree tmp = *a;
+  *a = *b;
+  *b = tmp;
+#ifdef RBTREE_STATS
+  rbtree_counters counters = a->counters;
+  a->counters = b->counters;
+  b->counters = counters;
+#endif
+}
+
+// 모양과 color를 그대로 복사한다. node는 inorder 순서로 할당하므로 dst의 pool에 key 순서대로 놓인다.
+node_t *clone_subtree(rbtree *dst, const rbtree *src, const node_t *node) {
+  if (node == src->nil) {
+    return dst->nil;
+  }
+  node_t *left = clone_subtree(dst, src, rb_left(src, node));
+  node_t *copy = rbtree_alloc_node(dst);
+  memcpy((char *)copy + sizeof(node_t), (const char *)node + sizeof(node_t), dst->node_size - sizeof(node_t));
+  rb_set_key(copy, node->key);
+#ifdef RBTREE_COUNTED
+  rb_set_count(copy, rb_count(node));
+#endif
+  rb_set_color(dst, copy, rb_color(src, node));
+  hash_add(dst, copy);
+  node_t *right = clone_subtree(dst, src, rb_right(src, node));
+  return attach(dst, left, copy, right);
+}
+
+void free_subtree(rbtree *t, node_t *node) {
+  if (node == t->nil) {
+    return;
+  }
+  node_t *right = rb_right(t, node);
+  free_subtree(t, rb_left(t, node));
+  free_node(t, node);
+  free_subtree(t, right);
+}
+
+// free list는 tree 하나에 하나뿐이라 재귀 중에는 버릴 subtree를 모아 두기만 하고, 다 끝난 뒤에 반납한다.
+void push_garbage(rbtree *t, node_t **list, node_t *subtree) {
+  rb_set_parent(t, subtree, *list);
+  *list = subtree;
+}
+
+void move_garbage(rbtree *t, node_t **list, node_t *from) {
+  while (from != t->nil) {
+    node_t *next = rb_parent(t, from);
+    push_garbage(t, list, from);
+    from = next;
+  }
+}
+
+void free_garbage(rbtree *t, node_t *list) {
+  while (list != t->nil) {
+    node_t *next = rb_parent(t, list);
+    free_subtree(t, list);
+    list = next;
+  }
+}
+
+void filter_tree(rbtree *t1, const rbtree *t2, const int keep_common, const int threads) {
+  rb_setop_task task = {0};
+  task.t = t1;
+  task.other = t2;
+  task.a = whole_tree(t1);
+  task.probe = t2->root;
+  task.keep_common = keep_common;
+  task.threads = threads;
+  task.garbage = t1->nil;
+  filter_task(&task);
+  free_garbage(t1, task.garbage);
+  set_whole_tree(t1, task.result);
+}
+
+// 두 하위 문제를 푼다. thread가 남았고 일이 충분히 크면 right를 새 thread에 맡기고 thread 수도 반씩 나눠 준다.
+void run_pair(rb_setop_task *left, rb_setop_task *right, void *(*fn)(void *), const size_t work) {
+  const int threads = left->threads;
+  if (threads > 1 && work >= RBTREE_PARALLEL_GRAIN) {
+    pthread_t thread;
+    left->threads = threads - threads / 2;
+    right->threads = threads / 2;
+    if (pthread_create(&thread, NULL, fn, right) == 0) {
+      fn(left);
+      pthread_join(thread, NULL);
+      return;
+    }
+  }
+  fn(left);
+  fn(right);
 }
 
+// a의 root를 기준으로 b를 나눠 양쪽을 각각 합친 뒤 root로 다시 join한다.
+// RBTREE_COUNTED에서는 b에서 root와 같은 key의 node를 떼어 내 root의 count로 더하고 그 node는 버린다.
+void *union_task(void *arg) {
+  rb_setop_task *task = (rb_setop_task *)arg;
+  rbtree *t = task->t;
+  if (task->a.root == t->nil || task->b.root == t->nil) {
+    task->result = (task->a.root == t->nil) ? task->b : task->a;
+    return NULL;
+  }
+  node_t *pivot = task->a.root;
+  const int child_bh = task->a.bh - (rb_color(t, pivot) == RBTREE_BLACK);
+  const size_t work = pivot->size + task->b.root->size;
+  rb_setop_task left = *task, right = *task;
+  left.garbage = right.garbage = t->nil;
+  left.a = (rb_subtree){rb_left(t, pivot), child_bh};
+  right.a = (rb_subtree){rb_right(t, pivot), child_bh};
+#ifdef RBTREE_COUNTED
+  rb_subtree rest, equal;
+  split_subtree(t, task->b, pivot->key, 0, &left.b, &rest);
+  split_subtree(t, rest, pivot->key, 1, &equal, &right.b);
+  if (equal.root != t->nil) {
+    rb_set_count(pivot, rb_count(pivot) + rb_count(equal.root));
+    push_garbage(t, &task->garbage, equal.root);
+  }
+#else
+  split_subtree(t, task->b, pivot->key, 0, &left.b, &right.b);
+#endif
+  run_pair(&left, &right, union_task, work);
+  move_garbage(t, &task->garbage, left.garbage);
+  move_garbage(t, &task->garbage, right.garbage);
+  task->result = join_subtrees(t, left.result, pivot, right.result);
+  return NULL;
+}
+
+// probe의 key로 a를 작은 쪽, 같은 쪽, 큰 쪽으로 나누고, 작은 쪽과 큰 쪽은 probe의 양쪽 subtree로 다시 거른다.
+// 같은 쪽은 intersect면 남기고 difference면 버린다.
+void *filter_task(void *arg) {
+  rb_setop_task *task = (rb_setop_task *)arg;
+  rbtree *t = task->t;
+  if (task->a.root == t->nil) {
+    task->result = task->a;
+    return NULL;
+  }
+  if (task->probe == task->other->nil) {
+    if (task->keep_common) {
+      push_garbage(t, &task->garbage, task->a.root);
+      task->result = (rb_subtree){t->nil, 0};
+    }
+    else {
+      task->result = task->a;
+    }
+    return NULL;
+  }
+  const key_t key = task->probe->key;
+  const size_t work = task->a.root->size;
+  rb_subtree rest, equal;
+  rb_setop_task left = *task, right = *task;
+  left.garbage = right.garbage = t->nil;
+  left.probe = rb_left(task->other, task->probe);
+  right.probe = rb_right(task->other, task->probe);
+  split_subtree(t, task->a, key, 0, &left.a, &rest);
+  split_subtree(t, rest, key, 1, &equal, &right.a);
+  run_pair(&left, &right, filter_task, work);
+
+  move_garbage(t, &task->garbage, left.garbage);
+  move_garbage(t, &task->garbage, right.garbage);
+  if (task->keep_common) {
+    task->result = concat_subtrees(t, concat_subtrees(t, left.result, equal), right.result);
+  }
+  else {
+    if (equal.root != t->nil) {
+      push_garbage(t, &task->garbage, equal.root);
+    }
+    task->result = concat_subtrees(t, left.result, right.result);
+  }
+  return NULL;
+}
+
+// thread가 남았으면 node의 왼쪽과 오른쪽 subtree에 크기에 비례해 thread를 나눠 주고, 오른쪽은 새 thread에서 돈다.
+// 더 나누지 않는 subtree는 parent link를 따라 inorder로 훑는다.
+void *export_task(void *arg) {
+  rb_export_task *task = (rb_export_task *)arg;
+  const rbtree *t = task->t;
+  node_t *node = task->node;
+  if (node == t->nil || task->offset >= task->n) {
+    return NULL;
+  }
+  if (task->threads > 1 && node->size >= RBTREE_PARALLEL_GRAIN) {
+    node_t *left = rb_left(t, node);
+    const size_t mid = task->offset + left->size;
+    for (size_t i = mid; i < mid + rb_count(node) && i < task->n; i++) {
+      task->arr[i] = node->key;
+    }
+    rb_export_task lo = *task, hi = *task;
+    lo.node = left;
+    hi.node = rb_right(t, node);
+    hi.offset = mid + rb_count(node);
+    lo.threads = (int)(((size_t)task->threads * left->size + node->size / 2) / node->size);
+    lo.threads = (lo.threads < 1) ? 1 : (lo.threads > task->threads - 1) ? task->threads - 1 : lo.threads;
+    hi.threads = task->threads - lo.threads;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, export_task, &hi) == 0) {
+      export_task(&lo);
+      pthread_join(thread, NULL);
+      return NULL;
+    }
+    lo.threads = hi.threads = 1;
+    export_task(&lo);
+    export_task(&hi);
+    return NULL;
+  }
+
+  const size_t end = (task->offset + node->size < task->n) ? task->offset + node->size : task->n;
+  node_t *p = tree_minimum(t, node);
+  for (size_t i = task->offset; i < end; p = tree_successor(t, p)) {
+    for (rb_size_t c = 0; c < rb_count(p) && i < end; c++) {
+      task->arr[i++] = p->key;
+    }
+  }
+  return NULL;
+}
 
 // // Temporary driver code
 // void inorder(node_t *root) {
@@ -441,4 +2209,4 @@ void rb_insert_fixup(rbtree *t, node_t *node_to_insert) {
 //   rbtree_insert(t, 0);
 
 //   inorder(t->root);
-// }
\ No newline at end of file
+// }
@@ -2,31 +2,359 @@
 #define _RBTREE_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum { RBTREE_RED, RBTREE_BLACK } color_t;
 
 typedef int key_t;
 
+/*
+  node 배치는 compile time에 고른다.
+  - 기본: color, key, 세 개의 pointer, size_t size (40 bytes)
+  - RBTREE_COMPACT: color를 parent pointer의 최하위 bit에 넣고 size를 32bit로 줄인다 (32 bytes)
+  - RBTREE_INDEX_LINKS: parent/left/right를 tree별 node 배열의 32bit index로 바꾼다.
+    color는 parent index의 최하위 bit에 들어간다 (20 bytes)
+  어느 배치든 link는 rb_parent/rb_left/... 를 통해서만 읽고 쓴다.
+
+  subtree size는 어느 배치에서도 빼지 않는다. rbtree_size, rank/select/range_count, 끝을 지키는 rbtree_to_array,
+  batch의 rebuild 판단, join/split과 집합 연산, 병렬 to_array가 모두 이 값을 읽으므로 끄면 이 연산들이 O(n)이 된다.
+  기본 배치에서는 8 bytes(32 → 40)를 더 쓰고, RBTREE_COMPACT에서는 key 뒤의 padding에 들어가 크기가 그대로다.
+  node를 줄여야 하면 RBTREE_COMPACT나 RBTREE_INDEX_LINKS를 쓴다.
+
+  RBTREE_COUNTED를 켜면 같은 key를 node 하나에 모으고 node의 count에 개수를 센다. (어느 배치와도 함께 쓸 수 있다)
+  - rbtree_insert는 같은 key가 있으면 그 node의 count만 늘리고 그 node를 반환한다. 할당도 회전도 없다.
+  - rbtree_erase는 count를 하나 줄이고, 0이 되면 node를 떼어 낸다. rbtree_link_remove는 count와 상관없이 node를 떼어 낸다.
+  - size와 rank/select/range_count, rbtree_to_array는 지금처럼 key 개수로 센다. rbtree_next/prev는 node 단위로 움직인다.
+  - intrusive/template tree는 비교 함수가 같다고 해도 모으지 않는다. count는 늘 1이다.
+
+  RBTREE_HASH_INDEX를 켜면 tree마다 key → node hash index를 함께 들고, rbtree_find와 rbtree_count, rbtree_erase_key는
+  tree를 내려가지 않고 hash에서 바로 찾는다. min/max, range, rank, to_array처럼 순서가 필요한 연산은 그대로 tree를 쓴다.
+  - 같은 key의 node가 여럿이면(RBTREE_COUNTED가 아닐 때) index는 그 node 수와 그중 하나를 기억한다.
+  - table을 키울 때는 새 table만 잡아 두고 insert/erase마다 이전 table에서 몇 칸씩 옮기므로, 한 번에 전부 rehash하지 않는다.
+  - key_t tree(node_size가 sizeof(node_t))에만 붙는다. RBTREE_CONCURRENT와는 함께 쓸 수 없다.
+
+  RBTREE_CONCURRENT를 켜면 writer 하나와 여러 reader가 tree를 같이 쓸 수 있다. (pointer link 배치에서만)
+  - writer는 지금처럼 rbtree_insert/rbtree_erase/batch 함수를 쓴다. writer끼리는 호출하는 쪽이 직렬화한다.
+  - reader는 lock 없이 rbtree_find, rbtree_min/max, rbtree_first/last, rbtree_lower_bound/upper_bound,
+    rbtree_range_to_array를 부른다. 탐색 중에 회전이나 삭제가 끼어들면 (t->seq가 바뀌면) 처음부터 다시 한다.
+  - erase된 node의 메모리는 delete_rbtree 전까지 pool에 남아 있으므로 reader가 밟아도 안전하다.
+    다만 reader가 받은 node는 writer가 지우고 재사용할 수 있으므로, 그 뒤에 읽는 key는 보장되지 않는다.
+  - rank/select/range_count, rbtree_next/prev는 reader용이 아니다.
+*/
+#if defined(RBTREE_CONCURRENT)
+#if defined(RBTREE_INDEX_LINKS)
+#error "RBTREE_CONCURRENT cannot be combined with RBTREE_INDEX_LINKS"
+#endif
+#if defined(RBTREE_HASH_INDEX)
+#error "RBTREE_CONCURRENT cannot be combined with RBTREE_HASH_INDEX"
+#endif
+// link는 release로 써서, 새 node를 매다는 순간 그 node의 key와 link가 먼저 보이게 한다.
+#define RB_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define RB_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+// key와 count는 node를 매다는 link store가 순서를 잡아 주므로 relaxed로 충분하다.
+// 지워져 재사용되는 node를 늦게 밟은 reader와 겹쳐도 data race가 되지 않게 atomic으로만 읽고 쓴다.
+#define RB_LOAD_RELAXED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define RB_STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define RB_LOAD(x) (x)
+#define RB_STORE(x, v) ((x) = (v))
+#define RB_LOAD_RELAXED(x) (x)
+#define RB_STORE_RELAXED(x, v) ((x) = (v))
+#endif
+
+#if defined(RBTREE_INDEX_LINKS)
+typedef uint32_t rb_size_t;
+
+typedef struct node_t {
+  uint32_t parent_color;  // parent index << 1 | color
+  uint32_t left, right;
+  key_t key;
+  rb_size_t size;  // 이 node를 root로 하는 subtree의 key 개수. nil은 0
+#if defined(RBTREE_COUNTED)
+  rb_size_t count;  // 이 node의 key 개수. nil은 0
+#endif
+} node_t;
+#elif defined(RBTREE_COMPACT)
+typedef uint32_t rb_size_t;
+
+typedef struct node_t {
+  uintptr_t parent_color;  // parent pointer | color
+  struct node_t *left, *right;
+  key_t key;
+  rb_size_t size;  // 이 node를 root로 하는 subtree의 key 개수. nil은 0
+#if defined(RBTREE_COUNTED)
+  rb_size_t count;  // 이 node의 key 개수. nil은 0
+#endif
+} node_t;
+#else
+typedef size_t rb_size_t;
+
 typedef struct node_t {
   color_t color;
   key_t key;
   struct node_t *parent, *left, *right;
+  rb_size_t size;  // 이 node를 root로 하는 subtree의 key 개수. nil은 0
+#if defined(RBTREE_COUNTED)
+  rb_size_t count;  // 이 node의 key 개수. nil은 0
+#endif
 } node_t;
+#endif
+
+// RBTREE_STATS를 켜면 tree마다 세는 counter. 끄면 rbtree에 이 field가 없고 세는 code도 모두 빠진다.
+typedef struct {
+  size_t inserts, erases, finds;  // 연산 횟수. 아래 counter를 연산당 값으로 나눌 때 쓴다
+  size_t comparisons;             // binary_search와 bst_insert에서 key를 비교한 횟수. hash index에서는 들여다본 칸 수
+  size_t rotations;
+  size_t recolors;                // fixup에서 color를 바꾼 횟수
+  size_t insert_fixup_loops;
+  size_t delete_fixup_loops;
+  size_t allocations;             // pool에서 node를 받은 횟수
+  size_t pool_refills;            // slab(chunk)을 새로 malloc한 횟수
+} rbtree_counters;
+
+#define RBTREE_STATS_MAX_DEPTH 128
+
+#if defined(RBTREE_HASH_INDEX)
+// 열린 주소법(linear probing) table의 한 칸. count가 0이면 빈 칸, RBTREE_HASH_TOMBSTONE이면 지운 칸이다.
+#define RBTREE_HASH_TOMBSTONE UINT32_MAX
+
+typedef struct {
+  key_t key;
+  uint32_t count;  // 이 key를 가진 node 수
+  node_t *node;    // 그중 하나. 그 node가 지워지고 아직 다른 node를 정하지 못했으면 NULL
+} rb_hash_slot;
+
+typedef struct {
+  rb_hash_slot *slots;
+  size_t capacity;          // 2의 거듭제곱. 0이면 index를 쓰지 않는 tree
+  size_t used;              // slots에서 빈 칸이 아닌 칸 수 (지운 칸 포함)
+  size_t live;              // 두 table을 합친 key 수
+  rb_hash_slot *old_slots;  // 키우는 중이면 이전 table. 없으면 NULL
+  size_t old_capacity;
+  size_t migrated;          // old_slots에서 다음에 옮길 칸
+} rb_hash_index;
+#endif
+
+typedef struct {
+  rbtree_counters counters;  // RBTREE_STATS가 꺼져 있으면 모두 0
+  size_t node_count;
+  size_t height;             // root에서 가장 깊은 node까지의 node 수. 빈 tree는 0
+  size_t black_height;       // root에서 nil까지 지나는 black node 수 (root 포함, nil 제외)
+  size_t depth_histogram[RBTREE_STATS_MAX_DEPTH];  // depth별 node 수. root의 depth는 0
+} rbtree_stats_t;
+
+#if defined(RBTREE_INDEX_LINKS)
+// node는 RBTREE_CHUNK_BYTES 크기로 정렬된 chunk에 나뉘어 담긴다. chunk는 옮겨지지 않으므로 node 주소는 바뀌지 않는다.
+// index는 (chunk 번호 << RBTREE_CHUNK_SHIFT) | chunk 안의 칸 번호이고, 0번(첫 chunk의 첫 칸)은 nil이다.
+#define RBTREE_CHUNK_BYTES ((size_t)1 << 20)
+#define RBTREE_CHUNK_SHIFT 16
+
+typedef struct rbtree_chunk {
+  uint32_t base;  // 첫 칸의 index
+  uint32_t reserved;
+  node_t nodes[];
+} rbtree_chunk;
+
+typedef struct {
+  node_t *root;
+  node_t *nil;  // for sentinel
+  node_t *leftmost, *rightmost;  // key가 가장 작은/큰 node. 빈 tree면 nil
+  rbtree_chunk **chunks;   // index >> RBTREE_CHUNK_SHIFT 번째 chunk
+  size_t chunk_count;
+  size_t chunk_capacity;   // chunks 배열의 크기
+  size_t chunk_nodes;      // chunk 하나에 들어가는 node 개수
+  size_t used;             // 마지막 chunk에서 쓴 칸 수
+  node_t *free_list;       // erase된 node들. right link로 연결되고 nil에서 끝난다.
+  node_t *finger;          // 마지막으로 insert한 node. rbtree_insert가 hint로 쓴다. 없으면 NULL
+  size_t node_size;        // pool 한 칸의 크기
+#if defined(RBTREE_HASH_INDEX)
+  rb_hash_index hash;
+#endif
+#if defined(RBTREE_STATS)
+  rbtree_counters counters;
+#endif
+} rbtree;
+#else
+// node_t를 묶음(slab) 단위로 할당해 두는 pool. tree마다 하나씩 가진다.
+// 한 칸의 크기는 rbtree의 node_size이다.
+typedef struct rbtree_slab {
+  struct rbtree_slab *next;
+  size_t capacity;
+  size_t used;
+  node_t nodes[];
+} rbtree_slab;
 
 typedef struct {
   node_t *root;
   node_t *nil;  // for sentinel
+  node_t *leftmost, *rightmost;  // key가 가장 작은/큰 node. 빈 tree면 nil
+  rbtree_slab *slabs;      // 가장 최근에 할당한 slab이 맨 앞
+  node_t *free_list;       // erase된 node들. right link로 연결되고 nil에서 끝난다.
+  size_t next_slab_size;   // 다음 slab에 담을 node 개수
+  node_t *finger;          // 마지막으로 insert한 node. rbtree_insert가 hint로 쓴다. 없으면 NULL
+  size_t node_size;        // pool 한 칸의 크기
+#if defined(RBTREE_CONCURRENT)
+  unsigned seq;            // writer가 link를 고치는 동안 홀수
+#endif
+#if defined(RBTREE_HASH_INDEX)
+  rb_hash_index hash;
+#endif
+#if defined(RBTREE_STATS)
+  rbtree_counters counters;
+#endif
 } rbtree;
+#endif
+
+// link 접근자. 기본 배치에서는 field 접근 그대로이다.
+#if defined(RBTREE_INDEX_LINKS)
+static inline node_t *rb_node_at(const rbtree *t, uint32_t index) {
+  return (node_t *)((char *)t->chunks[index >> RBTREE_CHUNK_SHIFT]->nodes +
+                    (size_t)(index & (((uint32_t)1 << RBTREE_CHUNK_SHIFT) - 1)) * t->node_size);
+}
+
+static inline uint32_t rb_index_of(const rbtree *t, const node_t *node) {
+  const rbtree_chunk *chunk = (const rbtree_chunk *)((uintptr_t)node & ~(uintptr_t)(RBTREE_CHUNK_BYTES - 1));
+  const size_t offset = (size_t)((const char *)node - (const char *)chunk->nodes);
+  // int tree에서는 상수 나눗셈이 되도록 나눠 둔다
+  return chunk->base + (uint32_t)((t->node_size == sizeof(node_t)) ? offset / sizeof(node_t) : offset / t->node_size);
+}
+
+static inline node_t *rb_parent(const rbtree *t, const node_t *n) { return rb_node_at(t, n->parent_color >> 1); }
+static inline node_t *rb_left(const rbtree *t, const node_t *n) { return rb_node_at(t, n->left); }
+static inline node_t *rb_right(const rbtree *t, const node_t *n) { return rb_node_at(t, n->right); }
+static inline color_t rb_color(const rbtree *t, const node_t *n) { return (color_t)(n->parent_color & 1); }
+static inline void rb_set_parent(const rbtree *t, node_t *n, const node_t *p) {
+  n->parent_color = (rb_index_of(t, p) << 1) | (n->parent_color & 1);
+}
+static inline void rb_set_left(const rbtree *t, node_t *n, const node_t *c) { n->left = rb_index_of(t, c); }
+static inline void rb_set_right(const rbtree *t, node_t *n, const node_t *c) { n->right = rb_index_of(t, c); }
+static inline void rb_set_color(const rbtree *t, node_t *n, color_t c) {
+  n->parent_color = (n->parent_color & ~(uint32_t)1) | (uint32_t)c;
+}
+#elif defined(RBTREE_COMPACT)
+static inline node_t *rb_parent(const rbtree *t, const node_t *n) { return (node_t *)(RB_LOAD(n->parent_color) & ~(uintptr_t)1); }
+static inline node_t *rb_left(const rbtree *t, const node_t *n) { return RB_LOAD(n->left); }
+static inline node_t *rb_right(const rbtree *t, const node_t *n) { return RB_LOAD(n->right); }
+static inline color_t rb_color(const rbtree *t, const node_t *n) { return (color_t)(RB_LOAD(n->parent_color) & 1); }
+static inline void rb_set_parent(const rbtree *t, node_t *n, const node_t *p) {
+  RB_STORE(n->parent_color, (uintptr_t)p | (n->parent_color & 1));
+}
+static inline void rb_set_left(const rbtree *t, node_t *n, node_t *c) { RB_STORE(n->left, c); }
+static inline void rb_set_right(const rbtree *t, node_t *n, node_t *c) { RB_STORE(n->right, c); }
+static inline void rb_set_color(const rbtree *t, node_t *n, color_t c) {
+  RB_STORE(n->parent_color, (n->parent_color & ~(uintptr_t)1) | (uintptr_t)c);
+}
+#else
+#define rb_parent(t, n) RB_LOAD((n)->parent)
+#define rb_left(t, n) RB_LOAD((n)->left)
+#define rb_right(t, n) RB_LOAD((n)->right)
+#define rb_color(t, n) RB_LOAD((n)->color)
+#define rb_set_parent(t, n, p) RB_STORE((n)->parent, (p))
+#define rb_set_left(t, n, c) RB_STORE((n)->left, (c))
+#define rb_set_right(t, n, c) RB_STORE((n)->right, (c))
+#define rb_set_color(t, n, c) RB_STORE((n)->color, (c))
+#endif
+#define rb_key(n) RB_LOAD_RELAXED((n)->key)
+#define rb_set_key(n, k) RB_STORE_RELAXED((n)->key, (k))
+#if defined(RBTREE_COUNTED)
+#define rb_count(n) RB_LOAD_RELAXED((n)->count)
+#define rb_set_count(n, c) RB_STORE_RELAXED((n)->count, (c))
+#else
+#define rb_count(n) ((rb_size_t)1)
+#endif
+#define rb_root(t) RB_LOAD((t)->root)
+#define rb_set_root(t, n) RB_STORE((t)->root, (n))
+#define rb_leftmost(t) RB_LOAD((t)->leftmost)
+#define rb_rightmost(t) RB_LOAD((t)->rightmost)
+
+#if defined(__GNUC__)
+#define RB_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define RB_PREFETCH(addr) ((void)(addr))
+#endif
 
 rbtree *new_rbtree(void);
+rbtree *new_rbtree_with_capacity(const size_t);
+rbtree *new_rbtree_with_node_size(const size_t, const size_t);
+rbtree *rbtree_build_sorted(const key_t *, const size_t);
 void delete_rbtree(rbtree *);
 
 node_t *rbtree_insert(rbtree *, const key_t);
+node_t *rbtree_insert_hint(rbtree *, node_t *, const key_t);
 node_t *rbtree_find(const rbtree *, const key_t);
+size_t rbtree_find_batch(const rbtree *, const key_t *, const size_t, node_t **);
 node_t *rbtree_min(const rbtree *);
 node_t *rbtree_max(const rbtree *);
 int rbtree_erase(rbtree *, node_t *);
+int rbtree_erase_key(rbtree *, const key_t);
+int rbtree_pop_min(rbtree *, key_t *);
+int rbtree_pop_max(rbtree *, key_t *);
+
+int rbtree_insert_batch(rbtree *, const key_t *, const size_t);
+size_t rbtree_erase_batch(rbtree *, const key_t *, const size_t);
+size_t rbtree_erase_range(rbtree *, const key_t, const key_t);
 
 int rbtree_to_array(const rbtree *, key_t *, const size_t);
+int rbtree_to_array_parallel(const rbtree *, key_t *, const size_t, const int);
+
+size_t rbtree_size(const rbtree *);
+size_t rbtree_count(const rbtree *, const key_t);
+size_t rbtree_rank(const rbtree *, const key_t);
+node_t *rbtree_select(const rbtree *, const size_t);
+
+node_t *rbtree_lower_bound(const rbtree *, const key_t);
+node_t *rbtree_upper_bound(const rbtree *, const key_t);
+size_t rbtree_range_count(const rbtree *, const key_t, const key_t);
+size_t rbtree_range_to_array(const rbtree *, const key_t, const key_t, key_t *, const size_t);
+
+// inorder 순회. 끝에 다다르면 NULL을 반환한다.
+node_t *rbtree_first(const rbtree *);
+node_t *rbtree_last(const rbtree *);
+node_t *rbtree_next(const rbtree *, const node_t *);
+node_t *rbtree_prev(const rbtree *, const node_t *);
+
+// counter와 지금 tree 모양(높이, black height, depth별 node 수). 모양은 부를 때 tree 전체를 훑어 구한다.
+void rbtree_stats(const rbtree *, rbtree_stats_t *);
+void rbtree_stats_reset(rbtree *);
+
+/*
+  join/split과 집합 연산. key_t로 정렬된 tree 전용이고(template/intrusive tree에는 쓰지 않는다), 두 tree는 서로 달라야 하며,
+  RBTREE_CONCURRENT의 reader가 없을 때 부른다.
+  node는 tree마다 다른 pool과 nil에 묶여 있으므로 두 tree를 합치거나 나눌 때는 작은 쪽 node만 큰 쪽 pool로 복사하고,
+  큰 쪽은 두 handle의 내용을 맞바꿔서 옮기지 않는다. 그래서 join/split은 O(log n)에 작은 쪽 크기만큼이 더해지고,
+  복사된 node는 주소가 바뀐다.
+  - rbtree_join(t1, key, t2): t1의 key <= key <= t2의 key일 때 t1에 t1, key, t2를 이어 붙이고 t2를 비운다.
+  - rbtree_split(t, key, &lt, &gt): key보다 작은 node는 새 tree *lt로, 큰 node는 *gt로 보내고 t를 비운다.
+    key와 같은 node는 지우고 그 개수를 반환한다.
+  - rbtree_union(t1, t2): t2의 node를 모두 t1에 합치고(같은 key는 둘 다 남는다) t2를 비운다.
+  - rbtree_intersect/difference(t1, t2): t1에서 key가 t2에 있는(없는) node만 남긴다. t2는 바뀌지 않는다.
+  집합 연산은 O(m log(n/m + 1))이고(m <= n), threads가 2 이상이면 재귀를 그 수만큼의 thread로 나눠 돈다.
+*/
+void rbtree_join(rbtree *, const key_t, rbtree *);
+size_t rbtree_split(rbtree *, const key_t, rbtree **, rbtree **);
+void rbtree_union(rbtree *, rbtree *, const int);
+void rbtree_intersect(rbtree *, const rbtree *, const int);
+void rbtree_difference(rbtree *, const rbtree *, const int);
+
+// link 단위 API. key 비교 없이 자리를 받아 매달기만 하므로 다른 key type의 tree가 같은 균형 코드를 쓸 수 있다.
+node_t *rbtree_alloc_node(rbtree *);
+void rbtree_insert_at(rbtree *, node_t *, node_t *, int);
+void rbtree_link_remove(rbtree *, node_t *);
+
+#ifndef RBTREE_INDEX_LINKS
+// intrusive API. 사용자 구조체에 rb_link를 넣어 두고 그대로 매단다. tree는 node를 할당하지도 반납하지도 않는다.
+// rb_link 안의 key는 쓰지 않으며, 순서는 비교 함수가 정한다.
+// index link는 tree의 node 배열 안에서만 의미가 있으므로 RBTREE_INDEX_LINKS에서는 쓸 수 없다.
+typedef node_t rb_link;
+typedef int (*rbtree_link_cmp)(const rb_link *, const rb_link *);
+typedef int (*rbtree_key_cmp)(const void *, const rb_link *);
+
+#define rbtree_entry(link, type, member) \
+  ((type *)((char *)(link) - offsetof(type, member)))
+
+rb_link *rbtree_link_insert(rbtree *, rb_link *, rbtree_link_cmp);
+rb_link *rbtree_link_find(const rbtree *, const void *, rbtree_key_cmp);
+rb_link *rbtree_link_lower_bound(const rbtree *, const void *, rbtree_key_cmp);
+#endif
 
 #endif  // _RBTREE_H_
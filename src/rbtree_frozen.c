@@ -0,0 +1,351 @@
+#include "rbtree_frozen.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// keys 배열의 정렬 단위. cache line 하나에 key 16개가 들어간다.
+#define RBTREE_FROZEN_ALIGN 64
+// k번 칸에 있을 때 4단계 아래 후손(16k ~ 16k+15)이 들어 있는 cache line을 미리 읽는다.
+#define RBTREE_FROZEN_PREFETCH_STRIDE 16
+
+#define RBTREE_FILE_MAGIC "RBTFROZ"
+#define RBTREE_FILE_VERSION 2
+#define RBTREE_FILE_BYTE_ORDER 0x01020304u
+
+// rbtree_save가 쓰는 파일의 맨 앞. 모든 field는 만든 기계의 byte order 그대로이다.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;        // RBTREE_FILE_BYTE_ORDER를 그대로 쓴 값. 읽는 쪽과 다르면 열지 않는다
+  uint32_t key_size;          // sizeof(key_t)
+  uint32_t reserved;          // 0
+  uint64_t n;
+  uint64_t keys_offset;       // keys[0]의 위치. n + 1칸이고 파일은 거기서 끝난다
+  uint64_t file_size;
+  uint64_t payload_checksum;  // keys_offset부터 파일 끝까지
+  uint64_t header_checksum;   // 이 field 앞까지
+} rbtree_file_header;
+
+size_t eytzinger_first(size_t n);
+size_t eytzinger_next(size_t k, size_t n);
+size_t eytzinger_lower_bound(const rbtree_frozen *f, key_t key);
+size_t eytzinger_rank(const rbtree_frozen *f, key_t key, int or_equal);
+size_t eytzinger_subtree_size(size_t k, int levels, size_t n);
+size_t align_up(size_t offset);
+int write_padded(FILE *fp, const void *data, size_t size, size_t *offset);
+int sync_parent_dir(const char *path);
+
+/*
+  1. Implementation 요구되는 functions
+*/
+// tree의 key를 복사해 읽기 전용 index를 만든다. tree는 바꾸지 않는다.
+rbtree_frozen *rbtree_freeze(const rbtree *t) {
+  rbtree_frozen *f = (rbtree_frozen *)calloc(1, sizeof(rbtree_frozen));
+  f->n = rbtree_size(t);
+  // aligned_alloc의 크기는 정렬 단위의 배수여야 한다
+  const size_t bytes = ((f->n + 1) * sizeof(key_t) + RBTREE_FROZEN_ALIGN - 1) / RBTREE_FROZEN_ALIGN * RBTREE_FROZEN_ALIGN;
+  f->keys = (key_t *)aligned_alloc(RBTREE_FROZEN_ALIGN, bytes);
+  f->mapping = NULL;
+  f->mapping_size = 0;
+  f->keys[0] = 0;
+
+  // in-order로 tree를 따라가면서 Eytzinger 배열도 in-order로 채운다
+  size_t k = eytzinger_first(f->n);
+  for (node_t *p = rbtree_first(t); p != NULL; p = rbtree_next(t, p)) {
+    for (rb_size_t c = 0; c < rb_count(p); c++) {
+      f->keys[k] = p->key;
+      k = eytzinger_next(k, f->n);
+    }
+  }
+  return f;
+}
+
+void delete_rbtree_frozen(rbtree_frozen *f) {
+  if (f == NULL) {
+    return;
+  }
+  if (f->mapping != NULL) {
+    munmap(f->mapping, f->mapping_size);
+  }
+  else {
+    free(f->keys);
+  }
+  free(f);
+}
+
+size_t rbtree_frozen_size(const rbtree_frozen *f) {
+  return f->n;
+}
+
+// key와 같은 값을 가리킨다. 없으면 NULL
+const key_t *rbtree_frozen_find(const rbtree_frozen *f, const key_t key) {
+  const size_t k = eytzinger_lower_bound(f, key);
+  if (k == 0 || f->keys[k] != key) {
+    return NULL;
+  }
+  return &f->keys[k];
+}
+
+// key 이상인 첫 값. 없으면 NULL
+const key_t *rbtree_frozen_lower_bound(const rbtree_frozen *f, const key_t key) {
+  const size_t k = eytzinger_lower_bound(f, key);
+  return (k == 0) ? NULL : &f->keys[k];
+}
+
+// key보다 작은 값의 개수 (rbtree_rank와 같다)
+size_t rbtree_frozen_rank(const rbtree_frozen *f, const key_t key) {
+  return eytzinger_rank(f, key, 0);
+}
+
+// [lo, hi] 구간의 key 개수
+size_t rbtree_frozen_range_count(const rbtree_frozen *f, const key_t lo, const key_t hi) {
+  if (hi < lo) {
+    return 0;
+  }
+  return eytzinger_rank(f, hi, 1) - eytzinger_rank(f, lo, 0);
+}
+
+// [lo, hi] 구간의 key를 순서대로 최대 cap개 arr에 채우고, 채운 개수를 반환한다.
+size_t rbtree_frozen_range_to_array(const rbtree_frozen *f, const key_t lo, const key_t hi, key_t *arr, const size_t cap) {
+  size_t count = 0;
+  for (size_t k = eytzinger_lower_bound(f, lo); k != 0 && f->keys[k] <= hi && count < cap; k = eytzinger_next(k, f->n)) {
+    arr[count++] = f->keys[k];
+  }
+  return count;
+}
+
+// tree를 frozen 배치로 path에 쓴다. 같은 디렉터리의 임시 파일에 다 쓴 뒤 rename하므로 중간에 실패해도 기존 파일은 남는다.
+// 성공하면 0, 실패하면 -1 (errno는 실패한 system call의 것)
+int rbtree_save(const rbtree *t, const char *path) {
+  rbtree_frozen *f = rbtree_freeze(t);
+  rbtree_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RBTREE_FILE_MAGIC, sizeof(header.magic));
+  header.version = RBTREE_FILE_VERSION;
+  header.byte_order = RBTREE_FILE_BYTE_ORDER;
+  header.key_size = sizeof(key_t);
+  header.n = f->n;
+  header.keys_offset = align_up(sizeof(header));
+  header.file_size = header.keys_offset + (f->n + 1) * sizeof(key_t);
+  header.payload_checksum = checksum64(f->keys, (f->n + 1) * sizeof(key_t), RBTREE_CHECKSUM_SEED);
+  header.header_checksum = checksum64(&header, offsetof(rbtree_file_header, header_checksum), RBTREE_CHECKSUM_SEED);
+
+  char *tmp_path = (char *)malloc(strlen(path) + 5);
+  sprintf(tmp_path, "%s.tmp", path);
+  FILE *fp = fopen(tmp_path, "wb");
+  size_t offset = 0;
+  int ok = fp != NULL &&
+           write_padded(fp, &header, sizeof(header), &offset) == 0 &&
+           fwrite(f->keys, sizeof(key_t), f->n + 1, fp) == f->n + 1 &&
+           fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  if (fp != NULL && fclose(fp) != 0) {
+    ok = 0;
+  }
+  // rename은 directory를 fsync해야 crash 뒤에도 남는다
+  ok = ok && rename(tmp_path, path) == 0 && sync_parent_dir(path) == 0;
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  delete_rbtree_frozen(f);
+  return ok ? 0 : -1;
+}
+
+// rbtree_save로 쓴 파일을 mmap해 frozen index로 연다. 파일이 없거나 header가 맞지 않으면 NULL
+rbtree_frozen *rbtree_open_mapped(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(rbtree_file_header)) {
+    mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);  // mapping은 fd를 닫아도 남는다
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  const rbtree_file_header *header = (const rbtree_file_header *)mapping;
+  const size_t size = (size_t)st.st_size;
+  const uint64_t header_checksum = checksum64(header, offsetof(rbtree_file_header, header_checksum), RBTREE_CHECKSUM_SEED);
+  if (memcmp(header->magic, RBTREE_FILE_MAGIC, sizeof(header->magic)) != 0 || header->header_checksum != header_checksum ||
+      header->version != RBTREE_FILE_VERSION || header->byte_order != RBTREE_FILE_BYTE_ORDER ||
+      header->key_size != sizeof(key_t) || header->file_size != size ||
+      header->keys_offset != align_up(sizeof(rbtree_file_header)) ||
+      // n은 곱하지 않고 파일 크기에서 나눠 맞춘다. 곱하면 넘쳐서 엉뚱한 n이 크기 확인을 통과할 수 있다
+      size < header->keys_offset + sizeof(key_t) || (size - header->keys_offset) % sizeof(key_t) != 0 ||
+      header->n != (size - header->keys_offset) / sizeof(key_t) - 1) {
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  rbtree_frozen *f = (rbtree_frozen *)calloc(1, sizeof(rbtree_frozen));
+  f->n = header->n;
+  f->keys = (key_t *)((char *)mapping + header->keys_offset);
+  f->mapping = mapping;
+  f->mapping_size = size;
+  return f;
+}
+
+// mapping의 본문 checksum이 header와 맞으면 1. 파일 전체를 읽는다. mapping이 아니면 확인할 것이 없으므로 1
+int rbtree_frozen_verify(const rbtree_frozen *f) {
+  if (f->mapping == NULL) {
+    return 1;
+  }
+  const rbtree_file_header *header = (const rbtree_file_header *)f->mapping;
+  const uint64_t checksum = checksum64((const char *)f->mapping + header->keys_offset,
+                                       f->mapping_size - header->keys_offset, RBTREE_CHECKSUM_SEED);
+  return checksum == header->payload_checksum;
+}
+
+// 파일로 연 index면 header의 본문 checksum. 같은 내용을 저장한 파일인지 가리는 데 쓴다. 아니면 0
+uint64_t rbtree_frozen_checksum(const rbtree_frozen *f) {
+  return (f->mapping == NULL) ? 0 : ((const rbtree_file_header *)f->mapping)->payload_checksum;
+}
+
+// in-order로 key를 꺼내 rbtree_build_sorted로 다시 짓는다.
+rbtree *rbtree_thaw(const rbtree_frozen *f) {
+  key_t *sorted = (key_t *)malloc((f->n + 1) * sizeof(key_t));
+  size_t i = 0;
+  for (size_t k = eytzinger_first(f->n); k != 0; k = eytzinger_next(k, f->n)) {
+    sorted[i++] = f->keys[k];
+  }
+  rbtree *t = rbtree_build_sorted(sorted, f->n);
+  free(sorted);
+  return t;
+}
+
+// 8 bytes씩 섞는 FNV-1a 변형. 끝에 남는 bytes는 0으로 채운 word로 센다.
+uint64_t checksum64(const void *data, size_t size, const uint64_t seed) {
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = seed;
+  for (; size >= sizeof(uint64_t); p += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    h = (h ^ word) * 0x100000001b3ull;
+  }
+  if (size > 0) {
+    uint64_t word = 0;
+    memcpy(&word, p, size);
+    h = (h ^ word) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+/*
+  2. helper functions below
+*/
+// in-order 첫 칸: root에서 왼쪽으로 끝까지. n이 0이면 0
+size_t eytzinger_first(const size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  size_t k = 1;
+  while (2 * k <= n) {
+    k = 2 * k;
+  }
+  return k;
+}
+
+// in-order 다음 칸. 마지막 칸 다음은 0
+size_t eytzinger_next(size_t k, const size_t n) {
+  if (2 * k + 1 <= n) {
+    k = 2 * k + 1;
+    while (2 * k <= n) {
+      k = 2 * k;
+    }
+    return k;
+  }
+  // 오른쪽 자식으로 내려왔던 만큼 올라간 뒤 한 번 더 올라간다
+  while (k & 1) {
+    k >>= 1;
+  }
+  return k >> 1;
+}
+
+// key 이상인 첫 칸의 번호. 없으면 0
+// 분기 없이 끝까지 내려간 뒤, 마지막으로 왼쪽으로 꺾은 곳까지 되돌아간다.
+size_t eytzinger_lower_bound(const rbtree_frozen *f, const key_t key) {
+  size_t k = 1;
+  while (k <= f->n) {
+    RB_PREFETCH(f->keys + k * RBTREE_FROZEN_PREFETCH_STRIDE);
+    k = 2 * k + (f->keys[k] < key);
+  }
+#if defined(__GNUC__)
+  k >>= __builtin_ffsll((long long)~k);
+#else
+  while (k & 1) {
+    k >>= 1;
+  }
+  k >>= 1;
+#endif
+  return k;
+}
+
+// key보다 작은(or_equal이면 key 이하인) 값의 개수. lower_bound와 같은 길을 내려가면서 오른쪽으로 갈 때마다
+// 왼쪽 subtree와 지나온 칸을 더한다. 배열이 완전 이진 tree이므로 subtree 크기는 번호로 바로 구한다.
+size_t eytzinger_rank(const rbtree_frozen *f, const key_t key, const int or_equal) {
+  int levels = 0;  // root 아래 단계 수
+  while (((size_t)2 << levels) <= f->n) {
+    levels++;
+  }
+  size_t rank = 0;
+  for (size_t k = 1; k <= f->n; levels--) {
+    RB_PREFETCH(f->keys + k * RBTREE_FROZEN_PREFETCH_STRIDE);
+    if (f->keys[k] < key || (or_equal && f->keys[k] == key)) {
+      rank += eytzinger_subtree_size(2 * k, levels - 1, f->n) + 1;
+      k = 2 * k + 1;
+    }
+    else {
+      k = 2 * k;
+    }
+  }
+  return rank;
+}
+
+// k번 칸 아래 subtree의 칸 수. levels는 k 아래 단계 수이고, 마지막 단계만 덜 찰 수 있다.
+size_t eytzinger_subtree_size(const size_t k, const int levels, const size_t n) {
+  if (k > n) {
+    return 0;
+  }
+  const size_t width = (size_t)1 << levels;
+  const size_t first = k << levels;  // 마지막 단계에서 k 아래 첫 칸
+  const size_t last_level = (n < first) ? 0 : (n - first + 1 < width) ? n - first + 1 : width;
+  return width - 1 + last_level;
+}
+
+size_t align_up(const size_t offset) {
+  return (offset + RBTREE_FROZEN_ALIGN - 1) / RBTREE_FROZEN_ALIGN * RBTREE_FROZEN_ALIGN;
+}
+
+// data를 쓰고 RBTREE_FROZEN_ALIGN 경계까지 0으로 채운다. *offset은 파일에서의 위치
+int write_padded(FILE *fp, const void *data, const size_t size, size_t *offset) {
+  const char zeros[RBTREE_FROZEN_ALIGN] = {0};
+  const size_t padding = align_up(*offset + size) - (*offset + size);
+  if (fwrite(data, 1, size, fp) != size || fwrite(zeros, 1, padding, fp) != padding) {
+    return -1;
+  }
+  *offset += size + padding;
+  return 0;
+}
+
+// path가 들어 있는 directory를 fsync한다. 그 안에서 한 rename/create가 disk에 남는다.
+int sync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = (slash == NULL) ? strdup(".") : strndup(path, (slash == path) ? 1 : (size_t)(slash - path));
+  const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (fd < 0) {
+    return -1;
+  }
+  const int ret = fsync(fd);
+  close(fd);
+  return ret;
+}
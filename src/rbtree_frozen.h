@@ -0,0 +1,49 @@
+#ifndef _RBTREE_FROZEN_H_
+#define _RBTREE_FROZEN_H_
+
+#include "rbtree.h"
+
+/*
+  rbtree_freeze가 만드는 읽기 전용 index.
+  tree의 key를 in-order로 읽어 Eytzinger(BFS) 순서의 배열에 담는다.
+  keys[1]이 root이고, keys[k]의 왼쪽 자식은 keys[2k], 오른쪽 자식은 keys[2k+1]이다.
+  배열이 완전 이진 tree이므로 rank는 따로 저장하지 않고 탐색 경로와 칸 번호에서 구한다.
+  탐색 경로의 앞부분이 몇 개의 cache line에 모이고 다음 단계를 미리 prefetch할 수 있어서,
+  흩어진 node를 pointer로 따라가는 binary_search보다 cache miss가 훨씬 적다.
+  만든 뒤에는 원래 tree와 독립적이다. tree를 바꿔도 index는 바뀌지 않는다.
+
+  rbtree_save는 이 배치를 그대로 파일에 쓴다: 고정 폭 field의 header 뒤에 keys가 RBTREE_FROZEN_ALIGN 경계에 놓인다.
+  rbtree_open_mapped는 파일을 mmap하고 keys가 mapping 안을 가리키게 하므로, 읽어 들이거나 다시 짓지 않고
+  page cache에서 바로 find/range 질의를 한다. open은 header(magic, version, key 크기, byte order, 크기,
+  header checksum)만 확인한다. 본문 checksum은 파일 전체를 읽어야 하므로 rbtree_frozen_verify로 따로 확인한다.
+  파일은 만든 기계와 같은 key_t 크기와 byte order에서만 열린다.
+  rbtree_thaw는 frozen index(mapping이든 아니든)에서 고칠 수 있는 rbtree를 O(n)에 다시 만든다.
+*/
+typedef struct {
+  key_t *keys;     // Eytzinger 순서. 0번 칸은 비워 둔다
+  size_t n;
+  void *mapping;        // rbtree_open_mapped로 열었으면 파일 전체의 mapping. 아니면 NULL
+  size_t mapping_size;
+} rbtree_frozen;
+
+rbtree_frozen *rbtree_freeze(const rbtree *);
+void delete_rbtree_frozen(rbtree_frozen *);
+
+size_t rbtree_frozen_size(const rbtree_frozen *);
+const key_t *rbtree_frozen_find(const rbtree_frozen *, const key_t);
+const key_t *rbtree_frozen_lower_bound(const rbtree_frozen *, const key_t);
+size_t rbtree_frozen_rank(const rbtree_frozen *, const key_t);
+size_t rbtree_frozen_range_count(const rbtree_frozen *, const key_t, const key_t);
+size_t rbtree_frozen_range_to_array(const rbtree_frozen *, const key_t, const key_t, key_t *, const size_t);
+
+int rbtree_save(const rbtree *, const char *);
+rbtree_frozen *rbtree_open_mapped(const char *);
+int rbtree_frozen_verify(const rbtree_frozen *);
+uint64_t rbtree_frozen_checksum(const rbtree_frozen *);
+rbtree *rbtree_thaw(const rbtree_frozen *);
+
+// 파일 형식(snapshot, journal)이 같이 쓰는 checksum. 처음에는 RBTREE_CHECKSUM_SEED를, 이어서 셀 때는 앞 결과를 넘긴다.
+#define RBTREE_CHECKSUM_SEED 0xcbf29ce484222325ull
+uint64_t checksum64(const void *, size_t, uint64_t);
+
+#endif  // _RBTREE_FROZEN_H_
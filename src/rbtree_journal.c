@@ -0,0 +1,305 @@
+#include "rbtree_journal.h"
+
+#include "rbtree_frozen.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RBTREE_JOURNAL_MAGIC "RBTJRNL"
+#define RBTREE_JOURNAL_VERSION 1
+#define RBTREE_JOURNAL_BATCH_MAGIC 0x4254424au
+#define RBTREE_JOURNAL_DEFAULT_GROUP 4096
+
+typedef enum { JOURNAL_INSERT = 1, JOURNAL_ERASE = 2 } journal_op;
+
+// log 파일의 맨 앞. 뒤에 batch가 이어진다
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_size;         // sizeof(key_t)
+  uint64_t base_checksum;    // 이 log가 이어지는 snapshot의 checksum
+  uint64_t header_checksum;  // 이 field 앞까지
+} journal_file_header;
+
+// batch 하나의 앞. 뒤에 record가 count개 이어진다
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t checksum;  // record들의 checksum
+} journal_batch_header;
+
+typedef struct {
+  key_t key;
+  int32_t op;
+} journal_record;
+
+int load_snapshot(rbtree_journal *j);
+int open_log(rbtree_journal *j, const char *log_path);
+int reset_log(rbtree_journal *j);
+int replay_log(rbtree_journal *j);
+void apply_records(rbtree *t, journal_record *records, size_t count);
+int compare_records(const void *a, const void *b);
+int append_record(rbtree_journal *j, key_t key, journal_op op);
+int write_all(int fd, const void *data, size_t size);
+
+/*
+  1. Implementation 요구되는 functions
+*/
+// snapshot과 log로 tree를 되살리고 이어서 쓸 journal을 연다. 둘 다 없으면 빈 tree에서 시작한다.
+// snapshot이 깨졌거나 다른 형식의 log이면 NULL. group_size가 0이면 기본값을 쓴다.
+rbtree_journal *rbtree_journal_open(const char *snapshot_path, const char *log_path, const size_t group_size) {
+  rbtree_journal *j = (rbtree_journal *)calloc(1, sizeof(rbtree_journal));
+  j->fd = -1;
+  j->group_size = (group_size == 0) ? RBTREE_JOURNAL_DEFAULT_GROUP : group_size;
+  j->buffer = (unsigned char *)malloc(sizeof(journal_batch_header) + j->group_size * sizeof(journal_record));
+  j->snapshot_path = strdup(snapshot_path);
+  if (load_snapshot(j) != 0 || open_log(j, log_path) != 0) {
+    delete_rbtree_journal(j);
+    return NULL;
+  }
+  return j;
+}
+
+// 남은 record를 commit하고 닫는다. tree도 함께 지운다.
+void delete_rbtree_journal(rbtree_journal *j) {
+  if (j->fd >= 0) {
+    rbtree_journal_commit(j);
+    close(j->fd);
+  }
+  if (j->tree != NULL) {
+    delete_rbtree(j->tree);
+  }
+  free(j->buffer);
+  free(j->snapshot_path);
+  free(j);
+}
+
+// 앞서 commit이 실패했으면 tree를 고치지 않고 NULL (errno)
+node_t *rbtree_journal_insert(rbtree_journal *j, const key_t key) {
+  if (append_record(j, key, JOURNAL_INSERT) != 0) {
+    return NULL;
+  }
+  return rbtree_insert(j->tree, key);
+}
+
+// 앞서 commit이 실패했으면 tree를 고치지 않고 -1 (errno)
+int rbtree_journal_erase(rbtree_journal *j, node_t *node) {
+  if (append_record(j, node->key, JOURNAL_ERASE) != 0) {
+    return -1;
+  }
+  return rbtree_erase(j->tree, node);
+}
+
+// 쌓인 record를 batch 하나로 log 끝에 쓰고 fsync한다. 성공하면 0, 실패하면 -1 (errno)
+int rbtree_journal_commit(rbtree_journal *j) {
+  if (j->error != 0) {
+    errno = j->error;
+    return -1;
+  }
+  if (j->count == 0) {
+    return 0;
+  }
+  journal_batch_header *batch = (journal_batch_header *)j->buffer;
+  const size_t bytes = j->count * sizeof(journal_record);
+  batch->magic = RBTREE_JOURNAL_BATCH_MAGIC;
+  batch->count = (uint32_t)j->count;
+  batch->checksum = checksum64(j->buffer + sizeof(journal_batch_header), bytes, RBTREE_CHECKSUM_SEED);
+  if (write_all(j->fd, j->buffer, sizeof(journal_batch_header) + bytes) != 0 || fsync(j->fd) != 0) {
+    j->error = errno;
+    return -1;
+  }
+  j->count = 0;
+  return 0;
+}
+
+// tree 전체를 snapshot으로 쓰고 log를 비운다. log는 rbtree_save가 rename까지 disk에 내린 뒤에야 비운다.
+// snapshot이 모든 연산을 담으므로 아직 commit하지 않은 record는 버리고,
+// 앞서 commit이 실패했더라도 여기서 성공하면 journal은 다시 온전해진다.
+int rbtree_journal_checkpoint(rbtree_journal *j) {
+  if (rbtree_save(j->tree, j->snapshot_path) != 0) {
+    return -1;
+  }
+  rbtree_frozen *f = rbtree_open_mapped(j->snapshot_path);
+  if (f == NULL) {
+    return -1;
+  }
+  j->base_checksum = rbtree_frozen_checksum(f);
+  delete_rbtree_frozen(f);
+  j->count = 0;
+  j->error = 0;
+  return reset_log(j);
+}
+
+/*
+  2. helper functions below
+*/
+int load_snapshot(rbtree_journal *j) {
+  rbtree_frozen *f = rbtree_open_mapped(j->snapshot_path);
+  if (f == NULL) {
+    // 처음 여는 경우가 아니라 파일이 있는데 열리지 않는다면 깨진 것이다
+    if (access(j->snapshot_path, F_OK) == 0) {
+      return -1;
+    }
+    j->tree = new_rbtree();
+    j->base_checksum = 0;
+    return 0;
+  }
+  if (!rbtree_frozen_verify(f)) {
+    delete_rbtree_frozen(f);
+    return -1;
+  }
+  j->tree = rbtree_thaw(f);
+  j->base_checksum = rbtree_frozen_checksum(f);
+  delete_rbtree_frozen(f);
+  return 0;
+}
+
+// log header가 지금 snapshot을 가리키면 다시 적용하고, 새로 만든 빈 파일이거나 이미 snapshot에 들어간 log면 비운다.
+// header가 깨졌으면 버리지 않고 -1. 그 안의 record가 마지막 snapshot 뒤의 유일한 기록일 수 있다.
+int open_log(rbtree_journal *j, const char *log_path) {
+  j->fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (j->fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(j->fd, &st) != 0) {
+    return -1;
+  }
+  if (st.st_size == 0) {
+    return reset_log(j);
+  }
+  journal_file_header header;
+  if (pread(j->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      memcmp(header.magic, RBTREE_JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.header_checksum != checksum64(&header, offsetof(journal_file_header, header_checksum), RBTREE_CHECKSUM_SEED) ||
+      header.version != RBTREE_JOURNAL_VERSION || header.key_size != sizeof(key_t)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (header.base_checksum != j->base_checksum) {
+    return reset_log(j);
+  }
+  return replay_log(j);
+}
+
+int reset_log(rbtree_journal *j) {
+  journal_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RBTREE_JOURNAL_MAGIC, sizeof(header.magic));
+  header.version = RBTREE_JOURNAL_VERSION;
+  header.key_size = sizeof(key_t);
+  header.base_checksum = j->base_checksum;
+  header.header_checksum = checksum64(&header, offsetof(journal_file_header, header_checksum), RBTREE_CHECKSUM_SEED);
+  if (ftruncate(j->fd, 0) != 0 || write_all(j->fd, &header, sizeof(header)) != 0 || fsync(j->fd) != 0) {
+    j->error = errno;
+    return -1;
+  }
+  return 0;
+}
+
+// 온전한 batch를 앞에서부터 모두 읽어 한꺼번에 적용한다. 처음으로 잘리거나 checksum이 틀린 batch부터는 버린다.
+int replay_log(rbtree_journal *j) {
+  struct stat st;
+  if (fstat(j->fd, &st) != 0) {
+    return -1;
+  }
+  journal_record *records = NULL;
+  size_t count = 0;
+  off_t offset = sizeof(journal_file_header);
+  journal_batch_header batch;
+  while (pread(j->fd, &batch, sizeof(batch), offset) == (ssize_t)sizeof(batch) &&
+         batch.magic == RBTREE_JOURNAL_BATCH_MAGIC && batch.count > 0 &&
+         (off_t)(sizeof(batch) + batch.count * sizeof(journal_record)) <= st.st_size - offset) {
+    const size_t bytes = batch.count * sizeof(journal_record);
+    records = (journal_record *)realloc(records, (count + batch.count) * sizeof(journal_record));
+    if (pread(j->fd, records + count, bytes, offset + sizeof(batch)) != (ssize_t)bytes ||
+        checksum64(records + count, bytes, RBTREE_CHECKSUM_SEED) != batch.checksum) {
+      break;
+    }
+    count += batch.count;
+    offset += sizeof(batch) + bytes;
+  }
+  // 잘린 꼬리를 잘라 내야 다음 batch가 온전한 batch 바로 뒤에 붙는다
+  if (offset < st.st_size && ftruncate(j->fd, offset) != 0) {
+    free(records);
+    return -1;
+  }
+  apply_records(j->tree, records, count);
+  free(records);
+  return 0;
+}
+
+// key로 정렬해 key마다 insert 수에서 erase 수를 뺀 만큼만 넣거나 지운다.
+// erase는 그때 있던 node에 대해서만 기록되므로, 순서를 잊어도 key마다 남는 개수는 같다.
+void apply_records(rbtree *t, journal_record *records, const size_t count) {
+  if (count == 0) {
+    return;
+  }
+  qsort(records, count, sizeof(journal_record), compare_records);
+  key_t *inserts = (key_t *)malloc(count * sizeof(key_t));
+  key_t *erases = (key_t *)malloc(count * sizeof(key_t));
+  size_t insert_count = 0, erase_count = 0;
+  for (size_t i = 0; i < count;) {
+    const key_t key = records[i].key;
+    long net = 0;
+    for (; i < count && records[i].key == key; i++) {
+      net += (records[i].op == JOURNAL_INSERT) ? 1 : -1;
+    }
+    for (; net > 0; net--) {
+      inserts[insert_count++] = key;
+    }
+    for (; net < 0; net++) {
+      erases[erase_count++] = key;
+    }
+  }
+  rbtree_erase_batch(t, erases, erase_count);
+  rbtree_insert_batch(t, inserts, insert_count);
+  free(inserts);
+  free(erases);
+}
+
+int compare_records(const void *a, const void *b) {
+  const key_t lhs = ((const journal_record *)a)->key;
+  const key_t rhs = ((const journal_record *)b)->key;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+// group_size개가 차면 바로 commit한다. 그 commit이 실패하면 방금 쌓은 record를 빼고 -1을 반환하므로
+// 이 record의 연산은 tree에 반영되지 않는다. j->error가 남아 다음 record부터도 -1이고, checkpoint가 성공해야 다시 쌓는다.
+// 앞서 쌓인 record는 commit 전의 연산이므로 crash 때 사라질 수 있는 것은 여느 때와 같다.
+int append_record(rbtree_journal *j, const key_t key, const journal_op op) {
+  if (j->error != 0) {
+    errno = j->error;
+    return -1;
+  }
+  journal_record *records = (journal_record *)(j->buffer + sizeof(journal_batch_header));
+  records[j->count].key = key;
+  records[j->count].op = op;
+  j->count++;
+  if (j->count == j->group_size && rbtree_journal_commit(j) != 0) {
+    j->count--;
+    return -1;
+  }
+  return 0;
+}
+
+int write_all(const int fd, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    const ssize_t written = write(fd, p, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += written;
+    size -= (size_t)written;
+  }
+  return 0;
+}
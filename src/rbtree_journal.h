@@ -0,0 +1,40 @@
+#ifndef _RBTREE_JOURNAL_H_
+#define _RBTREE_JOURNAL_H_
+
+#include "rbtree.h"
+
+/*
+  rbtree에 붙이는 write-ahead journal. crash가 나도 마지막 commit까지의 insert/erase가 남는다.
+  - insert/erase는 record를 메모리에 쌓고 바로 tree에 반영한다. group_size개가 쌓이거나 rbtree_journal_commit을
+    부르면 쌓인 record를 한 묶음(batch)으로 log 끝에 쓰고 fsync 한 번으로 내린다 (group commit).
+    commit이 돌아오기 전의 연산은 crash 때 사라질 수 있다.
+  - rbtree_journal_checkpoint는 tree 전체를 snapshot 파일(rbtree_save 형식)로 쓰고 log를 비운다.
+  - rbtree_journal_open은 snapshot을 thaw하고 log를 다시 적용해 tree를 되살린다. log의 record는 key로 정렬해
+    key마다 insert와 erase를 상쇄한 뒤 rbtree_insert_batch/rbtree_erase_batch로 한꺼번에 적용한다.
+    끝이 잘린 batch(쓰다가 죽은 것)는 checksum으로 가려내 버린다.
+  log header에는 그 log가 이어지는 snapshot의 checksum을 적어 둔다. checkpoint가 snapshot을 바꾼 뒤 log를 비우기 전에
+  죽었다면 log가 가리키는 snapshot이 달라지므로, 이미 snapshot에 들어간 log를 한 번 더 적용하지 않는다.
+  commit이 실패하면 그 뒤의 insert/erase는 tree를 고치지 않고 NULL/-1을 반환한다. checkpoint가 성공하면 다시 받는다.
+  log header가 깨졌으면 rbtree_journal_open은 log를 비우지 않고 NULL을 반환한다.
+  tree는 journal이 가지고 있다. 읽기는 j->tree에 바로 하고, 고치는 것은 journal 함수로만 한다.
+*/
+typedef struct {
+  rbtree *tree;
+  char *snapshot_path;
+  int fd;                  // log 파일
+  uint64_t base_checksum;  // log가 이어지는 snapshot의 checksum. snapshot이 없으면 0
+  unsigned char *buffer;   // 아직 쓰지 않은 batch. 앞에 batch header 자리를 비워 둔다
+  size_t count;            // buffer의 record 수
+  size_t group_size;
+  int error;               // commit이 실패하면 errno를 남겨 두고 다음 commit과 insert/erase도 실패한다. checkpoint가 성공하면 지운다
+} rbtree_journal;
+
+rbtree_journal *rbtree_journal_open(const char *snapshot_path, const char *log_path, const size_t group_size);
+void delete_rbtree_journal(rbtree_journal *);
+
+node_t *rbtree_journal_insert(rbtree_journal *, const key_t);
+int rbtree_journal_erase(rbtree_journal *, node_t *);
+int rbtree_journal_commit(rbtree_journal *);
+int rbtree_journal_checkpoint(rbtree_journal *);
+
+#endif  // _RBTREE_JOURNAL_H_
@@ -0,0 +1,370 @@
+#include "rbtree_persistent.h"
+
+#include <stdlib.h>
+
+// 높이는 2 log2(n + 1)을 넘지 않는다. erase fixup의 첫 회전으로 stack을 한 칸 더 쓸 수 있다.
+#define RBTREE_PERSISTENT_MAX_PATH 130
+
+rbtree_pnode *new_pnode(key_t key);
+rbtree_pnode *retain_pnode(rbtree_pnode *node);
+void release_pnode(rbtree_pnode *node);
+rbtree_pnode *own_pnode(rbtree_pnode **slot);
+color_t pnode_color(const rbtree_pnode *node);
+size_t pnode_size(const rbtree_pnode *node);
+rbtree_pnode **pnode_slot(rbtree_persistent *t, rbtree_pnode **path, int i);
+void pnode_left_rotate(rbtree_pnode **slot);
+void pnode_right_rotate(rbtree_pnode **slot);
+void pnode_insert_fixup(rbtree_persistent *t, rbtree_pnode **path, int i);
+void pnode_erase_fixup(rbtree_persistent *t, rbtree_pnode **path, int i, int x_is_left);
+
+/*
+  1. Implementation 요구되는 functions
+*/
+rbtree_persistent *new_rbtree_persistent(void) {
+  return (rbtree_persistent *)calloc(1, sizeof(rbtree_persistent));
+}
+
+// 이 버전만 보던 node는 해제되고, 다른 버전과 나눠 가진 node는 참조 수만 줄어든다.
+void delete_rbtree_persistent(rbtree_persistent *t) {
+  release_pnode(t->root);
+  free(t);
+}
+
+// t의 지금 내용을 가리키는 새 handle. 어느 한쪽을 고쳐도 다른 쪽은 바뀌지 않는다.
+rbtree_persistent *rbtree_snapshot(const rbtree_persistent *t) {
+  rbtree_persistent *snapshot = new_rbtree_persistent();
+  snapshot->root = retain_pnode(t->root);
+  return snapshot;
+}
+
+// 같은 key는 오른쪽으로 보낸다
+int rbtree_persistent_insert(rbtree_persistent *t, const key_t key) {
+  rbtree_pnode *path[RBTREE_PERSISTENT_MAX_PATH];
+  int depth = 0;
+  rbtree_pnode **slot = &t->root;
+  while (*slot != NULL) {
+    rbtree_pnode *node = own_pnode(slot);
+    node->size++;
+    path[depth++] = node;
+    slot = (key < node->key) ? &node->left : &node->right;
+  }
+  *slot = new_pnode(key);
+  path[depth] = *slot;
+  pnode_insert_fixup(t, path, depth);
+  return 0;
+}
+
+// key를 가진 node 하나를 지우고 지운 개수(0 또는 1)를 반환한다.
+int rbtree_persistent_erase(rbtree_persistent *t, const key_t key) {
+  if (rbtree_persistent_find(t, key) == NULL) {
+    return 0;
+  }
+  // key를 가진 node까지, 자식이 둘이면 그 successor까지 내려가며 복사하고 size를 줄인다.
+  rbtree_pnode *path[RBTREE_PERSISTENT_MAX_PATH];
+  int depth = 0;
+  rbtree_pnode **slot = &t->root;
+  rbtree_pnode *target = NULL;
+  for (;;) {
+    rbtree_pnode *node = own_pnode(slot);
+    node->size--;
+    path[depth++] = node;
+    if (target == NULL && key == node->key) {
+      target = node;
+      if (node->left == NULL || node->right == NULL) {
+        break;
+      }
+      slot = &node->right;
+    }
+    else if (target != NULL) {
+      if (node->left == NULL) {
+        break;
+      }
+      slot = &node->left;
+    }
+    else {
+      slot = (key < node->key) ? &node->left : &node->right;
+    }
+  }
+
+  // 복사본은 이 버전만 가지므로 successor의 key를 target으로 옮기고 successor 자리를 지운다.
+  rbtree_pnode *y = path[depth - 1];
+  if (y != target) {
+    target->key = y->key;
+  }
+  rbtree_pnode *y_child = (y->left != NULL) ? y->left : y->right;
+  slot = pnode_slot(t, path, depth - 1);
+  const int x_is_left = (depth >= 2 && slot == &path[depth - 2]->left);
+  const color_t y_original_color = y->color;
+  *slot = y_child;
+  y->left = y->right = NULL;  // 자식은 slot이 넘겨받았다
+  release_pnode(y);
+
+  if (y_original_color == RBTREE_BLACK) {
+    pnode_erase_fixup(t, path, depth - 2, x_is_left);
+  }
+  return 1;
+}
+
+const rbtree_pnode *rbtree_persistent_find(const rbtree_persistent *t, const key_t key) {
+  const rbtree_pnode *cur_node = t->root;
+  while (cur_node != NULL && cur_node->key != key) {
+    cur_node = (key < cur_node->key) ? cur_node->left : cur_node->right;
+  }
+  return cur_node;
+}
+
+// 빈 tree면 NULL
+const rbtree_pnode *rbtree_persistent_min(const rbtree_persistent *t) {
+  const rbtree_pnode *cur_node = t->root;
+  while (cur_node != NULL && cur_node->left != NULL) {
+    cur_node = cur_node->left;
+  }
+  return cur_node;
+}
+
+const rbtree_pnode *rbtree_persistent_max(const rbtree_persistent *t) {
+  const rbtree_pnode *cur_node = t->root;
+  while (cur_node != NULL && cur_node->right != NULL) {
+    cur_node = cur_node->right;
+  }
+  return cur_node;
+}
+
+size_t rbtree_persistent_size(const rbtree_persistent *t) {
+  return pnode_size(t->root);
+}
+
+// key보다 작은 key의 개수 (rbtree_rank와 같다)
+size_t rbtree_persistent_rank(const rbtree_persistent *t, const key_t key) {
+  size_t rank = 0;
+  const rbtree_pnode *cur_node = t->root;
+  while (cur_node != NULL) {
+    if (key <= cur_node->key) {
+      cur_node = cur_node->left;
+    }
+    else {
+      rank += pnode_size(cur_node->left) + 1;
+      cur_node = cur_node->right;
+    }
+  }
+  return rank;
+}
+
+// parent link가 없으므로 지나온 node를 stack에 쌓으며 in-order로 돈다. 앞의 n개만 채운다.
+int rbtree_persistent_to_array(const rbtree_persistent *t, key_t *arr, const size_t n) {
+  const rbtree_pnode *stack[RBTREE_PERSISTENT_MAX_PATH];
+  int depth = 0;
+  size_t ticket = 0;
+  const rbtree_pnode *cur_node = t->root;
+  while ((cur_node != NULL || depth > 0) && ticket < n) {
+    while (cur_node != NULL) {
+      stack[depth++] = cur_node;
+      cur_node = cur_node->left;
+    }
+    cur_node = stack[--depth];
+    arr[ticket++] = cur_node->key;
+    cur_node = cur_node->right;
+  }
+  return 0;
+}
+
+/*
+  2. helper functions below
+*/
+rbtree_pnode *new_pnode(key_t key) {
+  rbtree_pnode *node = (rbtree_pnode *)calloc(1, sizeof(rbtree_pnode));
+  node->key = key;
+  node->color = RBTREE_RED;
+  node->refs = 1;
+  node->size = 1;
+  return node;
+}
+
+rbtree_pnode *retain_pnode(rbtree_pnode *node) {
+  if (node != NULL) {
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  }
+  return node;
+}
+
+// 마지막 참조였으면 자식의 참조도 놓고 해제한다.
+void release_pnode(rbtree_pnode *node) {
+  if (node == NULL || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  release_pnode(node->left);
+  release_pnode(node->right);
+  free(node);
+}
+
+// *slot을 이 버전만 가진 node로 만든다. 다른 버전과 나눠 가진 node면 복사해서 slot을 바꾼다.
+// slot을 가진 부모는 이미 이 버전만 가진 node여야 한다.
+rbtree_pnode *own_pnode(rbtree_pnode **slot) {
+  rbtree_pnode *node = *slot;
+  if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1) {
+    return node;
+  }
+  rbtree_pnode *copy = (rbtree_pnode *)malloc(sizeof(rbtree_pnode));
+  *copy = *node;
+  copy->refs = 1;
+  retain_pnode(copy->left);
+  retain_pnode(copy->right);
+  release_pnode(node);
+  *slot = copy;
+  return copy;
+}
+
+// NULL은 black이다
+color_t pnode_color(const rbtree_pnode *node) {
+  return (node == NULL) ? RBTREE_BLACK : node->color;
+}
+
+size_t pnode_size(const rbtree_pnode *node) {
+  return (node == NULL) ? 0 : node->size;
+}
+
+// path[i]를 가리키는 부모의 칸. path[i]가 root면 t->root
+rbtree_pnode **pnode_slot(rbtree_persistent *t, rbtree_pnode **path, int i) {
+  if (i == 0) {
+    return &t->root;
+  }
+  return (path[i - 1]->left == path[i]) ? &path[i - 1]->left : &path[i - 1]->right;
+}
+
+// *slot과 올라올 자식은 이 버전만 가진 node여야 한다. 포인터를 옮기기만 하므로 참조 수는 그대로이다.
+void pnode_left_rotate(rbtree_pnode **slot) {
+  rbtree_pnode *pivot = *slot;
+  rbtree_pnode *right = pivot->right;
+  pivot->right = right->left;
+  right->left = pivot;
+  right->size = pivot->size;
+  pivot->size = pnode_size(pivot->left) + pnode_size(pivot->right) + 1;
+  *slot = right;
+}
+
+void pnode_right_rotate(rbtree_pnode **slot) {
+  rbtree_pnode *pivot = *slot;
+  rbtree_pnode *left = pivot->left;
+  pivot->left = left->right;
+  left->right = pivot;
+  left->size = pivot->size;
+  pivot->size = pnode_size(pivot->left) + pnode_size(pivot->right) + 1;
+  *slot = left;
+}
+
+// rbtree.c의 rb_insert_fixup과 같은 case 분석이다. 부모와 조부모는 path[i - 1], path[i - 2]이다.
+void pnode_insert_fixup(rbtree_persistent *t, rbtree_pnode **path, int i) {
+  while (i >= 2 && pnode_color(path[i - 1]) == RBTREE_RED) {
+    rbtree_pnode *node = path[i], *parent = path[i - 1], *grandparent = path[i - 2];
+    if (parent == grandparent->left) {
+      if (pnode_color(grandparent->right) == RBTREE_RED) {
+        own_pnode(&grandparent->right)->color = RBTREE_BLACK;
+        parent->color = RBTREE_BLACK;
+        grandparent->color = RBTREE_RED;
+        i -= 2;
+        continue;
+      }
+      if (node == parent->right) {
+        pnode_left_rotate(&grandparent->left);
+        parent = node;
+      }
+      parent->color = RBTREE_BLACK;
+      grandparent->color = RBTREE_RED;
+      pnode_right_rotate(pnode_slot(t, path, i - 2));
+    }
+    else {
+      if (pnode_color(grandparent->left) == RBTREE_RED) {
+        own_pnode(&grandparent->left)->color = RBTREE_BLACK;
+        parent->color = RBTREE_BLACK;
+        grandparent->color = RBTREE_RED;
+        i -= 2;
+        continue;
+      }
+      if (node == parent->left) {
+        pnode_right_rotate(&grandparent->right);
+        parent = node;
+      }
+      parent->color = RBTREE_BLACK;
+      grandparent->color = RBTREE_RED;
+      pnode_left_rotate(pnode_slot(t, path, i - 2));
+    }
+    break;
+  }
+  t->root->color = RBTREE_BLACK;  // root는 위에서 복사해 두었다
+}
+
+// rbtree.c의 rb_delete_fixup과 같은 case 분석이다.
+// 지워진 자리의 x는 NULL일 수 있으므로 부모 path[i]와 방향으로 가리킨다. i가 -1이면 x는 root이다.
+void pnode_erase_fixup(rbtree_persistent *t, rbtree_pnode **path, int i, int x_is_left) {
+  while (i >= 0) {
+    rbtree_pnode *parent = path[i];
+    if (pnode_color(x_is_left ? parent->left : parent->right) == RBTREE_RED) {
+      break;
+    }
+    if (x_is_left) {
+      rbtree_pnode *sibling = own_pnode(&parent->right);
+      // case 1: sibling이 red면 회전해서 black sibling을 만든다. parent가 한 칸 내려간다.
+      if (sibling->color == RBTREE_RED) {
+        sibling->color = RBTREE_BLACK;
+        parent->color = RBTREE_RED;
+        pnode_left_rotate(pnode_slot(t, path, i));
+        path[i] = sibling;
+        path[++i] = parent;
+        sibling = own_pnode(&parent->right);
+      }
+      // case 2: sibling의 두 자식이 모두 black이면 black 하나를 parent로 올린다.
+      if (pnode_color(sibling->left) == RBTREE_BLACK && pnode_color(sibling->right) == RBTREE_BLACK) {
+        sibling->color = RBTREE_RED;
+        x_is_left = (i > 0 && path[i - 1]->left == parent);
+        i--;
+        continue;
+      }
+      // case 3: 먼 쪽 자식이 black이면 sibling을 회전해 case 4로 만든다.
+      if (pnode_color(sibling->right) == RBTREE_BLACK) {
+        own_pnode(&sibling->left)->color = RBTREE_BLACK;
+        sibling->color = RBTREE_RED;
+        pnode_right_rotate(&parent->right);
+        sibling = parent->right;
+      }
+      // case 4
+      sibling->color = parent->color;
+      parent->color = RBTREE_BLACK;
+      own_pnode(&sibling->right)->color = RBTREE_BLACK;
+      pnode_left_rotate(pnode_slot(t, path, i));
+      return;
+    }
+    else {
+      rbtree_pnode *sibling = own_pnode(&parent->left);
+      if (sibling->color == RBTREE_RED) {
+        sibling->color = RBTREE_BLACK;
+        parent->color = RBTREE_RED;
+        pnode_right_rotate(pnode_slot(t, path, i));
+        path[i] = sibling;
+        path[++i] = parent;
+        sibling = own_pnode(&parent->left);
+      }
+      if (pnode_color(sibling->left) == RBTREE_BLACK && pnode_color(sibling->right) == RBTREE_BLACK) {
+        sibling->color = RBTREE_RED;
+        x_is_left = (i > 0 && path[i - 1]->left == parent);
+        i--;
+        continue;
+      }
+      if (pnode_color(sibling->left) == RBTREE_BLACK) {
+        own_pnode(&sibling->right)->color = RBTREE_BLACK;
+        sibling->color = RBTREE_RED;
+        pnode_left_rotate(&parent->left);
+        sibling = parent->left;
+      }
+      sibling->color = parent->color;
+      parent->color = RBTREE_BLACK;
+      own_pnode(&sibling->left)->color = RBTREE_BLACK;
+      pnode_right_rotate(pnode_slot(t, path, i));
+      return;
+    }
+  }
+  // x가 red이거나 root까지 올라왔다
+  rbtree_pnode **slot = (i < 0) ? &t->root : (x_is_left ? &path[i]->left : &path[i]->right);
+  if (*slot != NULL) {
+    own_pnode(slot)->color = RBTREE_BLACK;
+  }
+}
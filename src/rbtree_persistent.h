@@ -0,0 +1,44 @@
+#ifndef _RBTREE_PERSISTENT_H_
+#define _RBTREE_PERSISTENT_H_
+
+#include "rbtree.h"
+
+/*
+  path copying으로 이전 버전을 보존하는 red-black tree.
+  rbtree_snapshot은 root의 참조 수만 늘리므로 O(1)이다. 그 뒤 어느 쪽에서든 insert/erase를 하면
+  root부터 바뀌는 자리까지의 O(log n)개 node만 복사하고, 나머지 subtree는 두 버전이 같이 쓴다.
+  node는 참조 수로 관리하며, 마지막 버전이 놓을 때 해제된다.
+
+  node에는 parent pointer가 없다. insert/erase는 내려가면서 지나온 node를 stack에 쌓아 두고,
+  fixup은 그 stack을 부모 대신 쓴다. 참조 수가 1인 node는 이 버전만 보고 있으므로 복사하지 않고 그대로 고친다.
+
+  한 handle(rbtree_persistent)은 한 번에 한 thread만 쓴다.
+  같은 node를 나눠 가진 서로 다른 handle은 각자 다른 thread에서 읽고 쓰고 지워도 된다. (참조 수는 atomic)
+*/
+typedef struct rbtree_pnode {
+  key_t key;
+  color_t color;
+  unsigned refs;  // 이 node를 가리키는 부모 또는 handle의 수
+  size_t size;    // 이 node를 root로 하는 subtree의 node 개수
+  struct rbtree_pnode *left, *right;  // 없으면 NULL
+} rbtree_pnode;
+
+typedef struct {
+  rbtree_pnode *root;
+} rbtree_persistent;
+
+rbtree_persistent *new_rbtree_persistent(void);
+void delete_rbtree_persistent(rbtree_persistent *);
+rbtree_persistent *rbtree_snapshot(const rbtree_persistent *);
+
+int rbtree_persistent_insert(rbtree_persistent *, const key_t);
+int rbtree_persistent_erase(rbtree_persistent *, const key_t);
+const rbtree_pnode *rbtree_persistent_find(const rbtree_persistent *, const key_t);
+const rbtree_pnode *rbtree_persistent_min(const rbtree_persistent *);
+const rbtree_pnode *rbtree_persistent_max(const rbtree_persistent *);
+
+size_t rbtree_persistent_size(const rbtree_persistent *);
+size_t rbtree_persistent_rank(const rbtree_persistent *, const key_t);
+int rbtree_persistent_to_array(const rbtree_persistent *, key_t *, const size_t);
+
+#endif  // _RBTREE_PERSISTENT_H_
@@ -0,0 +1,393 @@
+#include "rbtree_sharded.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+#define RBTREE_SHARD_MAX 4096
+// 이보다 작은 shard는 쓰기가 몰려도 나누지 않는다.
+#define RBTREE_SHARD_MIN_SPLIT 64
+// 평균의 몇 배를 넘으면 뜨거운 shard로 보고 나눈다.
+#define RBTREE_SHARD_HOT_FACTOR 2
+
+rbtree_shard *new_shard(rbtree *tree, key_t lo);
+void delete_shard(rbtree_shard *shard);
+void retire_shard(rbtree_sharded *s, rbtree_shard *shard);
+rbtree_shard *shard_at(const rbtree_sharded *s, size_t index);
+size_t shard_index(const rbtree_sharded *s, key_t key);
+rbtree_shard *lock_shard(rbtree_sharded *s, key_t key);
+void unlock_shard(rbtree_sharded *s, rbtree_shard *shard);
+void set_shard_at(rbtree_sharded *s, size_t index, rbtree_shard *shard);
+int insert_shard_at(rbtree_sharded *s, size_t index, rbtree_shard *shard);
+size_t split_shard(rbtree_sharded *s, size_t index, size_t pieces);
+size_t split_pieces(size_t load, size_t avg_load);
+void merge_shards(rbtree_sharded *s, size_t index);
+
+/*
+  1. Implementation 요구되는 functions
+*/
+// [lo, hi]를 shard_count개의 같은 폭 구간으로 나눈다. 구간 밖의 key는 양 끝 shard로 간다.
+// shards 배열은 lock 없이 읽히므로 RBTREE_SHARD_MAX칸을 미리 잡아 두고 다시 잡지 않는다.
+rbtree_sharded *new_rbtree_sharded(const size_t shard_count, const key_t lo, const key_t hi) {
+  rbtree_sharded *s = (rbtree_sharded *)calloc(1, sizeof(rbtree_sharded));
+  const size_t count = (shard_count == 0) ? 1 : shard_count;
+  s->capacity = (count > RBTREE_SHARD_MAX) ? count : RBTREE_SHARD_MAX;
+  s->shards = (rbtree_shard **)calloc(s->capacity, sizeof(rbtree_shard *));
+  pthread_rwlock_init(&s->layout_lock, NULL);
+
+  const long long width = (long long)hi - lo + 1;
+  for (size_t i = 0; i < count; i++) {
+    key_t shard_lo = (i == 0) ? INT_MIN : (key_t)(lo + width * (long long)i / (long long)count);
+    s->shards[s->count++] = new_shard(new_rbtree(), shard_lo);
+  }
+  s->min_count = s->count;
+  return s;
+}
+
+void delete_rbtree_sharded(rbtree_sharded *s) {
+  for (size_t i = 0; i < s->count; i++) {
+    delete_shard(s->shards[i]);
+  }
+  while (s->retired != NULL) {
+    rbtree_shard *next = s->retired->retired_next;
+    delete_shard(s->retired);
+    s->retired = next;
+  }
+  pthread_rwlock_destroy(&s->layout_lock);
+  free(s->shards);
+  free(s);
+}
+
+int rbtree_sharded_insert(rbtree_sharded *s, const key_t key) {
+  rbtree_shard *shard = lock_shard(s, key);
+  rbtree_insert(shard->tree, key);
+  shard->writes++;
+  unlock_shard(s, shard);
+  return 0;
+}
+
+// key가 있으면 1
+int rbtree_sharded_find(rbtree_sharded *s, const key_t key) {
+  rbtree_shard *shard = lock_shard(s, key);
+  const int found = rbtree_find(shard->tree, key) != NULL;
+  unlock_shard(s, shard);
+  return found;
+}
+
+// key를 가진 node 하나를 지우고 지운 개수(0 또는 1)를 반환한다.
+int rbtree_sharded_erase(rbtree_sharded *s, const key_t key) {
+  rbtree_shard *shard = lock_shard(s, key);
+  node_t *node = rbtree_find(shard->tree, key);
+  if (node != NULL) {
+    rbtree_erase(shard->tree, node);
+    shard->writes++;
+  }
+  unlock_shard(s, shard);
+  return node != NULL;
+}
+
+// 비어 있지 않으면 가장 작은 key를 *min에 쓰고 1을 반환한다.
+int rbtree_sharded_min(rbtree_sharded *s, key_t *min) {
+  return rbtree_sharded_lower_bound(s, INT_MIN, min);
+}
+
+int rbtree_sharded_max(rbtree_sharded *s, key_t *max) {
+  int found = 0;
+  pthread_rwlock_rdlock(&s->layout_lock);
+  for (size_t i = s->count; i > 0 && !found; i--) {
+    rbtree_shard *shard = s->shards[i - 1];
+    pthread_mutex_lock(&shard->lock);
+    node_t *node = rbtree_max(shard->tree);
+    if (node != NULL) {
+      *max = node->key;
+      found = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  pthread_rwlock_unlock(&s->layout_lock);
+  return found;
+}
+
+// key 이상인 첫 key를 *bound에 쓰고 1을 반환한다. 없으면 0
+int rbtree_sharded_lower_bound(rbtree_sharded *s, const key_t key, key_t *bound) {
+  int found = 0;
+  pthread_rwlock_rdlock(&s->layout_lock);
+  for (size_t i = shard_index(s, key); i < s->count && !found; i++) {
+    rbtree_shard *shard = s->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    node_t *node = rbtree_lower_bound(shard->tree, key);
+    if (node != NULL) {
+      *bound = node->key;
+      found = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  pthread_rwlock_unlock(&s->layout_lock);
+  return found;
+}
+
+size_t rbtree_sharded_size(rbtree_sharded *s) {
+  size_t size = 0;
+  pthread_rwlock_rdlock(&s->layout_lock);
+  for (size_t i = 0; i < s->count; i++) {
+    pthread_mutex_lock(&s->shards[i]->lock);
+    size += rbtree_size(s->shards[i]->tree);
+    pthread_mutex_unlock(&s->shards[i]->lock);
+  }
+  pthread_rwlock_unlock(&s->layout_lock);
+  return size;
+}
+
+// 지금 shard 개수
+size_t rbtree_sharded_count(rbtree_sharded *s) {
+  return __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+}
+
+// shard 구간이 key 순서이므로 shard를 차례로 이어 붙이면 정렬된 결과가 된다. 앞의 n개만 채운다.
+int rbtree_sharded_to_array(rbtree_sharded *s, key_t *arr, const size_t n) {
+  rbtree_sharded_range_to_array(s, INT_MIN, INT_MAX, arr, n);
+  return 0;
+}
+
+size_t rbtree_sharded_range_count(rbtree_sharded *s, const key_t lo, const key_t hi) {
+  if (hi < lo) {
+    return 0;
+  }
+  size_t count = 0;
+  pthread_rwlock_rdlock(&s->layout_lock);
+  for (size_t i = shard_index(s, lo); i < s->count && s->shards[i]->lo <= hi; i++) {
+    pthread_mutex_lock(&s->shards[i]->lock);
+    count += rbtree_range_count(s->shards[i]->tree, lo, hi);
+    pthread_mutex_unlock(&s->shards[i]->lock);
+  }
+  pthread_rwlock_unlock(&s->layout_lock);
+  return count;
+}
+
+// [lo, hi] 구간의 key를 순서대로 최대 cap개 arr에 채우고, 채운 개수를 반환한다.
+size_t rbtree_sharded_range_to_array(rbtree_sharded *s, const key_t lo, const key_t hi, key_t *arr, const size_t cap) {
+  size_t count = 0;
+  pthread_rwlock_rdlock(&s->layout_lock);
+  for (size_t i = shard_index(s, lo); i < s->count && s->shards[i]->lo <= hi && count < cap; i++) {
+    pthread_mutex_lock(&s->shards[i]->lock);
+    count += rbtree_range_to_array(s->shards[i]->tree, lo, hi, arr + count, cap - count);
+    pthread_mutex_unlock(&s->shards[i]->lock);
+  }
+  pthread_rwlock_unlock(&s->layout_lock);
+  return count;
+}
+
+// 마지막 rebalance 이후 쓰기가 몰렸거나 key가 몰린 shard는 평균 정도가 되도록 여러 조각으로 나누고,
+// 둘 다 식은 이웃 shard는 하나로 합친다. 새로 생기거나 없어진 shard 수를 반환한다.
+// layout_seq를 홀수로 만든 뒤 지금 있는 shard의 lock을 모두 잡으므로, 진행 중인 insert/erase/find가 끝난 뒤에 고친다.
+size_t rbtree_sharded_rebalance(rbtree_sharded *s) {
+  pthread_rwlock_wrlock(&s->layout_lock);
+  __atomic_store_n(&s->layout_seq, s->layout_seq + 1, __ATOMIC_SEQ_CST);
+  const size_t held_count = s->count;
+  rbtree_shard **held = (rbtree_shard **)malloc(held_count * sizeof(rbtree_shard *));
+  for (size_t i = 0; i < held_count; i++) {
+    held[i] = s->shards[i];
+    pthread_mutex_lock(&held[i]->lock);
+  }
+
+  size_t total_size = 0, total_writes = 0;
+  for (size_t i = 0; i < s->count; i++) {
+    total_size += rbtree_size(s->shards[i]->tree);
+    total_writes += s->shards[i]->writes;
+  }
+  const size_t avg_size = total_size / s->count;
+  const size_t avg_writes = total_writes / s->count;
+
+  size_t changes = 0;
+  for (size_t i = 0; i < s->count; i++) {
+    const rbtree_shard *shard = s->shards[i];
+    const size_t size = rbtree_size(shard->tree);
+    const int hot = shard->writes > RBTREE_SHARD_HOT_FACTOR * avg_writes ||
+                    size > RBTREE_SHARD_HOT_FACTOR * avg_size;
+    if (hot && size >= RBTREE_SHARD_MIN_SPLIT) {
+      size_t pieces = split_pieces(size, avg_size);
+      if (split_pieces(shard->writes, avg_writes) > pieces) {
+        pieces = split_pieces(shard->writes, avg_writes);
+      }
+      // 조각 하나가 RBTREE_SHARD_MIN_SPLIT / 2보다 작아지지 않게 한다
+      if (pieces > 2 * size / RBTREE_SHARD_MIN_SPLIT) {
+        pieces = 2 * size / RBTREE_SHARD_MIN_SPLIT;
+      }
+      const size_t added = split_shard(s, i, pieces);
+      changes += added;
+      i += added;  // 새로 생긴 조각은 이번에는 다시 보지 않는다
+    }
+  }
+  for (size_t i = 0; i + 1 < s->count && s->count > s->min_count;) {
+    const rbtree_shard *left = s->shards[i], *right = s->shards[i + 1];
+    const size_t size = rbtree_size(left->tree) + rbtree_size(right->tree);
+    const size_t writes = left->writes + right->writes;
+    if (size <= avg_size / 2 && writes <= avg_writes / 2) {
+      merge_shards(s, i);
+      changes++;
+    }
+    else {
+      i++;
+    }
+  }
+
+  for (size_t i = 0; i < s->count; i++) {
+    s->shards[i]->writes = 0;
+  }
+  __atomic_store_n(&s->layout_seq, s->layout_seq + 1, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < held_count; i++) {
+    pthread_mutex_unlock(&held[i]->lock);
+  }
+  free(held);
+  pthread_rwlock_unlock(&s->layout_lock);
+  return changes;
+}
+
+/*
+  2. helper functions below
+*/
+rbtree_shard *new_shard(rbtree *tree, key_t lo) {
+  rbtree_shard *shard = (rbtree_shard *)calloc(1, sizeof(rbtree_shard));
+  shard->tree = tree;
+  shard->lo = lo;
+  pthread_mutex_init(&shard->lock, NULL);
+  return shard;
+}
+
+void delete_shard(rbtree_shard *shard) {
+  pthread_mutex_destroy(&shard->lock);
+  if (shard->tree != NULL) {
+    delete_rbtree(shard->tree);
+  }
+  free(shard);
+}
+
+// 합쳐져 없어진 shard. lock을 잡은 채로 layout을 읽던 writer가 있을 수 있으므로 tree만 지우고 shard는 남겨 둔다.
+void retire_shard(rbtree_sharded *s, rbtree_shard *shard) {
+  delete_rbtree(shard->tree);
+  shard->tree = NULL;
+  shard->retired_next = s->retired;
+  s->retired = shard;
+}
+
+rbtree_shard *shard_at(const rbtree_sharded *s, size_t index) {
+  return __atomic_load_n(&s->shards[index], __ATOMIC_ACQUIRE);
+}
+
+// key가 속한 shard. lo가 key 이하인 마지막 shard이다.
+// lock_shard는 rebalance와 겹쳐 부르므로 그때 얻은 index는 layout_seq로 확인한 뒤에만 믿는다.
+size_t shard_index(const rbtree_sharded *s, key_t key) {
+  size_t lo = 0, hi = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+  while (hi - lo > 1) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (shard_at(s, mid)->lo <= key) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// key가 속한 shard의 lock을 잡는다. 공유하는 lock은 건드리지 않는다.
+// shard lock을 잡은 뒤에도 layout_seq가 그대로면 rebalance는 아직 이 shard의 lock을 기다리는 중이거나 시작하지 않았으므로
+// 고른 shard가 맞다. 달라졌으면 풀고 다시 고른다. rebalance 중(홀수)이면 layout lock으로 끝나기를 기다린다.
+rbtree_shard *lock_shard(rbtree_sharded *s, key_t key) {
+  for (;;) {
+    const unsigned seq = __atomic_load_n(&s->layout_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      pthread_rwlock_rdlock(&s->layout_lock);
+      pthread_rwlock_unlock(&s->layout_lock);
+      continue;
+    }
+    rbtree_shard *shard = shard_at(s, shard_index(s, key));
+    pthread_mutex_lock(&shard->lock);
+    if (__atomic_load_n(&s->layout_seq, __ATOMIC_ACQUIRE) == seq) {
+      return shard;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void unlock_shard(rbtree_sharded *s, rbtree_shard *shard) {
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// lock 없이 읽는 writer가 있으므로 shards 칸은 atomic으로 쓴다
+void set_shard_at(rbtree_sharded *s, size_t index, rbtree_shard *shard) {
+  __atomic_store_n(&s->shards[index], shard, __ATOMIC_RELEASE);
+}
+
+// shards[index] 자리에 끼워 넣는다. 자리가 없으면 0
+int insert_shard_at(rbtree_sharded *s, size_t index, rbtree_shard *shard) {
+  if (s->count == s->capacity) {
+    return 0;
+  }
+  for (size_t i = s->count; i > index; i--) {
+    set_shard_at(s, i, s->shards[i - 1]);
+  }
+  set_shard_at(s, index, shard);
+  __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// load가 평균의 몇 배인지 올림한 값. 최소 2
+size_t split_pieces(size_t load, size_t avg_load) {
+  if (avg_load == 0) {
+    return 2;
+  }
+  const size_t pieces = (load + avg_load - 1) / avg_load;
+  return (pieces < 2) ? 2 : pieces;
+}
+
+// key 순서로 pieces개의 비슷한 크기로 나눠, 첫 조각은 그 자리에 두고 나머지는 바로 뒤에 새 shard로 끼운다.
+// 같은 key는 한 shard에 모이도록 경계를 그 key가 처음 나오는 곳으로 당긴다. 새로 생긴 shard 수를 반환한다.
+// layout lock을 쓰기로 잡은 채로 부른다.
+size_t split_shard(rbtree_sharded *s, size_t index, size_t pieces) {
+  rbtree_shard *shard = s->shards[index];
+  const size_t size = rbtree_size(shard->tree);
+  key_t *keys = (key_t *)malloc(size * sizeof(key_t));
+  rbtree_to_array(shard->tree, keys, size);
+
+  size_t added = 0;
+  size_t end = size;  // 뒤에서부터 잘라 내면 끼워 넣을 자리가 index + 1로 고정된다
+  for (size_t piece = pieces - 1; piece > 0 && s->count < s->capacity; piece--) {
+    size_t cut = piece * size / pieces;
+    while (cut > 0 && keys[cut - 1] == keys[cut]) {
+      cut--;
+    }
+    if (cut == 0 || cut >= end) {
+      continue;
+    }
+    rbtree_shard *right = new_shard(rbtree_build_sorted(keys + cut, end - cut), keys[cut]);
+    if (!insert_shard_at(s, index + 1, right)) {
+      delete_shard(right);
+      break;
+    }
+    end = cut;
+    added++;
+  }
+  if (added > 0) {
+    delete_rbtree(shard->tree);
+    shard->tree = rbtree_build_sorted(keys, end);
+  }
+  free(keys);
+  return added;
+}
+
+// shards[index + 1]을 shards[index]에 합친다. layout lock을 쓰기로 잡은 채로 부른다.
+void merge_shards(rbtree_sharded *s, size_t index) {
+  rbtree_shard *left = s->shards[index], *right = s->shards[index + 1];
+  const size_t n = rbtree_size(right->tree);
+  key_t *keys = (key_t *)malloc((n == 0 ? 1 : n) * sizeof(key_t));
+  rbtree_to_array(right->tree, keys, n);
+  rbtree_insert_batch(left->tree, keys, n);
+  free(keys);
+
+  left->writes += right->writes;
+  for (size_t i = index + 1; i + 1 < s->count; i++) {
+    set_shard_at(s, i, s->shards[i + 1]);
+  }
+  __atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELEASE);
+  retire_shard(s, right);
+}
@@ -0,0 +1,58 @@
+#ifndef _RBTREE_SHARDED_H_
+#define _RBTREE_SHARDED_H_
+
+#include "rbtree.h"
+
+#include <pthread.h>
+
+/*
+  key 구간별로 나눈 여러 rbtree. shard마다 lock이 따로 있어서 서로 다른 shard에 쓰는 writer는 기다리지 않는다.
+  shards[i]는 [shards[i]->lo, shards[i+1]->lo) 구간의 key를 가진다. 첫 shard의 lo는 key_t의 최솟값이다.
+  모든 함수는 여러 thread에서 불러도 된다.
+  - insert/erase/find는 해당 shard lock만 잡는다. 공유하는 lock을 건드리지 않으므로 서로 다른 shard의 writer는
+    cache line 하나를 두고 다투지 않는다. shard를 고른 뒤 lock을 잡고 layout_seq가 그대로인지 확인하고,
+    그사이 rebalance가 끼어들었으면 다시 고른다.
+  - rbtree_sharded_rebalance는 layout lock을 쓰기로 잡고, layout_seq를 홀수로 만든 뒤 모든 shard lock을 잡고 나서
+    shard를 나누거나 합친다. 합쳐서 없어진 shard와 shards 배열은 delete_rbtree_sharded 전까지 해제하지 않으므로
+    layout을 읽던 writer가 밟아도 안전하다.
+  - 여러 shard를 훑는 함수(min/max, to_array, range)는 layout lock을 읽기로 잡고 shard를 순서대로 하나씩 잠그므로,
+    동시에 들어오는 insert/erase에 대해 전체를 한 시점에 찍은 결과는 아니다.
+  node는 lock 밖으로 내보내지 않으므로 find 계열은 node_t * 대신 key를 돌려준다.
+*/
+typedef struct rbtree_shard {
+  rbtree *tree;                // 합쳐져 없어진 shard는 NULL
+  key_t lo;                    // 만든 뒤로 바뀌지 않는다
+  size_t writes;               // 마지막 rebalance 이후 insert/erase 횟수
+  pthread_mutex_t lock;
+  struct rbtree_shard *retired_next;  // 합쳐져 없어진 shard들의 목록
+} rbtree_shard;
+
+typedef struct {
+  rbtree_shard **shards;       // key 구간 순서. 처음에 capacity칸을 잡고 다시 잡지 않는다
+  size_t count;
+  size_t capacity;
+  size_t min_count;            // 합치더라도 처음 만든 개수 아래로는 줄이지 않는다
+  unsigned layout_seq;         // rebalance가 shards를 고치는 동안 홀수
+  rbtree_shard *retired;       // delete_rbtree_sharded에서 해제한다
+  pthread_rwlock_t layout_lock;  // rebalance(쓰기)와 여러 shard를 훑는 함수(읽기) 사이
+} rbtree_sharded;
+
+rbtree_sharded *new_rbtree_sharded(const size_t shard_count, const key_t lo, const key_t hi);
+void delete_rbtree_sharded(rbtree_sharded *);
+
+int rbtree_sharded_insert(rbtree_sharded *, const key_t);
+int rbtree_sharded_find(rbtree_sharded *, const key_t);
+int rbtree_sharded_erase(rbtree_sharded *, const key_t);
+int rbtree_sharded_min(rbtree_sharded *, key_t *);
+int rbtree_sharded_max(rbtree_sharded *, key_t *);
+int rbtree_sharded_lower_bound(rbtree_sharded *, const key_t, key_t *);
+
+size_t rbtree_sharded_size(rbtree_sharded *);
+size_t rbtree_sharded_count(rbtree_sharded *);
+int rbtree_sharded_to_array(rbtree_sharded *, key_t *, const size_t);
+size_t rbtree_sharded_range_count(rbtree_sharded *, const key_t, const key_t);
+size_t rbtree_sharded_range_to_array(rbtree_sharded *, const key_t, const key_t, key_t *, const size_t);
+
+size_t rbtree_sharded_rebalance(rbtree_sharded *);
+
+#endif  // _RBTREE_SHARDED_H_
@@ -0,0 +1,123 @@
+#ifndef _RBTREE_TEMPLATE_H_
+#define _RBTREE_TEMPLATE_H_
+
+#include "rbtree.h"
+
+/*
+  key type마다 rbtree를 찍어 내는 macro.
+
+    RBTREE_DEFINE(u64tree, uint64_t, (a > b) - (a < b))
+
+  처럼 쓰면 u64tree_node와 u64tree_new/insert/find/erase/... 가 생긴다.
+  cmp_expr는 key_type인 a, b에 대해 a < b면 음수, 같으면 0, a > b면 양수가 되는 식이다.
+  비교는 static inline 함수 안에 그대로 펼쳐지므로 function pointer를 거치지 않는다.
+
+  node는 node_t 뒤에 key를 붙인 모양이고, 회전과 fixup, 삭제, 순회, node pool은 rbtree.c의 것을 그대로 쓴다.
+  node_t 안의 int key는 쓰지 않는다. tree는 rbtree *로 다루며 delete_rbtree, rbtree_size 등도 그대로 쓸 수 있다.
+  기존 int API(rbtree_insert 등)는 key를 node_t 안에 둔 같은 구조의 tree이다.
+*/
+#define RBTREE_DEFINE(name, key_type, cmp_expr)                                       \
+  typedef struct name##_node {                                                        \
+    node_t link;                                                                      \
+    key_type key;                                                                     \
+  } name##_node;                                                                      \
+                                                                                      \
+  static inline int name##_cmp(const key_type a, const key_type b) {                  \
+    return (cmp_expr);                                                                \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_entry(const node_t *node) {                       \
+    return (name##_node *)node;                                                       \
+  }                                                                                   \
+                                                                                      \
+  static inline rbtree *name##_new(void) {                                            \
+    return new_rbtree_with_node_size(sizeof(name##_node), 0);                         \
+  }                                                                                   \
+                                                                                      \
+  static inline rbtree *name##_new_with_capacity(const size_t capacity) {             \
+    return new_rbtree_with_node_size(sizeof(name##_node), capacity);                  \
+  }                                                                                   \
+                                                                                      \
+  /* 같은 key는 오른쪽으로 보낸다 */                                                  \
+  static inline name##_node *name##_insert(rbtree *t, const key_type key) {           \
+    node_t *parent = t->nil;                                                          \
+    node_t *cur_node = t->root;                                                       \
+    int as_left = 0;                                                                  \
+    while (cur_node != t->nil) {                                                      \
+      parent = cur_node;                                                              \
+      as_left = name##_cmp(key, name##_entry(cur_node)->key) < 0;                     \
+      cur_node = as_left ? rb_left(t, cur_node) : rb_right(t, cur_node);              \
+    }                                                                                 \
+    name##_node *node = name##_entry(rbtree_alloc_node(t));                           \
+    node->key = key;                                                                  \
+    rbtree_insert_at(t, parent, &node->link, as_left);                                \
+    return node;                                                                      \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_find(const rbtree *t, const key_type key) {       \
+    node_t *cur_node = t->root;                                                       \
+    while (cur_node != t->nil) {                                                      \
+      const int cmp = name##_cmp(key, name##_entry(cur_node)->key);                   \
+      if (cmp == 0) {                                                                 \
+        return name##_entry(cur_node);                                                \
+      }                                                                               \
+      cur_node = (cmp < 0) ? rb_left(t, cur_node) : rb_right(t, cur_node);            \
+    }                                                                                 \
+    return NULL;                                                                      \
+  }                                                                                   \
+                                                                                      \
+  /* key 이상(upper이면 초과)인 첫 node. 없으면 NULL */                               \
+  static inline name##_node *name##_bound(const rbtree *t, const key_type key,        \
+                                          const int upper) {                          \
+    node_t *bound = NULL;                                                             \
+    node_t *cur_node = t->root;                                                       \
+    while (cur_node != t->nil) {                                                      \
+      const int cmp = name##_cmp(key, name##_entry(cur_node)->key);                   \
+      if (cmp < 0 || (cmp == 0 && !upper)) {                                          \
+        bound = cur_node;                                                             \
+        cur_node = rb_left(t, cur_node);                                              \
+      }                                                                               \
+      else {                                                                          \
+        cur_node = rb_right(t, cur_node);                                             \
+      }                                                                               \
+    }                                                                                 \
+    return name##_entry(bound);                                                       \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_lower_bound(const rbtree *t, const key_type key) { \
+    return name##_bound(t, key, 0);                                                   \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_upper_bound(const rbtree *t, const key_type key) { \
+    return name##_bound(t, key, 1);                                                   \
+  }                                                                                   \
+                                                                                      \
+  static inline int name##_erase(rbtree *t, name##_node *node) {                      \
+    return rbtree_erase(t, &node->link);                                              \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_min(const rbtree *t) {                            \
+    return name##_entry(rbtree_min(t));                                               \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_max(const rbtree *t) {                            \
+    return name##_entry(rbtree_max(t));                                               \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_next(const rbtree *t, const name##_node *node) {  \
+    return name##_entry(rbtree_next(t, &node->link));                                 \
+  }                                                                                   \
+                                                                                      \
+  static inline name##_node *name##_prev(const rbtree *t, const name##_node *node) {  \
+    return name##_entry(rbtree_prev(t, &node->link));                                 \
+  }                                                                                   \
+                                                                                      \
+  static inline size_t name##_to_array(const rbtree *t, key_type *arr, const size_t n) { \
+    size_t count = 0;                                                                 \
+    for (name##_node *p = name##_min(t); p != NULL && count < n; p = name##_next(t, p)) { \
+      arr[count++] = p->key;                                                          \
+    }                                                                                 \
+    return count;                                                                     \
+  }
+
+#endif  // _RBTREE_TEMPLATE_H_
@@ -1,8 +1,19 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <rbtree.h>
+#include <rbtree_frozen.h>
+#include <rbtree_journal.h>
+#include <rbtree_persistent.h>
+#include <rbtree_sharded.h>
+#include <rbtree_template.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 // new_rbtree should return rbtree struct with null root node
 void test_init(void) {
@@ -26,9 +37,9 @@ void test_insert_single(const key_t key) {
   assert(p->key == key);
   // assert(p->color == RBTREE_BLACK);  // color of root node should be black
 #ifdef SENTINEL
-  assert(p->left == t->nil);
-  assert(p->right == t->nil);
-  assert(p->parent == t->nil);
+  assert(rb_left(t, p) == t->nil);
+  assert(rb_right(t, p) == t->nil);
+  assert(rb_parent(t, p) == t->nil);
 #else
   assert(p->left == NULL);
   assert(p->right == NULL);
@@ -180,8 +191,8 @@ void test_multi_instance() {
 // The values of right subtree should be greater than or equal to the current
 // node
 
-static bool search_traverse(const node_t *p, key_t *min, key_t *max,
-                            node_t *nil) {
+static bool search_traverse(const rbtree *t, const node_t *p, key_t *min,
+                            key_t *max, node_t *nil) {
   if (p == nil) {
     return true;
   }
@@ -191,11 +202,11 @@ static bool search_traverse(const node_t *p, key_t *min, key_t *max,
   key_t l_min, l_max, r_min, r_max;
   l_min = l_max = r_min = r_max = p->key;
 
-  const bool lr = search_traverse(p->left, &l_min, &l_max, nil);
+  const bool lr = search_traverse(t, rb_left(t, p), &l_min, &l_max, nil);
   if (!lr || l_max > p->key) {
     return false;
   }
-  const bool rr = search_traverse(p->right, &r_min, &r_max, nil);
+  const bool rr = search_traverse(t, rb_right(t, p), &r_min, &r_max, nil);
   if (!rr || r_min < p->key) {
     return false;
   }
@@ -214,7 +225,7 @@ void test_search_constraint(const rbtree *t) {
 #else
   node_t *nil = NULL;
 #endif
-  assert(search_traverse(p, &min, &max, nil));
+  assert(search_traverse(t, p, &min, &max, nil));
 }
 
 // Color constraint
@@ -232,8 +243,9 @@ static void init_color_traverse(void) {
   max_black_depth = 0;
 }
 
-static bool color_traverse(const node_t *p, const color_t parent_color,
-                           const int black_depth, node_t *nil) {
+static bool color_traverse(const rbtree *t, const node_t *p,
+                           const color_t parent_color, const int black_depth,
+                           node_t *nil) {
   if (p == nil) {
     if (!touch_nil) {
       touch_nil = true;
@@ -243,12 +255,13 @@ static bool color_traverse(const node_t *p, const color_t parent_color,
     }
     return true;
   }
-  if (parent_color == RBTREE_RED && p->color == RBTREE_RED) {
+  const color_t color = rb_color(t, p);
+  if (parent_color == RBTREE_RED && color == RBTREE_RED) {
     return false;
   }
-  int next_depth = ((p->color == RBTREE_BLACK) ? 1 : 0) + black_depth;
-  return color_traverse(p->left, p->color, next_depth, nil) &&
-         color_traverse(p->right, p->color, next_depth, nil);
+  int next_depth = ((color == RBTREE_BLACK) ? 1 : 0) + black_depth;
+  return color_traverse(t, rb_left(t, p), color, next_depth, nil) &&
+         color_traverse(t, rb_right(t, p), color, next_depth, nil);
 }
 
 void test_color_constraint(const rbtree *t) {
@@ -259,10 +272,34 @@ void test_color_constraint(const rbtree *t) {
   node_t *nil = NULL;
 #endif
   node_t *p = t->root;
-  assert(p == nil || p->color == RBTREE_BLACK);
+  assert(p == nil || rb_color(t, p) == RBTREE_BLACK);
 
   init_color_traverse();
-  assert(color_traverse(p, RBTREE_BLACK, 0, nil));
+  assert(color_traverse(t, p, RBTREE_BLACK, 0, nil));
+}
+
+// Size constraint
+// size of every node should be the number of keys in its subtree
+
+static size_t size_traverse(const rbtree *t, const node_t *p, const node_t *nil,
+                            bool *ok) {
+  if (p == nil) {
+    return 0;
+  }
+  const size_t size = size_traverse(t, rb_left(t, p), nil, ok) +
+                      size_traverse(t, rb_right(t, p), nil, ok) + rb_count(p);
+  if (p->size != size) {
+    *ok = false;
+  }
+  return size;
+}
+
+void test_size_constraint(const rbtree *t) {
+  assert(t != NULL);
+  bool ok = true;
+  size_traverse(t, t->root, t->nil, &ok);
+  assert(ok);
+  assert(t->nil->size == 0);
 }
 
 // rbtree should keep search tree and color constraints
@@ -275,6 +312,7 @@ void test_rb_constraints(const key_t arr[], const size_t n) {
 
   test_color_constraint(t);
   test_search_constraint(t);
+  test_size_constraint(t);
 
   delete_rbtree(t);
 }
@@ -310,6 +348,1596 @@ void test_to_array_suite() {
   delete_rbtree(t);
 }
 
+// erase된 node는 pool로 돌아가 다음 insert에서 재사용되어야 한다
+void test_node_pool(void) {
+  rbtree *t = new_rbtree_with_capacity(4);
+  assert(t != NULL);
+
+  const key_t entries[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12};
+  const size_t n = sizeof(entries) / sizeof(entries[0]);
+  insert_arr(t, entries, n);
+
+  node_t *p = rbtree_find(t, 34);
+  assert(p != NULL);
+  rbtree_erase(t, p);
+  rbtree_insert(t, 35);
+  assert(rbtree_find(t, 35) == p);
+
+  test_color_constraint(t);
+  test_search_constraint(t);
+  delete_rbtree(t);
+}
+
+// rank/select should agree with the sorted array, also after erases
+void test_order_statistics(void) {
+  const size_t n = 1000;
+  key_t *arr = calloc(n, sizeof(key_t));
+  rbtree *t = new_rbtree();
+  srand(7);
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % 500;
+  }
+  insert_arr(t, arr, n);
+  for (size_t i = 0; i < n; i += 2) {
+    rbtree_erase(t, rbtree_find(t, arr[i]));
+  }
+  size_t m = 0;
+  for (size_t i = 1; i < n; i += 2) {
+    arr[m++] = arr[i];
+  }
+  qsort((void *)arr, m, sizeof(key_t), comp);
+
+  test_color_constraint(t);
+  test_search_constraint(t);
+  test_size_constraint(t);
+  assert(rbtree_size(t) == m);
+
+  for (size_t i = 0; i < m; i++) {
+    node_t *p = rbtree_select(t, i);
+    assert(p != NULL && p->key == arr[i]);
+    size_t lower = i;
+    while (lower > 0 && arr[lower - 1] == arr[i]) {
+      lower--;
+    }
+    assert(rbtree_rank(t, arr[i]) == lower);
+  }
+  assert(rbtree_select(t, m) == NULL);
+  assert(rbtree_rank(t, -1) == 0);
+  assert(rbtree_rank(t, 500) == m);
+
+  // to_array should stop at n elements
+  key_t res[11];
+  res[10] = -1;
+  rbtree_to_array(t, res, 10);
+  for (int i = 0; i < 10; i++) {
+    assert(res[i] == arr[i]);
+  }
+  assert(res[10] == -1);
+
+  free(arr);
+  delete_rbtree(t);
+}
+
+// bounds and range queries should match a scan over the sorted array
+void test_range_query(void) {
+  key_t entries[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12, 24, 36, 990, 25};
+  const size_t n = sizeof(entries) / sizeof(entries[0]);
+  rbtree *t = new_rbtree();
+  insert_arr(t, entries, n);
+  qsort((void *)entries, n, sizeof(key_t), comp);
+
+  for (key_t key = 0; key <= 1000; key++) {
+    size_t lo = 0;
+    while (lo < n && entries[lo] < key) {
+      lo++;
+    }
+    size_t hi = lo;
+    while (hi < n && entries[hi] <= key) {
+      hi++;
+    }
+    node_t *p = rbtree_lower_bound(t, key);
+    assert(lo == n ? p == NULL : (p != NULL && p->key == entries[lo]));
+    node_t *q = rbtree_upper_bound(t, key);
+    assert(hi == n ? q == NULL : (q != NULL && q->key == entries[hi]));
+  }
+
+  assert(rbtree_range_count(t, 8, 25) == 7);
+  assert(rbtree_range_count(t, 24, 24) == 2);
+  assert(rbtree_range_count(t, 991, 2000) == 0);
+  assert(rbtree_range_count(t, 25, 8) == 0);
+
+  key_t res[4];
+  assert(rbtree_range_to_array(t, 8, 25, res, 4) == 4);
+  assert(res[0] == 8 && res[1] == 10 && res[2] == 12 && res[3] == 23);
+  assert(rbtree_range_to_array(t, 36, 2000, res, 4) == 4);
+  assert(res[0] == 36 && res[3] == 990);
+  assert(rbtree_range_to_array(t, 991, 2000, res, 4) == 0);
+
+  delete_rbtree(t);
+}
+
+// iterating forward and backward should visit keys in sorted order
+void test_iterator(void) {
+  rbtree *t = new_rbtree();
+  assert(rbtree_first(t) == NULL);
+  assert(rbtree_last(t) == NULL);
+
+  key_t entries[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12, 24, 36, 990, 25};
+  const size_t n = sizeof(entries) / sizeof(entries[0]);
+  insert_arr(t, entries, n);
+  qsort((void *)entries, n, sizeof(key_t), comp);
+
+  size_t i = 0;
+  // RBTREE_COUNTED에서는 같은 key를 가진 node 하나가 count번 나온 것으로 센다
+  for (node_t *p = rbtree_first(t); p != NULL; p = rbtree_next(t, p)) {
+    for (rb_size_t c = 0; c < rb_count(p); c++) {
+      assert(p->key == entries[i++]);
+    }
+  }
+  assert(i == n);
+  for (node_t *p = rbtree_last(t); p != NULL; p = rbtree_prev(t, p)) {
+    for (rb_size_t c = 0; c < rb_count(p); c++) {
+      assert(p->key == entries[--i]);
+    }
+  }
+  assert(i == 0);
+
+  delete_rbtree(t);
+}
+
+// a tree built from sorted keys should be a valid rbtree that keeps working after updates
+void test_build_sorted(void) {
+  key_t keys[100];
+  for (size_t n = 0; n <= 100; n++) {
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = (key_t)(i / 2);
+    }
+    rbtree *t = rbtree_build_sorted(keys, n);
+    assert(t != NULL);
+    assert(rbtree_size(t) == n);
+    test_color_constraint(t);
+    test_search_constraint(t);
+    test_size_constraint(t);
+
+    key_t res[100];
+    rbtree_to_array(t, res, n);
+    for (size_t i = 0; i < n; i++) {
+      assert(res[i] == keys[i]);
+    }
+
+    rbtree_insert(t, 17);
+    if (n > 0) {
+      rbtree_erase(t, rbtree_min(t));
+    }
+    test_color_constraint(t);
+    test_size_constraint(t);
+    delete_rbtree(t);
+  }
+}
+
+static void check_contents(const rbtree *t, key_t *expected, const size_t n) {
+  qsort((void *)expected, n, sizeof(key_t), comp);
+  assert(rbtree_size(t) == n);
+  key_t *res = calloc(n + 1, sizeof(key_t));
+  rbtree_to_array(t, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(res[i] == expected[i]);
+  }
+  free(res);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  test_size_constraint(t);
+}
+
+// batch insert/erase should behave like inserting/erasing every key, for small and large batches
+void test_batch(void) {
+  const size_t n = 2000;
+  key_t *expected = calloc(3 * n, sizeof(key_t));
+  key_t *batch = calloc(3 * n, sizeof(key_t));
+  size_t m = 0;
+  rbtree *t = new_rbtree();
+  srand(11);
+
+  // large batch on an empty tree: rebuild path
+  for (size_t i = 0; i < n; i++) {
+    batch[i] = expected[m++] = rand() % 1000;
+  }
+  rbtree_insert_batch(t, batch, n);
+  check_contents(t, expected, m);
+
+  node_t *kept = rbtree_find(t, expected[0]);
+  // small batches: finger path
+  for (int round = 0; round < 10; round++) {
+    for (size_t i = 0; i < 50; i++) {
+      batch[i] = expected[m++] = rand() % 1200;
+    }
+    rbtree_insert_batch(t, batch, 50);
+    check_contents(t, expected, m);
+  }
+  // large batch on a non-empty tree keeps existing nodes
+  for (size_t i = 0; i < n; i++) {
+    batch[i] = expected[m++] = rand() % 1000 + 500;
+  }
+  rbtree_insert_batch(t, batch, n);
+  check_contents(t, expected, m);
+  node_t *p = rbtree_first(t);
+  while (p != NULL && p != kept) {
+    p = rbtree_next(t, p);
+  }
+  assert(p == kept);
+
+  // small erase batch, including keys that are not in the tree
+  for (size_t i = 0; i < 40; i++) {
+    batch[i] = expected[i * 7];
+  }
+  batch[40] = -5;
+  batch[41] = 5000;
+  assert(rbtree_erase_batch(t, batch, 42) == 40);
+  size_t w = 0;
+  for (size_t i = 0; i < m; i++) {
+    if (i % 7 != 0 || i >= 40 * 7) {
+      expected[w++] = expected[i];
+    }
+  }
+  m = w;
+  check_contents(t, expected, m);
+
+  // large erase batch: rebuild path
+  for (size_t i = 0; i < m / 2; i++) {
+    batch[i] = expected[2 * i];
+  }
+  assert(rbtree_erase_batch(t, batch, m / 2) == m / 2);
+  w = 0;
+  for (size_t i = 1; i < m; i += 2) {
+    expected[w++] = expected[i];
+  }
+  m = w;
+  check_contents(t, expected, m);
+
+  memcpy(batch, expected, m * sizeof(key_t));
+  assert(rbtree_erase_batch(t, batch, m) == m);
+  assert(t->root == t->nil);
+
+  free(batch);
+  free(expected);
+  delete_rbtree(t);
+}
+
+// insert should return the new node, and any hint should give the same tree contents
+void test_insert_hint(void) {
+  const size_t n = 1000;
+  key_t *expected = calloc(n, sizeof(key_t));
+  rbtree *t = new_rbtree();
+  srand(13);
+
+  node_t *hint = NULL;
+  for (size_t i = 0; i < n; i++) {
+    // mostly increasing keys with some jitter, hinted from a random earlier node
+    expected[i] = (key_t)i + rand() % 16 - 8;
+    node_t *p = (i % 3 == 0) ? rbtree_insert(t, expected[i]) : rbtree_insert_hint(t, hint, expected[i]);
+    assert(p != NULL && p->key == expected[i]);
+    if (rand() % 4 == 0) {
+      hint = p;
+    }
+  }
+  check_contents(t, expected, n);
+
+  // erasing the last inserted node should not leave a dangling finger
+  node_t *p = rbtree_insert(t, 500);
+  rbtree_erase(t, p);
+  rbtree_insert(t, 501);
+  expected = realloc(expected, (n + 1) * sizeof(key_t));
+  expected[n] = 501;
+  check_contents(t, expected, n + 1);
+
+  free(expected);
+  delete_rbtree(t);
+}
+
+typedef struct {
+  uint32_t tenant;
+  uint64_t ts;
+} tenant_ts_t;
+
+RBTREE_DEFINE(u64tree, uint64_t, (a > b) - (a < b))
+RBTREE_DEFINE(tstree, tenant_ts_t,
+              a.tenant != b.tenant ? (a.tenant > b.tenant) - (a.tenant < b.tenant)
+                                   : (a.ts > b.ts) - (a.ts < b.ts))
+
+// trees generated by RBTREE_DEFINE should keep order and rb constraints for their key type
+// 끝 node 캐시는 insert/erase/batch/rebuild를 거쳐도 실제 최솟값·최댓값과 같아야 한다
+void check_extremes(const rbtree *t, const key_t *sorted, const size_t n) {
+  if (n == 0) {
+    assert(rbtree_min(t) == NULL && rbtree_max(t) == NULL);
+    return;
+  }
+  assert(rbtree_min(t) == rbtree_select(t, 0) && rbtree_min(t)->key == sorted[0]);
+  assert(rbtree_max(t) == rbtree_select(t, n - 1) && rbtree_max(t)->key == sorted[n - 1]);
+}
+
+void test_pop_minmax(void) {
+  rbtree *t = new_rbtree();
+  key_t key;
+  assert(rbtree_pop_min(t, &key) == 0 && rbtree_pop_max(t, &key) == 0);
+
+  const size_t n = 2000;
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = (key_t)((i * 7919) % 1000);  // 모든 key가 두 번씩
+    rbtree_insert(t, arr[i]);
+  }
+  qsort(arr, n, sizeof(key_t), comp);
+  check_extremes(t, arr, n);
+
+  // 양쪽에서 번갈아 꺼내고, 중간중간 끝 node를 rbtree_erase로도 지운다
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    if ((hi - lo) % 3 == 0) {
+      assert(rbtree_pop_min(t, &key) == 1 && key == arr[lo++]);
+    }
+    else if ((hi - lo) % 3 == 1) {
+      assert(rbtree_pop_max(t, &key) == 1 && key == arr[--hi]);
+    }
+    else {
+      rbtree_erase(t, rbtree_max(t));
+      hi--;
+    }
+    check_extremes(t, arr + lo, hi - lo);
+  }
+  assert(rbtree_pop_min(t, &key) == 0);
+
+  // batch rebuild와 hint insert 뒤에도 맞는다
+  const key_t batch[] = {50, 10, 90, 30, 70};
+  const key_t batch_sorted[] = {10, 30, 50, 70, 90};
+  rbtree_insert_batch(t, batch, 5);
+  check_extremes(t, batch_sorted, 5);
+  rbtree_insert(t, 5);
+  rbtree_insert(t, 95);
+  assert(rbtree_min(t)->key == 5 && rbtree_max(t)->key == 95);
+  const key_t gone[] = {5, 95, 10, 30, 50, 70, 90};
+  assert(rbtree_erase_batch(t, gone, 7) == 7);
+  check_extremes(t, NULL, 0);
+  delete_rbtree(t);
+
+  t = rbtree_build_sorted(batch_sorted, 5);
+  check_extremes(t, batch_sorted, 5);
+  assert(rbtree_pop_max(t, &key) == 1 && key == 90);
+  check_extremes(t, batch_sorted, 4);
+  free(arr);
+  delete_rbtree(t);
+}
+
+// to_array는 parent link를 따라 순회하므로 parent link까지 함께 확인된다
+void check_set_result(const rbtree *t, const key_t *expected, const size_t n) {
+  test_color_constraint(t);
+  test_search_constraint(t);
+  test_size_constraint(t);
+  assert(rbtree_size(t) == n);
+  key_t *res = calloc(n + 1, sizeof(key_t));
+  rbtree_to_array(t, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(res[i] == expected[i]);
+  }
+  assert(n == 0 || (rbtree_min(t)->key == expected[0] && rbtree_max(t)->key == expected[n - 1]));
+  free(res);
+}
+
+// key마다 rbtree_count가 expected의 개수와 같고, RBTREE_COUNTED에서는 같은 key의 node가 하나뿐이어야 한다
+static void check_counts(const rbtree *t, key_t *expected, const size_t n) {
+  check_contents(t, expected, n);
+  for (size_t i = 0; i < n;) {
+    size_t j = i;
+    while (j < n && expected[j] == expected[i]) {
+      j++;
+    }
+    assert(rbtree_count(t, expected[i]) == j - i);
+    assert(rbtree_rank(t, expected[i]) == i);
+    assert(rbtree_select(t, i)->key == expected[i] && rbtree_select(t, j - 1)->key == expected[i]);
+    i = j;
+  }
+#ifdef RBTREE_COUNTED
+  for (node_t *p = rbtree_first(t); p != NULL && rbtree_next(t, p) != NULL; p = rbtree_next(t, p)) {
+    assert(p->key < rbtree_next(t, p)->key);
+  }
+#endif
+}
+
+// 같은 key가 많이 들어가고 빠져도 개수와 순서가 맞아야 한다. RBTREE_COUNTED에서는 같은 key가 node 하나를 같이 쓴다.
+void test_count(void) {
+  const size_t n = 3000;
+  key_t *expected = calloc(2 * n, sizeof(key_t));
+  key_t *batch = calloc(n, sizeof(key_t));
+  rbtree *t = new_rbtree();
+  assert(rbtree_count(t, 1) == 0);
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = (key_t)((i * 7) % 50);
+    node_t *p = rbtree_insert(t, expected[i]);
+    assert(p->key == expected[i]);
+#ifdef RBTREE_COUNTED
+    assert(p == rbtree_find(t, expected[i]));
+#endif
+  }
+  check_counts(t, expected, n);
+  assert(rbtree_count(t, 50) == 0 && rbtree_count(t, -1) == 0);
+
+  // 직전에 넣은 node(6)의 subtree 밖, 바로 앞 조상에 같은 key(5)가 있는 경우
+  rbtree *small = new_rbtree();
+  key_t small_keys[] = {5, 6, 5, 6, 7, 5};
+  for (size_t i = 0; i < 6; i++) {
+    rbtree_insert(small, small_keys[i]);
+  }
+  check_counts(small, small_keys, 6);
+  delete_rbtree(small);
+
+  // 하나씩 지우면 개수가 하나씩 줄고, 마지막 하나를 지워야 key가 사라진다
+  for (size_t i = 0; i < n / 60; i++) {
+    rbtree_erase(t, rbtree_find(t, 7));
+  }
+  assert(rbtree_count(t, 7) == 10);
+  while (rbtree_find(t, 7) != NULL) {
+    rbtree_erase(t, rbtree_find(t, 7));
+  }
+  assert(rbtree_count(t, 7) == 0);
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (expected[i] != 7) {
+      expected[m++] = expected[i];
+    }
+  }
+  check_counts(t, expected, m);
+
+  // batch도 같은 key를 모으고 개수만큼만 지운다 (작은 batch와 tree를 다시 짓는 큰 batch 모두)
+  for (size_t size = 10; size <= n; size *= 10) {
+    for (size_t i = 0; i < size; i++) {
+      batch[i] = (key_t)((i * 3) % 60);
+      expected[m++] = batch[i];
+    }
+    rbtree_insert_batch(t, batch, size);
+    check_counts(t, expected, m);
+    for (size_t i = 0; i < size; i++) {
+      batch[i] = (key_t)(i % 40);
+    }
+    size_t erased = rbtree_erase_batch(t, batch, size);
+    qsort((void *)batch, size, sizeof(key_t), comp);
+    size_t kept = 0, j = 0;
+    for (size_t i = 0; i < m; i++) {
+      while (j < size && batch[j] < expected[i]) {
+        j++;
+      }
+      if (j < size && batch[j] == expected[i]) {
+        j++;
+      }
+      else {
+        expected[kept++] = expected[i];
+      }
+    }
+    assert(erased == m - kept);
+    m = kept;
+    check_counts(t, expected, m);
+  }
+
+  // pop은 key 하나씩 꺼낸다
+  key_t key;
+  const size_t min_count = rbtree_count(t, expected[0]);
+  assert(rbtree_pop_min(t, &key) && key == expected[0]);
+  assert(rbtree_count(t, key) == min_count - 1);
+  assert(rbtree_pop_max(t, &key) && key == expected[m - 1]);
+  memmove(expected, expected + 1, (m - 2) * sizeof(key_t));
+  m -= 2;
+  check_counts(t, expected, m);
+
+  // export와 freeze는 같은 key를 개수만큼 펼친다
+  key_t *res = calloc(m, sizeof(key_t));
+  rbtree_to_array_parallel(t, res, m, 4);
+  assert(memcmp(res, expected, m * sizeof(key_t)) == 0);
+  rbtree_frozen *f = rbtree_freeze(t);
+  assert(rbtree_frozen_size(f) == m && rbtree_frozen_range_count(f, 20, 20) == rbtree_count(t, 20));
+  rbtree *thawed = rbtree_thaw(f);
+  check_counts(thawed, expected, m);
+  delete_rbtree(thawed);
+  delete_rbtree_frozen(f);
+
+  // 가운데 key와 같은 key가 양쪽 끝에 있어도 join한 뒤의 개수가 맞아야 한다
+  rbtree *lt, *gt;
+  const size_t split_count = rbtree_count(t, 30);
+  assert(split_count > 0 && rbtree_split(t, 30, &lt, &gt) == split_count);
+  assert(rbtree_count(lt, 30) == 0 && rbtree_count(gt, 30) == 0);
+  rbtree_insert(lt, 30);
+  rbtree_insert(lt, 30);
+  rbtree_insert(gt, 30);
+  rbtree_join(lt, 30, gt);
+  assert(rbtree_count(lt, 30) == 4 && rbtree_size(gt) == 0);
+  test_color_constraint(lt);
+  test_size_constraint(lt);
+
+  // union은 같은 key의 개수를 더한다
+  rbtree *other = new_rbtree();
+  for (key_t k = 0; k < 100; k++) {
+    rbtree_insert(other, k % 40);
+  }
+  const size_t before = rbtree_count(lt, 10);
+  rbtree_union(lt, other, 2);
+  assert(rbtree_count(lt, 10) == before + 3 && rbtree_count(lt, 99) == 0 && rbtree_size(other) == 0);
+  test_color_constraint(lt);
+  test_size_constraint(lt);
+
+  free(res);
+  free(batch);
+  free(expected);
+  delete_rbtree(t);
+  delete_rbtree(lt);
+  delete_rbtree(gt);
+  delete_rbtree(other);
+}
+
+// key로 지우기와 구간 지우기는 같은 key를 하나씩 지운 것과 같아야 한다
+void test_erase_range(void) {
+  const size_t n = 5000;
+  key_t *expected = calloc(n, sizeof(key_t));
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = (key_t)((i * 7919) % 2000);  // 대부분 두세 번씩
+    rbtree_insert(t, expected[i]);
+  }
+  qsort((void *)expected, n, sizeof(key_t), comp);
+  size_t m = n;
+
+  assert(rbtree_erase_key(t, -1) == 0 && rbtree_erase_key(t, 2000) == 0);
+  const size_t count = rbtree_count(t, 100);
+  assert(rbtree_erase_key(t, 100) == 1 && rbtree_count(t, 100) == count - 1);
+  for (size_t i = 0; i < m; i++) {
+    if (expected[i] == 100) {
+      memmove(expected + i, expected + i + 1, (m - i - 1) * sizeof(key_t));
+      m--;
+      break;
+    }
+  }
+  check_extremes(t, expected, m);
+
+  // 빈 구간, 뒤집힌 구간, 가운데, 양 끝, 남은 전체 순서로 지운다
+  const key_t ranges[][2] = {{5000, 6000}, {30, 20}, {500, 999}, {-100, 10}, {1990, 5000}, {700, 1200}, {-1, 2000}};
+  for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    const key_t lo = ranges[r][0], hi = ranges[r][1];
+    size_t kept = 0;
+    for (size_t i = 0; i < m; i++) {
+      if (expected[i] < lo || expected[i] > hi) {
+        expected[kept++] = expected[i];
+      }
+    }
+    assert(rbtree_range_count(t, lo, hi) == m - kept);
+    assert(rbtree_erase_range(t, lo, hi) == m - kept);
+    m = kept;
+    check_extremes(t, expected, m);
+    test_color_constraint(t);
+    test_search_constraint(t);
+    test_size_constraint(t);
+  }
+  assert(rbtree_size(t) == 0 && rbtree_erase_range(t, 0, 10) == 0);
+
+  // 돌려준 node를 다시 쓴다
+  for (key_t key = 0; key < 100; key++) {
+    rbtree_insert(t, key);
+  }
+  assert(rbtree_erase_range(t, 10, 19) == 10 && rbtree_erase_key(t, 50) == 1);
+  assert(rbtree_size(t) == 89 && rbtree_find(t, 15) == NULL && rbtree_find(t, 50) == NULL);
+  assert(rbtree_min(t)->key == 0 && rbtree_max(t)->key == 99);
+  test_color_constraint(t);
+  test_size_constraint(t);
+
+  free(expected);
+  delete_rbtree(t);
+}
+
+rbtree *build_range(const key_t from, const size_t n, const key_t step) {
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, from + (key_t)i * step);
+  }
+  return t;
+}
+
+// key마다 rbtree_find가 그 key를 가진, tree에 매달린 node를 주는지 본다. 없는 key는 NULL
+static void check_find_all(const rbtree *t, const key_t lo, const key_t hi) {
+  for (key_t key = lo; key <= hi; key++) {
+    node_t *p = rbtree_find(t, key);
+    assert((p != NULL) == (rbtree_range_count(t, key, key) > 0));
+    assert(rbtree_count(t, key) == rbtree_range_count(t, key, key));
+    if (p == NULL) {
+      continue;
+    }
+    assert(p->key == key);
+    node_t *root = p;
+    while (rb_parent(t, root) != t->nil) {
+      root = rb_parent(t, root);
+    }
+    assert(root == t->root);
+  }
+}
+
+// 같은 key가 섞인 채로 넣고 지우는 모든 경로를 거친 뒤에도 find는 tree와 같은 답을 내야 한다 (hash index가 있으면 그 index로)
+void test_hash_index(void) {
+  rbtree *t = new_rbtree();
+  for (key_t i = 0; i < 20000; i++) {
+    rbtree_insert(t, (i * 7) % 6000);  // key마다 서너 개
+#ifdef RBTREE_HASH_INDEX
+    // 키우는 동안 이전 table은 한 번에 옮기지 않는다
+    assert(t->hash.old_slots == NULL || t->hash.migrated < t->hash.old_capacity);
+    assert(t->hash.used * 4 <= t->hash.capacity * 3);
+#endif
+  }
+#ifdef RBTREE_HASH_INDEX
+  assert(t->hash.live == 6000);
+#endif
+  check_find_all(t, -5, 6005);
+
+  // 대표 node가 지워져도 남은 node를 찾는다
+  for (int round = 0; round < 3; round++) {
+    for (key_t key = 0; key < 6000; key += 3) {
+      rbtree_erase(t, rbtree_find(t, key));
+    }
+    check_find_all(t, 0, 10);
+  }
+  check_find_all(t, -5, 6005);
+
+  // batch와 구간 지우기, pop은 node를 한꺼번에 pool로 돌려준다
+  key_t batch[4000];
+  for (size_t i = 0; i < 4000; i++) {
+    batch[i] = (key_t)(i % 2000);
+  }
+  rbtree_erase_batch(t, batch, 4000);
+  rbtree_erase_range(t, 2500, 3500);
+  key_t key;
+  rbtree_pop_min(t, &key);
+  rbtree_pop_max(t, &key);
+  assert(rbtree_erase_key(t, 4000) == 1);
+  check_find_all(t, -5, 6005);
+  rbtree_insert_batch(t, batch, 4000);
+  check_find_all(t, -5, 6005);
+
+  // split/join/union은 node를 다른 tree로 복사하고 원래 node를 버린다
+  rbtree *lt, *gt;
+  rbtree_split(t, 3000, &lt, &gt);
+  check_find_all(lt, -5, 6005);
+  check_find_all(gt, -5, 6005);
+  rbtree_join(lt, 3000, gt);
+  check_find_all(lt, -5, 6005);
+  rbtree *other = build_range(5990, 30, 1);
+  rbtree_union(lt, other, 2);
+  check_find_all(lt, -5, 6025);
+  rbtree_difference(lt, t, 1);
+  check_find_all(lt, -5, 6025);
+
+  delete_rbtree(t);
+  delete_rbtree(lt);
+  delete_rbtree(gt);
+  delete_rbtree(other);
+
+  // table을 키우는 도중에 지운 key는 옮기기가 끝나기 전에도, 같은 key를 다시 넣은 뒤에도 되살아나면 안 된다
+  rbtree *m = new_rbtree();
+  key_t next = 0;
+#ifdef RBTREE_HASH_INDEX
+  while (m->hash.old_slots == NULL) {
+    rbtree_insert(m, next++);
+  }
+#else
+  for (; next < 100; next++) {
+    rbtree_insert(m, next);
+  }
+#endif
+  for (int round = 0; rbtree_size(m) > 0; round++) {
+    if (round % 2 == 0) {
+      rbtree_pop_min(m, &key);
+    }
+    else {
+      rbtree_pop_max(m, &key);
+    }
+    assert(rbtree_find(m, key) == NULL && rbtree_count(m, key) == 0);
+    if (round % 3 == 0) {
+      rbtree_insert(m, key);
+      assert(rbtree_find(m, key) != NULL && rbtree_count(m, key) == 1);
+      assert(rbtree_erase_key(m, key) == 1 && rbtree_erase_key(m, key) == 0);
+      assert(rbtree_find(m, key) == NULL && rbtree_count(m, key) == 0);
+    }
+    if (round < 64) {
+      rbtree_insert(m, next++);
+    }
+  }
+  delete_rbtree(m);
+}
+
+void test_join_split(void) {
+  key_t *expected = calloc(6000, sizeof(key_t));
+  for (key_t i = 0; i < 6000; i++) {
+    expected[i] = i;
+  }
+  // 큰 쪽이 왼쪽인 경우와 오른쪽인 경우
+  rbtree *t1 = build_range(0, 1000, 1), *t2 = build_range(1001, 100, 1);
+  rbtree_join(t1, 1000, t2);
+  check_set_result(t1, expected, 1101);
+  check_set_result(t2, NULL, 0);
+  delete_rbtree(t2);
+  t2 = build_range(1102, 4898, 1);
+  rbtree_join(t1, 1101, t2);
+  check_set_result(t1, expected, 6000);
+  check_set_result(t2, NULL, 0);
+  rbtree_insert(t2, 7);  // 비운 tree도 그대로 쓸 수 있다
+  check_set_result(t2, expected + 7, 1);
+  delete_rbtree(t2);
+  t2 = new_rbtree();
+  rbtree *empty = new_rbtree();
+  rbtree_join(t2, 0, empty);
+  check_set_result(t2, expected, 1);
+  delete_rbtree(empty);
+  delete_rbtree(t2);
+
+  // 같은 key는 모두 지워지고 그 개수를 반환한다
+  rbtree_insert(t1, 1500);
+  rbtree_insert(t1, 1500);
+  rbtree *lt, *gt;
+  assert(rbtree_split(t1, 1500, &lt, &gt) == 3);
+  check_set_result(lt, expected, 1500);
+  check_set_result(gt, expected + 1501, 6000 - 1501);
+  check_set_result(t1, NULL, 0);
+  delete_rbtree(t1);
+
+  // 양 끝 밖의 key로 나누면 한쪽이 빈다
+  assert(rbtree_split(gt, -1, &t1, &t2) == 0);
+  check_set_result(t1, NULL, 0);
+  check_set_result(t2, expected + 1501, 6000 - 1501);
+  rbtree_join(lt, 1500, t2);
+  check_set_result(lt, expected, 6000);
+  delete_rbtree(t1);
+  delete_rbtree(t2);
+  delete_rbtree(gt);
+  delete_rbtree(lt);
+  free(expected);
+}
+
+// 짝수 key tree와 3의 배수 key tree의 합, 교집합, 차집합. 크기를 thread를 나누는 기준보다 크게 잡는다.
+void test_set_operations(void) {
+  const size_t n = 150000, m = 100000;
+  key_t *evens = calloc(n, sizeof(key_t)), *triples = calloc(m, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    evens[i] = (key_t)(2 * i);
+  }
+  for (size_t i = 0; i < m; i++) {
+    triples[i] = (key_t)(3 * i);
+  }
+  key_t *merged = calloc(n + m, sizeof(key_t)), *common = calloc(m, sizeof(key_t)), *only = calloc(n, sizeof(key_t));
+  size_t merged_n = 0, common_n = 0, only_n = 0;
+  for (size_t i = 0, j = 0; i < n || j < m;) {
+    if (j == m || (i < n && evens[i] <= triples[j])) {
+      merged[merged_n++] = evens[i++];
+    }
+    else {
+      merged[merged_n++] = triples[j++];
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (evens[i] % 3 == 0 && evens[i] < (key_t)(3 * m)) {
+      common[common_n++] = evens[i];
+    }
+    else {
+      only[only_n++] = evens[i];
+    }
+  }
+
+  for (int threads = 1; threads <= 4; threads += 3) {
+    rbtree *a = rbtree_build_sorted(evens, n), *b = rbtree_build_sorted(triples, m);
+    rbtree_intersect(a, b, threads);
+    check_set_result(a, common, common_n);
+    check_set_result(b, triples, m);
+    delete_rbtree(a);
+
+    a = rbtree_build_sorted(evens, n);
+    rbtree_difference(a, b, threads);
+    check_set_result(a, only, only_n);
+    delete_rbtree(a);
+
+    // b가 더 작으므로 b의 node가 a의 pool로 복사된다. 반대 방향도 확인한다.
+    a = rbtree_build_sorted(evens, n);
+    rbtree_union(a, b, threads);
+    check_set_result(a, merged, merged_n);
+    check_set_result(b, NULL, 0);
+    rbtree_union(b, a, threads);
+    check_set_result(b, merged, merged_n);
+    check_set_result(a, NULL, 0);
+    delete_rbtree(a);
+    delete_rbtree(b);
+  }
+  free(evens);
+  free(triples);
+  free(merged);
+  free(common);
+  free(only);
+}
+
+// 몇 개의 thread로 나누든, n이 tree보다 작든 rbtree_to_array와 같아야 한다
+void test_to_array_parallel(void) {
+  rbtree *t = new_rbtree();
+  key_t out[1] = {42};
+  rbtree_to_array_parallel(t, out, 1, 4);
+  assert(out[0] == 42);
+
+  const size_t n = 300000;
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (key_t)((i * 7919) % (n / 2)));  // 모든 key가 두 번씩
+  }
+  key_t *expected = calloc(n, sizeof(key_t)), *res = calloc(n, sizeof(key_t));
+  rbtree_to_array(t, expected, n);
+  const int thread_counts[] = {1, 2, 3, 8};
+  for (size_t c = 0; c < sizeof(thread_counts) / sizeof(thread_counts[0]); c++) {
+    memset(res, 0, n * sizeof(key_t));
+    rbtree_to_array_parallel(t, res, n, thread_counts[c]);
+    assert(memcmp(res, expected, n * sizeof(key_t)) == 0);
+
+    const size_t part = n / 3 + 1;
+    memset(res, 0, n * sizeof(key_t));
+    rbtree_to_array_parallel(t, res, part, thread_counts[c]);
+    assert(memcmp(res, expected, part * sizeof(key_t)) == 0);
+    assert(res[part] == 0 && res[n - 1] == 0);
+  }
+  free(expected);
+  free(res);
+  delete_rbtree(t);
+}
+
+// batch로 찾은 결과는 key마다 rbtree_find를 부른 결과와 같아야 한다
+void test_find_batch(void) {
+  rbtree *t = new_rbtree();
+  node_t *out[1];
+  assert(rbtree_find_batch(t, NULL, 0, out) == 0);
+  key_t missing = 7;
+  assert(rbtree_find_batch(t, &missing, 1, out) == 0 && out[0] == NULL);
+
+  const size_t n = 5000, q = 3 * n + 1;  // group 크기로 나누어떨어지지 않게
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (key_t)(i * 3));
+  }
+  rbtree_insert(t, 42);  // 중복 key
+  key_t *keys = calloc(q, sizeof(key_t));
+  node_t **nodes = calloc(q, sizeof(node_t *));
+  size_t expected = 0;
+  for (size_t i = 0; i < q; i++) {
+    keys[i] = (key_t)((i * 7919) % (3 * n + 10));
+    expected += (rbtree_find(t, keys[i]) != NULL);
+  }
+  assert(rbtree_find_batch(t, keys, q, nodes) == expected);
+  for (size_t i = 0; i < q; i++) {
+    if (keys[i] % 3 == 0 && keys[i] < (key_t)(3 * n)) {
+      assert(nodes[i] != NULL && nodes[i]->key == keys[i]);
+    }
+    else {
+      assert(nodes[i] == NULL);
+    }
+  }
+  free(keys);
+  free(nodes);
+  delete_rbtree(t);
+}
+
+void test_template(void) {
+  rbtree *t = u64tree_new();
+  const size_t n = 500;
+  uint64_t *expected = calloc(n, sizeof(uint64_t));
+  srand(17);
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = ((uint64_t)rand() << 32) | (uint64_t)(rand() % 100);
+    u64tree_node *p = u64tree_insert(t, expected[i]);
+    assert(p->key == expected[i]);
+  }
+  test_color_constraint(t);
+  test_size_constraint(t);
+
+  for (size_t i = 0; i < n; i += 2) {
+    u64tree_node *p = u64tree_find(t, expected[i]);
+    assert(p != NULL && p->key == expected[i]);
+    u64tree_erase(t, p);
+  }
+  test_color_constraint(t);
+  test_size_constraint(t);
+  assert(rbtree_size(t) == n / 2);
+
+  uint64_t *res = calloc(n, sizeof(uint64_t));
+  assert(u64tree_to_array(t, res, n) == n / 2);
+  for (size_t i = 1; i < n / 2; i++) {
+    assert(res[i - 1] <= res[i]);
+  }
+  assert(u64tree_min(t)->key == res[0]);
+  assert(u64tree_max(t)->key == res[n / 2 - 1]);
+  assert(u64tree_lower_bound(t, res[3])->key == res[3]);
+  assert(u64tree_upper_bound(t, res[n / 2 - 1]) == NULL);
+  free(res);
+  free(expected);
+  delete_rbtree(t);
+
+  rbtree *s = tstree_new_with_capacity(8);
+  const tenant_ts_t keys[] = {{2, 5}, {1, 9}, {2, 1}, {1, 3}, {3, 0}};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    tstree_insert(s, keys[i]);
+  }
+  const tenant_ts_t probe = {2, 0};
+  tstree_node *p = tstree_lower_bound(s, probe);
+  assert(p->key.tenant == 2 && p->key.ts == 1);
+  p = tstree_next(s, p);
+  assert(p->key.tenant == 2 && p->key.ts == 5);
+  assert(tstree_find(s, probe) == NULL);
+  delete_rbtree(s);
+}
+
+// 모양 통계는 언제나, 연산 counter는 RBTREE_STATS일 때만 채워진다
+void test_stats(void) {
+  rbtree *t = new_rbtree();
+  rbtree_stats_t stats;
+  rbtree_stats(t, &stats);
+  assert(stats.node_count == 0 && stats.height == 0 && stats.black_height == 0);
+
+  const size_t n = 1000;
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (key_t)i);  // 오름차순이라 회전이 많이 일어난다
+  }
+  rbtree_find(t, 10);
+  rbtree_erase(t, rbtree_find(t, 500));
+  rbtree_stats(t, &stats);
+  assert(stats.node_count == n - 1);
+  size_t sum = 0, deepest = 0;
+  for (size_t d = 0; d < RBTREE_STATS_MAX_DEPTH; d++) {
+    sum += stats.depth_histogram[d];
+    deepest = (stats.depth_histogram[d] > 0) ? d + 1 : deepest;
+  }
+  assert(sum == n - 1 && deepest == stats.height);
+  assert(stats.depth_histogram[0] == 1);
+  assert(stats.height <= 2 * 10 && stats.height >= 10);  // 2 log2(n + 1) 이하
+  assert(stats.black_height >= stats.height / 2 && stats.black_height <= stats.height);
+
+#ifdef RBTREE_STATS
+  assert(stats.counters.inserts == n && stats.counters.finds == 2 && stats.counters.erases == 1);
+  assert(stats.counters.allocations == n);
+  assert(stats.counters.rotations > 0 && stats.counters.recolors > 0);
+  assert(stats.counters.insert_fixup_loops > 0);
+  assert(stats.counters.comparisons >= n);
+  assert(stats.counters.pool_refills > 0);
+  rbtree_stats_reset(t);
+  rbtree_stats(t, &stats);
+  assert(stats.counters.inserts == 0 && stats.counters.rotations == 0);
+#else
+  assert(stats.counters.inserts == 0 && stats.counters.rotations == 0);
+#endif
+  delete_rbtree(t);
+}
+
+// frozen index는 원래 tree와 같은 find/lower_bound/rank 결과를 내야 한다
+void test_frozen(void) {
+  rbtree *t = new_rbtree();
+  rbtree_frozen *f = rbtree_freeze(t);
+  assert(rbtree_frozen_size(f) == 0);
+  assert(rbtree_frozen_find(f, 0) == NULL);
+  assert(rbtree_frozen_lower_bound(f, 0) == NULL);
+  assert(rbtree_frozen_rank(f, 0) == 0);
+  delete_rbtree_frozen(f);
+
+  // 중복 key가 섞이고 마지막 단계가 덜 찬 크기
+  const size_t n = 1000;
+  srand(11);
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (rand() % 700) * 2);
+  }
+  f = rbtree_freeze(t);
+  assert(rbtree_frozen_size(f) == n);
+  for (key_t key = -3; key <= 1402; key++) {
+    const node_t *expected = rbtree_lower_bound(t, key);
+    const key_t *lb = rbtree_frozen_lower_bound(f, key);
+    assert((expected == NULL) == (lb == NULL));
+    assert(lb == NULL || *lb == expected->key);
+    assert(rbtree_frozen_rank(f, key) == rbtree_rank(t, key));
+    const key_t *found = rbtree_frozen_find(f, key);
+    assert((found == NULL) == (rbtree_find(t, key) == NULL));
+    assert(found == NULL || *found == key);
+  }
+
+  // tree를 바꿔도 index는 그대로이다
+  rbtree_erase(t, rbtree_min(t));
+  assert(rbtree_frozen_size(f) == n);
+  delete_rbtree_frozen(f);
+  delete_rbtree(t);
+
+  // rank는 칸 번호에서 구하므로 마지막 단계가 차는 정도마다 확인한다
+  for (size_t m = 1; m <= 70; m++) {
+    rbtree *small = build_range(0, m, 2);
+    f = rbtree_freeze(small);
+    for (key_t key = -1; key <= (key_t)(2 * m); key++) {
+      assert(rbtree_frozen_rank(f, key) == rbtree_rank(small, key));
+      assert(rbtree_frozen_range_count(f, key, key + 3) == rbtree_range_count(small, key, key + 3));
+    }
+    delete_rbtree_frozen(f);
+    delete_rbtree(small);
+  }
+}
+
+// 저장한 파일을 mmap으로 열면 원래 tree와 같은 질의 결과를 내고, thaw하면 같은 tree가 된다.
+// 본문이 깨지면 verify가, header가 깨지거나 잘리면 open이 잡아낸다.
+void test_frozen_file(void) {
+  char path[] = "/tmp/rbtree-test-XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  assert(rbtree_open_mapped(path) == NULL);  // 빈 파일
+
+  rbtree *t = new_rbtree();
+  assert(rbtree_save(t, path) == 0);
+  rbtree_frozen *f = rbtree_open_mapped(path);
+  assert(f != NULL && rbtree_frozen_size(f) == 0 && rbtree_frozen_verify(f));
+  assert(rbtree_frozen_find(f, 1) == NULL && rbtree_frozen_range_count(f, 0, 10) == 0);
+  rbtree *thawed = rbtree_thaw(f);
+  assert(rbtree_size(thawed) == 0);
+  delete_rbtree(thawed);
+  delete_rbtree_frozen(f);
+
+  const size_t n = 10001;  // keys가 8 bytes 경계에서 끝나지 않게
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, (key_t)((i * 7919) % 5000) * 2);  // 짝수 key, 대부분 두 번씩
+  }
+  assert(rbtree_save(t, path) == 0);
+  f = rbtree_open_mapped(path);
+  assert(f != NULL && rbtree_frozen_size(f) == n && rbtree_frozen_verify(f));
+  assert(f->mapping_size <= 4096 + (n + 1) * sizeof(key_t));  // header와 keys뿐이다
+  key_t range[64], expected[64];
+  for (key_t key = -3; key < 10003; key += 7) {
+    assert((rbtree_frozen_find(f, key) != NULL) == (rbtree_find(t, key) != NULL));
+    assert(rbtree_frozen_rank(f, key) == rbtree_rank(t, key));
+    assert(rbtree_frozen_range_count(f, key, key + 100) == rbtree_range_count(t, key, key + 100));
+    const size_t count = rbtree_frozen_range_to_array(f, key, key + 100, range, 64);
+    assert(count == rbtree_range_to_array(t, key, key + 100, expected, 64));
+    assert(count == 0 || memcmp(range, expected, count * sizeof(key_t)) == 0);
+  }
+  thawed = rbtree_thaw(f);
+  key_t *arr = calloc(n, sizeof(key_t)), *res = calloc(n, sizeof(key_t));
+  rbtree_to_array(t, arr, n);
+  rbtree_to_array(thawed, res, n);
+  assert(rbtree_size(thawed) == n && memcmp(arr, res, n * sizeof(key_t)) == 0);
+  test_color_constraint(thawed);
+  test_size_constraint(thawed);
+  rbtree_insert(thawed, 1);  // thaw한 tree는 고칠 수 있다
+  assert(rbtree_find(thawed, 1) != NULL);
+  delete_rbtree(thawed);
+  delete_rbtree_frozen(f);
+
+  // 본문의 한 byte를 바꾸면 open은 되지만 verify가 실패한다
+  FILE *fp = fopen(path, "r+b");
+  fseek(fp, 200, SEEK_SET);
+  const int byte = fgetc(fp);
+  fseek(fp, 200, SEEK_SET);
+  fputc(byte ^ 1, fp);
+  fclose(fp);
+  f = rbtree_open_mapped(path);
+  assert(f != NULL && !rbtree_frozen_verify(f));
+  delete_rbtree_frozen(f);
+
+  // header를 바꾸거나 파일을 자르면 열지 않는다
+  fp = fopen(path, "r+b");
+  fseek(fp, 16, SEEK_SET);
+  fputc(0x7f, fp);
+  fclose(fp);
+  assert(rbtree_open_mapped(path) == NULL);
+  assert(rbtree_save(t, path) == 0);
+  assert(truncate(path, 4096) == 0);
+  assert(rbtree_open_mapped(path) == NULL);
+
+  // n을 곱해서 넘치면 본래 크기가 되는 값으로 바꾸고 header checksum을 다시 매겨도 열지 않는다
+  rbtree *small = build_range(0, 3, 1);
+  assert(rbtree_save(small, path) == 0);
+  delete_rbtree(small);
+  unsigned char header[64];
+  fp = fopen(path, "r+b");
+  assert(fread(header, 1, sizeof(header), fp) == sizeof(header));
+  const uint64_t forged_n = UINT64_MAX / sizeof(key_t) + 4;  // (n + 1) * sizeof(key_t)가 넘쳐 4칸 크기가 된다
+  memcpy(header + 24, &forged_n, sizeof(forged_n));
+  const uint64_t resigned = checksum64(header, 56, RBTREE_CHECKSUM_SEED);
+  memcpy(header + 56, &resigned, sizeof(resigned));
+  fseek(fp, 0, SEEK_SET);
+  fwrite(header, 1, sizeof(header), fp);
+  fclose(fp);
+  assert(rbtree_open_mapped(path) == NULL);
+
+  unlink(path);
+  assert(rbtree_open_mapped(path) == NULL);
+  free(arr);
+  free(res);
+  delete_rbtree(t);
+}
+
+static void check_journal_tree(const rbtree *t, const rbtree *expected) {
+  const size_t n = rbtree_size(expected);
+  assert(rbtree_size(t) == n);
+  key_t *arr = calloc(n + 1, sizeof(key_t)), *res = calloc(n + 1, sizeof(key_t));
+  rbtree_to_array(expected, arr, n);
+  rbtree_to_array(t, res, n);
+  assert(n == 0 || memcmp(arr, res, n * sizeof(key_t)) == 0);
+  test_color_constraint(t);
+  test_size_constraint(t);
+  free(arr);
+  free(res);
+}
+
+// commit한 연산은 다시 열어도 남고, 잘린 batch와 이미 snapshot에 들어간 log는 적용하지 않아야 한다
+void test_journal(void) {
+  char dir[] = "/tmp/rbtree-journal-XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  char snapshot[64], log[64];
+  snprintf(snapshot, sizeof(snapshot), "%s/snapshot", dir);
+  snprintf(log, sizeof(log), "%s/log", dir);
+
+  rbtree *expected = new_rbtree();
+  rbtree_journal *j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL && rbtree_size(j->tree) == 0);
+  for (int i = 0; i < 1000; i++) {
+    const key_t key = (key_t)((i * 37) % 300);  // 중복 key가 섞이게
+    rbtree_journal_insert(j, key);
+    rbtree_insert(expected, key);
+    if (i % 3 == 0) {
+      const key_t victim = (key_t)((i * 13) % 300);
+      node_t *p = rbtree_find(j->tree, victim);
+      if (p != NULL) {
+        rbtree_journal_erase(j, p);
+        rbtree_erase(expected, rbtree_find(expected, victim));
+      }
+    }
+  }
+  assert(rbtree_journal_commit(j) == 0);
+  delete_rbtree_journal(j);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+
+  // checkpoint 뒤에는 snapshot과 그 뒤의 log를 합쳐 되살린다
+  assert(rbtree_journal_checkpoint(j) == 0);
+  for (key_t key = 1000; key < 1100; key++) {
+    rbtree_journal_insert(j, key);
+    rbtree_insert(expected, key);
+  }
+  rbtree_erase(expected, rbtree_find(expected, rbtree_min(j->tree)->key));
+  rbtree_journal_erase(j, rbtree_min(j->tree));
+  delete_rbtree_journal(j);  // 남은 record는 닫을 때 commit한다
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+
+  // 쓰다가 죽은 batch는 버리고, 그 뒤에 쓴 batch는 다시 열어도 읽힌다
+  delete_rbtree_journal(j);
+  FILE *fp = fopen(log, "ab");
+  const unsigned char torn[] = {0x4a, 0x42, 0x54, 0x42, 0x10, 0, 0, 0, 1, 2, 3};
+  fwrite(torn, 1, sizeof(torn), fp);
+  fclose(fp);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+  rbtree_journal_insert(j, 5000);
+  rbtree_insert(expected, 5000);
+  assert(rbtree_journal_commit(j) == 0);
+  delete_rbtree_journal(j);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+
+  // checkpoint가 snapshot을 바꾸고 log를 비우기 전에 죽은 경우: 남은 log를 두 번 적용하지 않는다
+  rbtree_journal_insert(j, 6000);
+  rbtree_insert(expected, 6000);
+  assert(rbtree_journal_commit(j) == 0);
+  fp = fopen(log, "rb");
+  unsigned char stale[1 << 16];
+  const size_t stale_size = fread(stale, 1, sizeof(stale), fp);
+  fclose(fp);
+  assert(stale_size > 0 && stale_size < sizeof(stale));
+  assert(rbtree_journal_checkpoint(j) == 0);
+  delete_rbtree_journal(j);
+  fp = fopen(log, "wb");
+  fwrite(stale, 1, stale_size, fp);
+  fclose(fp);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+
+  // commit이 실패하면 그 뒤의 연산은 tree를 고치지 않고 실패한다. checkpoint가 성공하면 다시 받는다
+  const int saved_fd = dup(j->fd);
+  const int full_fd = open("/dev/full", O_WRONLY);
+  assert(saved_fd >= 0 && full_fd >= 0 && dup2(full_fd, j->fd) == j->fd);
+  close(full_fd);
+  assert(rbtree_journal_insert(j, 7000) != NULL);
+  rbtree_insert(expected, 7000);
+  assert(rbtree_journal_commit(j) == -1 && errno == ENOSPC);
+  const size_t size_before = rbtree_size(j->tree);
+  assert(rbtree_journal_insert(j, 7001) == NULL && errno == ENOSPC);
+  assert(rbtree_journal_erase(j, rbtree_min(j->tree)) == -1);
+  assert(rbtree_size(j->tree) == size_before);
+  assert(dup2(saved_fd, j->fd) == j->fd);
+  close(saved_fd);
+  assert(rbtree_journal_checkpoint(j) == 0);
+  assert(rbtree_journal_insert(j, 7001) != NULL);
+  rbtree_insert(expected, 7001);
+  delete_rbtree_journal(j);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+  delete_rbtree_journal(j);
+
+  // group이 차서 부른 commit이 실패하면 그 연산부터 tree를 고치지 않는다
+  j = rbtree_journal_open(snapshot, log, 4);
+  assert(j != NULL);
+  const int group_fd = dup(j->fd);
+  const int group_full_fd = open("/dev/full", O_WRONLY);
+  assert(group_fd >= 0 && group_full_fd >= 0 && dup2(group_full_fd, j->fd) == j->fd);
+  close(group_full_fd);
+  for (key_t key = 8000; key < 8003; key++) {
+    assert(rbtree_journal_insert(j, key) != NULL);
+    rbtree_insert(expected, key);
+  }
+  const size_t group_before = rbtree_size(j->tree);
+  assert(rbtree_journal_insert(j, 8003) == NULL && errno == ENOSPC);
+  assert(rbtree_size(j->tree) == group_before && rbtree_find(j->tree, 8003) == NULL);
+  assert(dup2(group_fd, j->fd) == j->fd);
+  close(group_fd);
+  assert(rbtree_journal_checkpoint(j) == 0);
+  delete_rbtree_journal(j);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+  delete_rbtree_journal(j);
+
+  // log header가 깨졌으면 log를 비우지 않고 열지 않는다
+  fp = fopen(log, "r+b");
+  const int magic = fgetc(fp);
+  fseek(fp, 0, SEEK_SET);
+  fputc(magic ^ 1, fp);
+  fclose(fp);
+  assert(rbtree_journal_open(snapshot, log, 64) == NULL);
+  fp = fopen(log, "r+b");
+  fputc(magic, fp);
+  fclose(fp);
+  j = rbtree_journal_open(snapshot, log, 64);
+  assert(j != NULL);
+  check_journal_tree(j->tree, expected);
+  delete_rbtree_journal(j);
+
+  // snapshot이 깨졌으면 열지 않는다
+  fp = fopen(snapshot, "r+b");
+  fseek(fp, 200, SEEK_SET);
+  const int byte = fgetc(fp);
+  fseek(fp, 200, SEEK_SET);
+  fputc(byte ^ 1, fp);
+  fclose(fp);
+  assert(rbtree_journal_open(snapshot, log, 64) == NULL);
+
+  unlink(snapshot);
+  unlink(log);
+  rmdir(dir);
+  delete_rbtree(expected);
+}
+
+// persistent node의 search, color, size 조건. 잘못되면 -1, 아니면 black height
+static int pnode_traverse(const rbtree_pnode *p, const color_t parent_color, const key_t *lo, const key_t *hi) {
+  if (p == NULL) {
+    return 0;
+  }
+  if ((lo != NULL && p->key < *lo) || (hi != NULL && p->key > *hi) || p->refs == 0 ||
+      (parent_color == RBTREE_RED && p->color == RBTREE_RED)) {
+    return -1;
+  }
+  const size_t size = (p->left ? p->left->size : 0) + (p->right ? p->right->size : 0) + 1;
+  const int l = pnode_traverse(p->left, p->color, lo, &p->key);
+  const int r = pnode_traverse(p->right, p->color, &p->key, hi);
+  if (l < 0 || l != r || p->size != size) {
+    return -1;
+  }
+  return l + (p->color == RBTREE_BLACK);
+}
+
+static void check_persistent(const rbtree_persistent *t, const key_t *expected, const size_t n) {
+  assert(t->root == NULL || t->root->color == RBTREE_BLACK);
+  assert(pnode_traverse(t->root, RBTREE_BLACK, NULL, NULL) >= 0);
+  assert(rbtree_persistent_size(t) == n);
+  key_t *res = calloc(n + 1, sizeof(key_t));
+  rbtree_persistent_to_array(t, res, n);
+  assert(n == 0 || memcmp(res, expected, n * sizeof(key_t)) == 0);
+  free(res);
+}
+
+// snapshot은 뒤이은 insert/erase에 영향받지 않고, 고치는 쪽은 일반 rbtree와 같게 움직여야 한다
+void test_persistent(void) {
+  rbtree_persistent *t = new_rbtree_persistent();
+  assert(rbtree_persistent_min(t) == NULL && rbtree_persistent_erase(t, 1) == 0);
+
+  const size_t n = 2000, versions = 8;
+  rbtree_persistent *snapshots[8];
+  key_t *expected[8];
+  size_t sizes[8];
+  rbtree *ref = new_rbtree();
+  srand(23);
+  for (size_t v = 0; v < versions; v++) {
+    for (size_t i = 0; i < n / versions; i++) {
+      const key_t key = rand() % 300;
+      if (rand() % 3 == 0) {
+        node_t *p = rbtree_find(ref, key);
+        assert(rbtree_persistent_erase(t, key) == (p != NULL));
+        if (p != NULL) {
+          rbtree_erase(ref, p);
+        }
+      }
+      else {
+        rbtree_persistent_insert(t, key);
+        rbtree_insert(ref, key);
+      }
+    }
+    sizes[v] = rbtree_size(ref);
+    expected[v] = calloc(sizes[v] + 1, sizeof(key_t));
+    rbtree_to_array(ref, expected[v], sizes[v]);
+    check_persistent(t, expected[v], sizes[v]);
+    snapshots[v] = rbtree_snapshot(t);
+    assert(snapshots[v]->root == t->root);
+  }
+  for (size_t v = 0; v < versions; v++) {
+    check_persistent(snapshots[v], expected[v], sizes[v]);
+  }
+
+  // snapshot에서 갈라져 나간 쪽을 고쳐도 원래 쪽은 그대로이다
+  rbtree_persistent *branch = rbtree_snapshot(snapshots[0]);
+  for (key_t key = 0; key < 300; key++) {
+    while (rbtree_persistent_erase(branch, key)) {
+    }
+  }
+  check_persistent(branch, NULL, 0);
+  check_persistent(snapshots[0], expected[0], sizes[0]);
+  assert(rbtree_persistent_min(t)->key == expected[versions - 1][0]);
+  assert(rbtree_persistent_max(t)->key == expected[versions - 1][sizes[versions - 1] - 1]);
+  assert(rbtree_persistent_rank(t, 150) == rbtree_rank(ref, 150));
+  assert((rbtree_persistent_find(t, 150) == NULL) == (rbtree_find(ref, 150) == NULL));
+
+  delete_rbtree_persistent(branch);
+  for (size_t v = 0; v < versions; v++) {
+    delete_rbtree_persistent(snapshots[v]);
+    free(expected[v]);
+  }
+  delete_rbtree_persistent(t);
+  delete_rbtree(ref);
+}
+
+// sharded tree는 shard를 나누고 합쳐도 하나의 rbtree와 같은 내용을 보여야 한다
+void test_sharded(void) {
+  rbtree_sharded *s = new_rbtree_sharded(4, 0, 999);
+  key_t min, max;
+  assert(rbtree_sharded_count(s) == 4);
+  assert(!rbtree_sharded_min(s, &min) && !rbtree_sharded_max(s, &max));
+
+  // 모든 key가 첫 shard에 몰리도록 넣는다
+  const size_t n = 1000;
+  key_t *keys = calloc(n, sizeof(key_t));
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = (key_t)((i * 37) % n) - 2000;
+    rbtree_sharded_insert(s, keys[i]);
+  }
+  rbtree_sharded_insert(s, 5000);
+  assert(rbtree_sharded_size(s) == n + 1);
+  assert(rbtree_sharded_rebalance(s) > 0);
+  assert(rbtree_sharded_count(s) > 4);
+  assert(rbtree_sharded_size(s) == n + 1);
+
+  rbtree_sharded_to_array(s, arr, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == (key_t)i - 2000);
+  }
+  assert(rbtree_sharded_min(s, &min) && min == -2000);
+  assert(rbtree_sharded_max(s, &max) && max == 5000);
+  assert(rbtree_sharded_find(s, -1500) && !rbtree_sharded_find(s, -999));
+  assert(rbtree_sharded_range_count(s, -1010, 6000) == 11);
+  assert(rbtree_sharded_range_to_array(s, -1010, 6000, arr, n) == 11);
+  assert(arr[0] == -1010 && arr[9] == -1001 && arr[10] == 5000);
+  key_t bound;
+  assert(rbtree_sharded_lower_bound(s, -1000, &bound) && bound == 5000);
+
+  // 지워서 식은 shard는 다시 합쳐진다
+  for (size_t i = 0; i < n; i++) {
+    assert(rbtree_sharded_erase(s, keys[i]) == 1);
+  }
+  assert(rbtree_sharded_erase(s, keys[0]) == 0);
+  const size_t before = rbtree_sharded_count(s);
+  rbtree_sharded_rebalance(s);
+  rbtree_sharded_insert(s, 1);
+  rbtree_sharded_rebalance(s);
+  assert(rbtree_sharded_count(s) < before);
+  assert(rbtree_sharded_size(s) == 2);
+  assert(rbtree_sharded_min(s, &min) && min == 1);
+  delete_rbtree_sharded(s);
+  free(keys);
+  free(arr);
+}
+
+#define SHARDED_WRITERS 4
+#define SHARDED_KEYS_PER_WRITER 5000
+
+typedef struct {
+  rbtree_sharded *s;
+  int id;
+} sharded_writer_t;
+
+static void *sharded_writer(void *arg) {
+  const sharded_writer_t *w = (const sharded_writer_t *)arg;
+  for (int i = 0; i < SHARDED_KEYS_PER_WRITER; i++) {
+    const key_t key = i * SHARDED_WRITERS + w->id;
+    rbtree_sharded_insert(w->s, key);
+    // rebalance가 shard를 나누고 합치는 사이에도 방금 넣은 key는 보여야 한다
+    rbtree_sharded_insert(w->s, -1 - key);
+    assert(rbtree_sharded_find(w->s, key) && rbtree_sharded_erase(w->s, -1 - key) == 1);
+    if (i % 1000 == 0) {
+      rbtree_sharded_rebalance(w->s);
+    }
+  }
+  return NULL;
+}
+
+// 여러 writer가 rebalance와 섞여 넣어도 빠지는 key가 없어야 한다
+void test_sharded_writers(void) {
+  rbtree_sharded *s = new_rbtree_sharded(2, 0, SHARDED_WRITERS * SHARDED_KEYS_PER_WRITER - 1);
+  pthread_t threads[SHARDED_WRITERS];
+  sharded_writer_t writers[SHARDED_WRITERS];
+  for (int i = 0; i < SHARDED_WRITERS; i++) {
+    writers[i] = (sharded_writer_t){s, i};
+    assert(pthread_create(&threads[i], NULL, sharded_writer, &writers[i]) == 0);
+  }
+  for (int i = 0; i < SHARDED_WRITERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  const size_t n = SHARDED_WRITERS * SHARDED_KEYS_PER_WRITER;
+  assert(rbtree_sharded_size(s) == n);
+  key_t *arr = calloc(n, sizeof(key_t));
+  rbtree_sharded_to_array(s, arr, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == (key_t)i);
+  }
+  free(arr);
+  delete_rbtree_sharded(s);
+}
+
+#ifdef RBTREE_CONCURRENT
+// 짝수 key는 계속 남아 있고, writer는 그 사이에 홀수 key를 넣었다 뺐다 한다.
+// reader는 lock 없이 읽어도 짝수 key를 항상 찾아야 한다.
+#define CONCURRENT_EVENS 2000
+#define CONCURRENT_READERS 4
+
+typedef struct {
+  rbtree *t;
+  int done;
+  size_t failures;
+} concurrent_ctx_t;
+
+static void *concurrent_reader(void *arg) {
+  concurrent_ctx_t *ctx = (concurrent_ctx_t *)arg;
+  unsigned state = (unsigned)(uintptr_t)&state;
+  size_t failures = 0;
+  key_t buf[8];
+  while (!__atomic_load_n(&ctx->done, __ATOMIC_ACQUIRE)) {
+    state = state * 1103515245 + 12345;
+    const key_t even = (key_t)((state >> 8) % CONCURRENT_EVENS) * 2;
+    node_t *p = rbtree_find(ctx->t, even);
+    failures += (p == NULL);
+    p = rbtree_lower_bound(ctx->t, even);
+    failures += (p == NULL);
+    p = rbtree_min(ctx->t);
+    failures += (p == NULL || p->key != 0);
+    const size_t count = rbtree_range_to_array(ctx->t, even, even + 4, buf, 8);
+    size_t evens = 0;
+    for (size_t i = 0; i < count; i++) {
+      failures += (i > 0 && buf[i] <= buf[i - 1]);
+      evens += (buf[i] % 2 == 0);
+    }
+    failures += (evens != ((even + 4 < 2 * CONCURRENT_EVENS) ? 3 : (size_t)(2 * CONCURRENT_EVENS - even) / 2));
+  }
+  __atomic_fetch_add(&ctx->failures, failures, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+void test_concurrent(void) {
+  rbtree *t = new_rbtree();
+  for (key_t key = 0; key < 2 * CONCURRENT_EVENS; key += 2) {
+    rbtree_insert(t, key);
+  }
+  concurrent_ctx_t ctx = {t, 0, 0};
+  pthread_t readers[CONCURRENT_READERS];
+  for (int i = 0; i < CONCURRENT_READERS; i++) {
+    assert(pthread_create(&readers[i], NULL, concurrent_reader, &ctx) == 0);
+  }
+
+  key_t odds[CONCURRENT_EVENS];
+  for (int i = 0; i < CONCURRENT_EVENS; i++) {
+    odds[i] = (key_t)((i * 7919) % CONCURRENT_EVENS) * 2 + 1;
+  }
+  for (int round = 0; round < 20; round++) {
+    if (round % 2 == 0) {
+      for (int i = 0; i < CONCURRENT_EVENS; i++) {
+        rbtree_insert(t, odds[i]);
+      }
+      for (int i = 0; i < CONCURRENT_EVENS; i++) {
+        rbtree_erase(t, rbtree_find(t, odds[i]));
+      }
+    }
+    else {
+      // 큰 batch는 tree를 통째로 다시 연결한다
+      rbtree_insert_batch(t, odds, CONCURRENT_EVENS);
+      assert(rbtree_erase_batch(t, odds, CONCURRENT_EVENS) == CONCURRENT_EVENS);
+    }
+  }
+  __atomic_store_n(&ctx.done, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < CONCURRENT_READERS; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  assert(ctx.failures == 0);
+  test_color_constraint(t);
+  test_size_constraint(t);
+  assert(rbtree_size(t) == CONCURRENT_EVENS);
+  delete_rbtree(t);
+}
+#endif
+
+// index link mode에는 intrusive API가 없다
+#ifndef RBTREE_INDEX_LINKS
+typedef struct {
+  int id;
+  int payload;
+  rb_link link;
+} record_t;
+
+static int record_cmp(const rb_link *a, const rb_link *b) {
+  const int ia = rbtree_entry(a, record_t, link)->id;
+  const int ib = rbtree_entry(b, record_t, link)->id;
+  return (ia > ib) - (ia < ib);
+}
+
+static int record_key_cmp(const void *key, const rb_link *b) {
+  const int ia = *(const int *)key;
+  const int ib = rbtree_entry(b, record_t, link)->id;
+  return (ia > ib) - (ia < ib);
+}
+
+// intrusive links should order the user's records without the tree allocating nodes
+void test_intrusive(void) {
+  const size_t n = 200;
+  record_t *records = calloc(n, sizeof(record_t));
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++) {
+    records[i].id = (int)((i * 37) % n);
+    records[i].payload = (int)i;
+    assert(rbtree_link_insert(t, &records[i].link, record_cmp) == &records[i].link);
+  }
+  assert(t->slabs == NULL);
+  test_color_constraint(t);
+  test_size_constraint(t);
+
+  for (int id = 0; id < (int)n; id += 3) {
+    rb_link *link = rbtree_link_find(t, &id, record_key_cmp);
+    assert(link != NULL && rbtree_entry(link, record_t, link)->id == id);
+    rbtree_link_remove(t, link);
+  }
+  int missing = 3;
+  assert(rbtree_link_find(t, &missing, record_key_cmp) == NULL);
+  assert(rbtree_entry(rbtree_link_lower_bound(t, &missing, record_key_cmp), record_t, link)->id == 4);
+  test_color_constraint(t);
+  test_size_constraint(t);
+
+  int prev = -1;
+  size_t count = 0;
+  for (node_t *p = rbtree_first(t); p != NULL; p = rbtree_next(t, p)) {
+    record_t *r = rbtree_entry(p, record_t, link);
+    assert(r->id > prev && r->id % 3 != 0);
+    assert(records[r->payload].id == r->id);
+    prev = r->id;
+    count++;
+  }
+  assert(count == rbtree_size(t));
+
+  delete_rbtree(t);
+  free(records);
+}
+#endif
+
 int main(void) {
   test_init();
   test_insert_single(1024);
@@ -320,5 +1948,34 @@ int main(void) {
   test_distinct_values();
   test_duplicate_values();
   test_multi_instance();
+  test_node_pool();
+  test_order_statistics();
+  test_range_query();
+  test_iterator();
+  test_build_sorted();
+  test_batch();
+  test_insert_hint();
+  test_pop_minmax();
+  test_count();
+  test_erase_range();
+  test_hash_index();
+  test_find_batch();
+  test_join_split();
+  test_to_array_parallel();
+  test_set_operations();
+  test_template();
+  test_stats();
+  test_frozen();
+  test_frozen_file();
+  test_journal();
+  test_persistent();
+  test_sharded();
+  test_sharded_writers();
+#ifdef RBTREE_CONCURRENT
+  test_concurrent();
+#endif
+#ifndef RBTREE_INDEX_LINKS
+  test_intrusive();
+#endif
   printf("Passed all tests!\n");
 }
\ No newline at end of file